@@ -1,20 +1,95 @@
 #define _XOPEN_SOURCE 500
+// For O_DIRECT
+#define _GNU_SOURCE
 #include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
+#ifdef _WIN32
+#include <io.h>
+#include <ws2tcpip.h>
+#else
+#include <netdb.h>
+#include <sys/socket.h>
+#endif
 #include "libs3.h"
 
 // Some Windows stuff
 #ifndef FOPEN_EXTRA_FLAGS
 #define FOPEN_EXTRA_FLAGS ""
 #endif
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+#ifdef _WIN32
+#define MKDIR(path) mkdir(path)
+#define SET_BINARY_MODE(fd) _setmode(fd, _O_BINARY)
+#define SLEEP_MS(ms) Sleep(ms)
+// rename() does not replace an existing file on Windows
+#define RENAME(from, to) \
+  (MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING) ? 0 : -1)
+#else
+#define MKDIR(path) mkdir(path, 0777)
+#define SET_BINARY_MODE(fd)
+#define SLEEP_MS(ms) usleep((ms) * 1000)
+#define RENAME(from, to) rename(from, to)
+#endif
+
+#ifdef _WIN32
+// mingw has no pread() or pwrite(); a positioned ReadFile() or WriteFile()
+// does the same, except that it also moves the file pointer, which nothing
+// here relies on for a file that is accessed by offset
+static ssize_t win_pread(int fd, void *buffer, size_t count, uint64_t offset)
+{
+  OVERLAPPED overlapped;
+  DWORD n;
+
+  memset(&overlapped, 0, sizeof(overlapped));
+  overlapped.Offset = (DWORD) offset;
+  overlapped.OffsetHigh = (DWORD) (offset >> 32);
+  if (!ReadFile((HANDLE) _get_osfhandle(fd), buffer, (DWORD) count, &n,
+          &overlapped)) {
+    if (GetLastError() == ERROR_HANDLE_EOF) {
+      return 0;
+    }
+    errno = EIO;
+    return -1;
+  }
+  return n;
+}
+
+static ssize_t win_pwrite(int fd, const void *buffer, size_t count,
+    uint64_t offset)
+{
+  OVERLAPPED overlapped;
+  DWORD n;
+
+  memset(&overlapped, 0, sizeof(overlapped));
+  overlapped.Offset = (DWORD) offset;
+  overlapped.OffsetHigh = (DWORD) (offset >> 32);
+  if (!WriteFile((HANDLE) _get_osfhandle(fd), buffer, (DWORD) count, &n,
+          &overlapped)) {
+    errno = EIO;
+    return -1;
+  }
+  return n;
+}
+
+#define pread win_pread
+#define pwrite win_pwrite
+#endif
 
 #define MULTIPART_CHUNK_SIZE (5<<20) //must larger than or equal to 5MB
 
@@ -27,6 +102,41 @@ static const char *secretAccessKeyG = "474b801062b34061aaf4f9c3af0ae4df";
 
 static int statusG = 0;
 static char errorDetailsG[4096] = { 0 };
+static int showResponsePropertiesG = 1;
+
+// S3 allows at most this many parts per multipart upload, and this program
+// passes part lengths to libs3 as int
+#define MULTIPART_MAX_PARTS 10000
+#define MULTIPART_MAX_PART_SIZE (1 << 30)
+
+// Tuning of the transfers made by this program.  libs3 owns its connections,
+// so socket buffers, TCP_NODELAY and the Expect: 100-continue policy cannot
+// be set from here; these are the knobs on this side of the data callbacks.
+typedef struct TransferOptions
+{
+  // Size of multipart upload parts; objects up to this size go in one PUT
+  uint64_t partSize;
+  // Size and number of the buffers between the data callbacks and the disk,
+  // per transfer
+  int ioBufferSize, ioBufferCount;
+  // Read upload sources with O_DIRECT
+  int directIo;
+  // Milliseconds between progress reports, 0 for none
+  int progressIntervalMs;
+  // Check downloads against the ETag and CRC32C of the object
+  int verify;
+} TransferOptions;
+
+// Options of every transfer that is not given its own
+static TransferOptions transferOptionsG =
+{
+  MULTIPART_CHUNK_SIZE,
+  1 << 20,
+  8,
+  0,
+  500,
+  0
+};
 
 typedef struct growbuffer
 {
@@ -39,6 +149,73 @@ typedef struct growbuffer
   struct growbuffer *prev, *next;
 } growbuffer;
 
+// libs3.dll allocates what it needs per request with its own malloc, which
+// cannot be hooked from here.  The buffers the sample takes per request
+// (growbuffer blocks, pack parts) are instead recycled through free lists;
+// these count how many had to be allocated and how many were reused, so
+// that --alloc-stats shows whether a warmed-up run still allocates.
+typedef struct AllocStats
+{
+  uint64_t allocated;
+  uint64_t reused;
+} AllocStats;
+
+static AllocStats allocStatsG;
+
+static void alloc_stats_count(int reused)
+{
+  __sync_fetch_and_add(reused ? &(allocStatsG.reused) :
+      &(allocStatsG.allocated), 1);
+}
+
+static void alloc_stats_print()
+{
+  fprintf(stderr, "Buffers: %llu allocated, %llu reused\n",
+      (unsigned long long) allocStatsG.allocated,
+      (unsigned long long) allocStatsG.reused);
+}
+
+// Freed growbuffer blocks, kept for the next growbuffer_append() up to
+// GROWBUFFER_FREE_MAX of them
+#define GROWBUFFER_FREE_MAX 64
+
+static growbuffer *growbufferFreeG;
+static int growbufferFreeCountG;
+static pthread_mutex_t growbufferFreeMutexG = PTHREAD_MUTEX_INITIALIZER;
+
+static growbuffer *growbuffer_block_alloc()
+{
+  growbuffer *buf;
+
+  pthread_mutex_lock(&growbufferFreeMutexG);
+  if ((buf = growbufferFreeG)) {
+    growbufferFreeG = buf->next;
+    growbufferFreeCountG--;
+  }
+  pthread_mutex_unlock(&growbufferFreeMutexG);
+
+  if (buf) {
+    alloc_stats_count(1);
+    return buf;
+  }
+  alloc_stats_count(0);
+  return (growbuffer *) malloc(sizeof(growbuffer));
+}
+
+static void growbuffer_block_free(growbuffer *buf)
+{
+  pthread_mutex_lock(&growbufferFreeMutexG);
+  if (growbufferFreeCountG < GROWBUFFER_FREE_MAX) {
+    buf->next = growbufferFreeG;
+    growbufferFreeG = buf;
+    growbufferFreeCountG++;
+    buf = 0;
+  }
+  pthread_mutex_unlock(&growbufferFreeMutexG);
+
+  free(buf);
+}
+
 typedef struct UploadManager{
   //used for initial multipart
   char * upload_id;
@@ -59,7 +236,7 @@ static int growbuffer_append(growbuffer **gb, const char *data, int dataLen)
   while (dataLen) {
     growbuffer *buf = *gb ? (*gb)->prev : 0;
     if (!buf || (buf->size == sizeof(buf->data))) {
-      buf = (growbuffer *) malloc(sizeof(growbuffer));
+      buf = growbuffer_block_alloc();
       if (!buf) {
         return 0;
       }
@@ -116,7 +293,7 @@ static void growbuffer_read(growbuffer **gb, int amt, int *amtReturn,
       buf->prev->next = buf->next;
       buf->next->prev = buf->prev;
     }
-    free(buf);
+    growbuffer_block_free(buf);
   }
 }
 
@@ -126,7 +303,7 @@ static void growbuffer_destroy(growbuffer *gb)
 
   while (gb) {
     growbuffer *next = gb->next;
-    free(gb);
+    growbuffer_block_free(gb);
     gb = (next == start) ? 0 : next;
   }
 }
@@ -161,6 +338,10 @@ static S3Status responsePropertiesCallback(const S3ResponseProperties *propertie
 {
   (void) callbackData;
 
+  if (!showResponsePropertiesG) {
+    return S3StatusOK;
+  }
+
 #define print_nonnull(name, field)                                 \
   do {                                                           \
     if (properties-> field) {                                  \
@@ -235,354 +416,9521 @@ static void responseCompleteCallback(S3Status status,
   }
 }
 
-typedef struct put_object_callback_data
+// Milliseconds since the epoch, for measuring request latencies
+static int64_t current_time_ms()
 {
-  FILE *infile;
-  uint64_t contentLength, originalContentLength;
-} put_object_callback_data;
+  struct timeval now;
 
-static int putObjectDataCallback(int bufferSize, char *buffer,
-    void *callbackData)
-{
-  put_object_callback_data *data = 
-    (put_object_callback_data *) callbackData;
+  gettimeofday(&now, 0);
+  return (((int64_t) now.tv_sec) * 1000) + (now.tv_usec / 1000);
+}
 
-  int ret = 0;
+// Reads the next line of in into line, which holds size bytes, without its
+// line ending.  Returns its length, or -1 at the end of the input.  A line
+// too long for line is consumed whole and its length is returned as size,
+// with only its start in line, so that it is rejected rather than split.
+static int read_line(FILE *in, char *line, int size)
+{
+  int len, c, overflow = 0;
 
-  if (data->contentLength) {
-    int toRead = ((data->contentLength > (unsigned) bufferSize) ?
-        (unsigned) bufferSize : data->contentLength);
-    if (data->infile) {
-      ret = fread(buffer, 1, toRead, data->infile);
+  if (!fgets(line, size, in)) {
+    return -1;
+  }
+  len = strlen(line);
+  if ((len == (size - 1)) && (line[len - 1] != '\n')) {
+    while (((c = getc(in)) != EOF) && (c != '\n')) {
+      overflow = 1;
     }
   }
-
-  data->contentLength -= ret;
-
-  if (data->contentLength) {
-    // Avoid a weird bug in MingW, which won't print the second integer
-    // value properly when it's in the same call, so print separately
-    printf("%llu bytes remaining ", 
-        (unsigned long long) data->contentLength);
-    printf("(%d%% complete) ...\n",
-        (int) (((data->originalContentLength - 
-              data->contentLength) * 100) /
-          data->originalContentLength));
+  while (len && ((line[len - 1] == '\n') || (line[len - 1] == '\r'))) {
+    line[--len] = 0;
   }
-
-  return ret;
+  return overflow ? size : len;
 }
 
-typedef struct MultipartPartData {
-  put_object_callback_data put_object_data;
-  int seq;
-  UploadManager * manager;
-} MultipartPartData;
+// Returns nonzero if name, a key or a path appended to a directory, names
+// something below that directory: it is not absolute and no component of it
+// is ".."
+static int path_is_relative_below(const char *name)
+{
+  const char *component = name;
 
-static S3Status initial_multipart_callback(const char * upload_id, void * callbackData) {
-  UploadManager *manager = (UploadManager *) callbackData;
-  manager->upload_id = strdup(upload_id);
-  return S3StatusOK;
+  if (!name[0] || (name[0] == '/')) {
+    return 0;
+  }
+#ifdef _WIN32
+  if (strchr(name, '\\') || strchr(name, ':')) {
+    return 0;
+  }
+#endif
+  while (component) {
+    if (!strncmp(component, "..", 2) &&
+        ((component[2] == '/') || !component[2])) {
+      return 0;
+    }
+    if ((component = strchr(component, '/'))) {
+      component++;
+    }
+  }
+  return 1;
 }
 
-static S3Status MultipartResponseProperiesCallback(const S3ResponseProperties *properties, void *callbackData) {
+// Some requests are issued many at a time through one S3RequestContext; a
+// RequestPipeline bounds how many of them are in flight at once.  Every
+// request added to the pipeline must call pipeline_release() from its
+// complete callback.
+//
+// libs3 keeps the curl handles of up to REQUEST_HANDLE_CACHE_SIZE finished
+// requests for the next ones; a cached handle keeps its connection open and,
+// over HTTPS, its TLS session, so that a new connection from it resumes the
+// session instead of doing a full handshake.  Requests beyond that many in
+// flight get handles that are discarded with both when they finish.
+typedef struct RequestPipeline
+{
+  S3RequestContext *context;
+  // The number of requests allowed in flight at the same time
+  int maxInFlight;
+  // The number of requests added to the context and not yet completed
+  int inFlight;
+} RequestPipeline;
 
-  responsePropertiesCallback(properties, callbackData);
-  MultipartPartData * data = (MultipartPartData*) callbackData;
-  int seq = data->seq;
-  const char *etag = properties->eTag;
-  data->manager->etags[seq - 1] = strdup(etag);
-  data->manager->next_etags_pos = seq;
-  return S3StatusOK;
+// REQUEST_STACK_SIZE in libs3's request.c
+#define REQUEST_HANDLE_CACHE_SIZE 32
+
+// Over HTTPS maxInFlight is limited to REQUEST_HANDLE_CACHE_SIZE, since every
+// request past it pays a full TLS handshake.
+static S3Status pipeline_create(RequestPipeline *pipeline, int maxInFlight)
+{
+  if ((protocolG == S3ProtocolHTTPS) &&
+      (maxInFlight > REQUEST_HANDLE_CACHE_SIZE)) {
+    fprintf(stderr, "Limiting parallel to %d so that TLS sessions are "
+        "reused\n", REQUEST_HANDLE_CACHE_SIZE);
+    maxInFlight = REQUEST_HANDLE_CACHE_SIZE;
+  }
+  pipeline->maxInFlight = (maxInFlight > 0) ? maxInFlight : 1;
+  pipeline->inFlight = 0;
+  pipeline->context = 0;
+  return S3_create_request_context(&(pipeline->context));
 }
 
-static int multipartPutXmlCallback(int bufferSize, char *buffer, void *callbackData) {
-  UploadManager * manager = (UploadManager*)callbackData;
-  int ret = 0;
-  if (manager->remaining) {
-    int toRead = ((manager->remaining > bufferSize) ?
-        bufferSize : manager->remaining);
-    growbuffer_read(&(manager->gb), toRead, &ret, buffer);
+static void pipeline_destroy(RequestPipeline *pipeline)
+{
+  if (pipeline->context) {
+    S3_destroy_request_context(pipeline->context);
+    pipeline->context = 0;
   }
-  manager->remaining -= ret;
-  return ret;
 }
 
-static void put_object(const char *filename, const char *bucketName, const char *key)
+// Blocks for at most maxWaitMs until some request of the context has I/O
+// ready, then lets libs3 process it and sets remaining to the number of
+// requests still running.
+static S3Status request_context_poll(S3RequestContext *context, int maxWaitMs,
+    int *remaining)
 {
-  uint64_t contentLength = 0;
-  const char *cacheControl = 0, *contentType = 0, *md5 = 0;
-  const char *contentDispositionFilename = 0, *contentEncoding = 0;
-  int64_t expires = -1;
-  S3CannedAcl cannedAcl = S3CannedAclPublicRead;
-  int metaPropertiesCount = 0;
-  S3NameValue metaProperties[S3_MAX_METADATA_COUNT];
-  char useServerSideEncryption = 0;
+  fd_set readFdSet, writeFdSet, exceptFdSet;
+  int maxFd = -1;
+  S3Status status;
 
-  put_object_callback_data data;
-  data.infile = -1;
-  if (filename) {
-    if (!contentLength) {
-      struct stat statbuf;
-      // Stat the file to get its length
-      if (stat(filename, &statbuf) == -1) {
-        fprintf(stderr, "\nERROR: Failed to stat file %s: ",
-            filename);
-        perror(0);
-        exit(-1);
-      }
-      contentLength = statbuf.st_size;
+  FD_ZERO(&readFdSet);
+  FD_ZERO(&writeFdSet);
+  FD_ZERO(&exceptFdSet);
+
+  if ((status = S3_get_request_context_fdsets(context, &readFdSet,
+          &writeFdSet, &exceptFdSet, &maxFd)) != S3StatusOK) {
+    return status;
+  }
+
+  int64_t timeout = S3_get_request_context_timeout(context);
+  if ((timeout < 0) || (timeout > maxWaitMs)) {
+    timeout = maxWaitMs;
+  }
+
+  if (timeout > 0) {
+    if (maxFd < 0) {
+      // No socket yet while resolving or connecting; Winsock fails a select()
+      // on empty sets at once instead of waiting
+      SLEEP_MS(timeout);
     }
-    // Open the file
-    if (!(data.infile = fopen(filename, "r" FOPEN_EXTRA_FLAGS))) {
-      fprintf(stderr, "\nERROR: Failed to open input file %s: ",
-          filename);
-      perror(0);
-      exit(-1);
+    else {
+      struct timeval tv = { timeout / 1000, (timeout % 1000) * 1000 };
+      select(maxFd + 1, &readFdSet, &writeFdSet, &exceptFdSet, &tv);
     }
   }
-  data.contentLength = data.originalContentLength = contentLength;
-
-  S3_init();
 
-  S3BucketContext bucketContext =
-  {
-    0,
-    bucketName,
-    protocolG,
-    uriStyleG,
-    accessKeyIdG,
-    secretAccessKeyG,
-    0
-  };
+  return S3_runonce_request_context(context, remaining);
+}
 
-  S3PutProperties putProperties =
-  {
-    contentType,
-    md5,
-    cacheControl,
-    contentDispositionFilename,
-    contentEncoding,
-    expires,
-    cannedAcl,
-    metaPropertiesCount,
-    metaProperties,
-    useServerSideEncryption
-  };
+// Polls the context of the pipeline as request_context_poll() does.  Returns
+// zero if the context failed.
+static int pipeline_poll(RequestPipeline *pipeline, int maxWaitMs)
+{
+  int remaining = 0;
+  S3Status status;
 
-  if (contentLength <= MULTIPART_CHUNK_SIZE) {
-    S3PutObjectHandler putObjectHandler =
-    {
-      { &responsePropertiesCallback, &responseCompleteCallback },
-      &putObjectDataCallback
-    };
+  if ((status = request_context_poll(pipeline->context, maxWaitMs,
+          &remaining)) != S3StatusOK) {
+    statusG = status;
+    return 0;
+  }
 
-    S3_put_object(&bucketContext, key, contentLength, &putProperties, 0,
-        &putObjectHandler, &data);
+  return 1;
+}
 
-    if (data.infile) {
-      fclose(data.infile);
-      data.infile = -1;
+// Drives the pipeline until at most limit requests are still in flight.
+// Returns zero if the context failed.
+static int pipeline_wait(RequestPipeline *pipeline, int limit)
+{
+  while (pipeline->inFlight > limit) {
+    if (!pipeline_poll(pipeline, 100)) {
+      return 0;
     }
+  }
 
-    if (statusG != S3StatusOK) {
-      printError();
-    }
-    else if (data.contentLength) {
-      fprintf(stderr, "\nERROR: Failed to read remaining %llu bytes from "
-          "input\n", (unsigned long long) data.contentLength);
-    }
+  return 1;
+}
+
+// Waits for a free slot and claims it for a request that the caller is about
+// to add to pipeline->context.  Returns zero if the context failed.
+static int pipeline_acquire(RequestPipeline *pipeline)
+{
+  if (!pipeline_wait(pipeline, pipeline->maxInFlight - 1)) {
+    return 0;
   }
-  else {
-    UploadManager manager;
-    manager.upload_id = 0;
-    manager.gb = 0;
+  pipeline->inFlight++;
+  return 1;
+}
 
-    //div round up
-    int seq;
-    int totalSeq = (contentLength + MULTIPART_CHUNK_SIZE- 1)/ MULTIPART_CHUNK_SIZE;
+static void pipeline_release(RequestPipeline *pipeline)
+{
+  pipeline->inFlight--;
+}
 
-    MultipartPartData partData;
-    int partContentLength = 0;
+// The requests run by a RequestGuard can be profiled, to tell the time our
+// own callbacks take from the time libs3 and libcurl spend building, signing
+// and parsing requests and from the time spent waiting on the network.  The
+// guard drives its request on the calling thread, so the CPU time of that
+// thread over the request, less that of the callbacks, is the library's, and
+// the wall time left over is waiting.  A callback that runs for stallMs or
+// more holds up the transfer and is reported as a stall.  With a trace file,
+// requests, stalls and callbacks of PROFILE_TRACE_MIN_US or more are written
+// to it as Chrome trace events (load it in chrome://tracing or Perfetto).
+#define PROFILE_DEFAULT_STALL_MS 100
+#define PROFILE_TRACE_MIN_US 1000
 
-    S3MultipartInitialHander handler = {
-      {
-        &responsePropertiesCallback,
-        &responseCompleteCallback
-      },
-      &initial_multipart_callback    
-    };
+typedef struct Profiler
+{
+  pthread_mutex_t mutex;
+  int enabled;
+  int stallMs;
+  FILE *trace;
+  int traceEvents;
+  // Trace thread ids handed out, one per guard
+  int threads;
+  int64_t originUs;
+  uint64_t requests, callbacks, stalls;
+  int64_t wallUs, callbackUs, callbackCpuUs, libraryCpuUs, waitUs;
+} Profiler;
 
-    S3PutObjectHandler putObjectHandler = {
-      {
-        &MultipartResponseProperiesCallback,
-        &responseCompleteCallback
-      },
-      &putObjectDataCallback
-    };
+// The profile of the request a guard is running
+typedef struct RequestProfile
+{
+  const char *operation, *key;
+  int thread;
+  // When the request started, in wall and thread CPU time
+  int64_t startUs, startCpuUs;
+  // Time spent in our callbacks so far
+  int64_t callbackUs, callbackCpuUs;
+  int callbacks;
+} RequestProfile;
 
-    S3MultipartCommitHandler commit_handler = {
-      {
-        &responsePropertiesCallback,
-        &responseCompleteCallback
-      },
-      &multipartPutXmlCallback,
-      0
-    };
+// When a callback started
+typedef struct ProfileMark
+{
+  int64_t us, cpuUs;
+} ProfileMark;
 
-    manager.etags = (char**)malloc(sizeof(char*) * totalSeq);
-    manager.next_etags_pos = 0;
+static Profiler profilerG = { .mutex = PTHREAD_MUTEX_INITIALIZER };
 
-    S3_initiate_multipart(&bucketContext,key,0, &handler,0, &manager);
-    if (manager.upload_id == 0 || statusG != S3StatusOK) {
-      printError();
-      goto clean;
-    }
+static int64_t monotonic_us()
+{
+  struct timespec now;
 
-    for(seq = manager.next_etags_pos+1 ; seq <= totalSeq ; seq ++) {
-      memset(&partData, 0, sizeof(MultipartPartData));
-      partData.manager = &manager;
-      partData.seq = seq;
-      partData.put_object_data = data;
-      partContentLength = (contentLength > MULTIPART_CHUNK_SIZE)?MULTIPART_CHUNK_SIZE:contentLength;
-      printf("Sending Part Seq %d, length=%d\n", seq, partContentLength);
-      partData.put_object_data.contentLength = partContentLength;
-      putProperties.md5 = 0;
-      S3_upload_part(&bucketContext, key, &putProperties, &putObjectHandler, seq, manager.upload_id, partContentLength,0, &partData);
-      if (statusG != S3StatusOK) {
-        printError();
-        goto clean;
-      }
-      contentLength -= MULTIPART_CHUNK_SIZE;
-    }
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (((int64_t) now.tv_sec) * 1000000) + (now.tv_nsec / 1000);
+}
 
-    int i;
-    int size = 0;
-    size += growbuffer_append(&(manager.gb), "<CompleteMultipartUpload>", strlen("<CompleteMultipartUpload>"));
-    char buf[256];
-    int n;
-    for(i=0;i<totalSeq;i++) {
-      n = snprintf(buf,256,"<Part><PartNumber>%d</PartNumber><ETag>%s</ETag></Part>",
-          i + 1,manager.etags[i]);
-      size += growbuffer_append(&(manager.gb), buf, n);
-    }
-    size += growbuffer_append(&(manager.gb), "</CompleteMultipartUpload>",strlen("</CompleteMultipartUpload>"));
-    manager.remaining = size;
+static int64_t thread_cpu_us()
+{
+  struct timespec now;
 
-    S3_complete_multipart_upload(&bucketContext, key, &commit_handler, manager.upload_id, manager.remaining, 0,  &manager); 
-    if (statusG != S3StatusOK) {
-      printError();
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+  return (((int64_t) now.tv_sec) * 1000000) + (now.tv_nsec / 1000);
+}
+
+static void trace_string(FILE *trace, const char *string)
+{
+  fputc('"', trace);
+  for (; string && *string; string++) {
+    unsigned char c = (unsigned char) *string;
+    if ((c == '"') || (c == '\\')) {
+      fprintf(trace, "\\%c", c);
+    }
+    else if (c < 0x20) {
+      fprintf(trace, "\\u%04x", c);
+    }
+    else {
+      fputc(c, trace);
+    }
+  }
+  fputc('"', trace);
+}
+
+// Starts a trace event; the caller adds its args and closes it.  Called with
+// the mutex held.
+static void trace_event(const char *name, const char *category, int thread,
+    int64_t startUs, int64_t durationUs)
+{
+  FILE *trace = profilerG.trace;
+
+  fprintf(trace, "%s\n{\"name\":", profilerG.traceEvents++ ? "," : "");
+  trace_string(trace, name);
+  fprintf(trace, ",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+      "\"ts\":%lld,\"dur\":%lld,\"args\":{", category, thread,
+      (long long) (startUs - profilerG.originUs), (long long) durationUs);
+}
+
+static void profile_request_begin(RequestProfile *profile,
+    const char *operation, const char *key)
+{
+  if (!profilerG.enabled) {
+    return;
+  }
+  if (!profile->thread) {
+    pthread_mutex_lock(&(profilerG.mutex));
+    profile->thread = ++profilerG.threads;
+    if (profilerG.trace) {
+      fprintf(profilerG.trace, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\","
+          "\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"requests %d\"}}",
+          profilerG.traceEvents++ ? "," : "", profile->thread,
+          profile->thread);
+    }
+    pthread_mutex_unlock(&(profilerG.mutex));
+  }
+  profile->operation = operation;
+  profile->key = key;
+  profile->startUs = monotonic_us();
+  profile->startCpuUs = thread_cpu_us();
+  profile->callbackUs = profile->callbackCpuUs = 0;
+  profile->callbacks = 0;
+}
+
+static void profile_callback_begin(ProfileMark *mark)
+{
+  if (profilerG.enabled) {
+    mark->us = monotonic_us();
+    mark->cpuUs = thread_cpu_us();
+  }
+}
+
+// Accounts for the callback started at mark, named for what it does
+static void profile_callback_end(RequestProfile *profile,
+    const ProfileMark *mark, const char *callback)
+{
+  if (!profilerG.enabled) {
+    return;
+  }
+
+  int64_t us = monotonic_us() - mark->us;
+  int64_t cpuUs = thread_cpu_us() - mark->cpuUs;
+  int stall = (us >= (((int64_t) profilerG.stallMs) * 1000));
+
+  profile->callbackUs += us;
+  profile->callbackCpuUs += cpuUs;
+  profile->callbacks++;
+  if (stall) {
+    fprintf(stderr, "WARNING: %s %s callback of %s blocked for %lld ms "
+        "(%lld ms CPU)\n", profile->operation, callback,
+        profile->key ? profile->key : "", (long long) (us / 1000),
+        (long long) (cpuUs / 1000));
+  }
+  if (!stall && (!profilerG.trace || (us < PROFILE_TRACE_MIN_US))) {
+    return;
+  }
+
+  pthread_mutex_lock(&(profilerG.mutex));
+  if (stall) {
+    profilerG.stalls++;
+  }
+  if (profilerG.trace) {
+    trace_event(callback, stall ? "stall" : "callback", profile->thread,
+        mark->us, us);
+    fprintf(profilerG.trace, "\"cpu_us\":%lld}}", (long long) cpuUs);
+  }
+  pthread_mutex_unlock(&(profilerG.mutex));
+}
+
+static void profile_request_end(RequestProfile *profile, S3Status status)
+{
+  if (!profilerG.enabled) {
+    return;
+  }
+
+  int64_t wallUs = monotonic_us() - profile->startUs;
+  int64_t libraryCpuUs = thread_cpu_us() - profile->startCpuUs -
+    profile->callbackCpuUs;
+  if (libraryCpuUs < 0) {
+    libraryCpuUs = 0;
+  }
+  int64_t waitUs = wallUs - profile->callbackUs - libraryCpuUs;
+  if (waitUs < 0) {
+    waitUs = 0;
+  }
+
+  pthread_mutex_lock(&(profilerG.mutex));
+  profilerG.requests++;
+  profilerG.callbacks += profile->callbacks;
+  profilerG.wallUs += wallUs;
+  profilerG.callbackUs += profile->callbackUs;
+  profilerG.callbackCpuUs += profile->callbackCpuUs;
+  profilerG.libraryCpuUs += libraryCpuUs;
+  profilerG.waitUs += waitUs;
+  if (profilerG.trace) {
+    FILE *trace = profilerG.trace;
+    trace_event(profile->operation, "request", profile->thread,
+        profile->startUs, wallUs);
+    fprintf(trace, "\"key\":");
+    trace_string(trace, profile->key);
+    fprintf(trace, ",\"status\":\"%s\",\"callbacks\":%d,\"callback_us\":%lld,"
+        "\"callback_cpu_us\":%lld,\"library_cpu_us\":%lld,\"wait_us\":%lld}}",
+        S3_get_status_name(status), profile->callbacks,
+        (long long) profile->callbackUs, (long long) profile->callbackCpuUs,
+        (long long) libraryCpuUs, (long long) waitUs);
+  }
+  pthread_mutex_unlock(&(profilerG.mutex));
+}
+
+static void profiler_finish()
+{
+  Profiler *profiler = &profilerG;
+  double wallMs = profiler->wallUs / 1000.0;
+
+  if (profiler->trace) {
+    fprintf(profiler->trace, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    fclose(profiler->trace);
+    profiler->trace = 0;
+  }
+  profiler->enabled = 0;
+
+  fprintf(stderr, "%llu requests, %.0f ms:\n",
+      (unsigned long long) profiler->requests, wallMs);
+  if (!profiler->requests) {
+    return;
+  }
+  fprintf(stderr, "  %.0f ms (%.1f%%) in %llu callbacks, %.0f ms of it CPU\n",
+      profiler->callbackUs / 1000.0,
+      wallMs ? (100 * profiler->callbackUs / 1000.0 / wallMs) : 0,
+      (unsigned long long) profiler->callbacks,
+      profiler->callbackCpuUs / 1000.0);
+  fprintf(stderr, "  %.0f ms (%.1f%%) of library CPU\n",
+      profiler->libraryCpuUs / 1000.0,
+      wallMs ? (100 * profiler->libraryCpuUs / 1000.0 / wallMs) : 0);
+  fprintf(stderr, "  %.0f ms (%.1f%%) waiting\n", profiler->waitUs / 1000.0,
+      wallMs ? (100 * profiler->waitUs / 1000.0 / wallMs) : 0);
+  fprintf(stderr, "  %llu callbacks blocked for %d ms or more\n",
+      (unsigned long long) profiler->stalls, profiler->stallMs);
+}
+
+// Turns profiling on, reporting when the program exits.  trace, if not null,
+// is the file to write trace events to.  Returns zero if it can't be created.
+static int profiler_start(const char *trace)
+{
+  if (trace && !profilerG.trace) {
+    if (!(profilerG.trace = fopen(trace, "w"))) {
+      return 0;
+    }
+    fprintf(profilerG.trace, "{\"traceEvents\":[");
+  }
+  if (!profilerG.stallMs) {
+    profilerG.stallMs = PROFILE_DEFAULT_STALL_MS;
+  }
+  if (!profilerG.enabled) {
+    profilerG.enabled = 1;
+    profilerG.originUs = monotonic_us();
+    atexit(&profiler_finish);
+  }
+  return 1;
+}
+
+// Once libs3 has started a request, the only way to stop it is to fail one of
+// its callbacks, and none is made while the request waits to connect or for
+// the server.  A RequestGuard runs requests on a request context of its own
+// instead, driving it in short steps so that deadlines and a cancel flag are
+// checked in between.  Destroying the context stops the request in whatever
+// phase it is, and libs3 then completes it with S3StatusInterrupted.  The
+// context is kept from one request to the next so that its connection stays
+// open, and replaced only after an interruption.  A guard is used by one
+// thread at a time.
+#define GUARD_TICK_MS 50
+
+// Limits in milliseconds, zero for none
+typedef struct RequestDeadline
+{
+  // Until the request first calls back: it is connected and its headers
+  // are sent (for a GET the response has started too)
+  int connectMs;
+  // Until the response headers arrive, counted from the last upload
+  // progress, so that an upload is not limited by the time its body takes
+  int firstByteMs;
+  // Until the request completes
+  int totalMs;
+  // Once started, a request that moves fewer than lowSpeedBytes in any
+  // lowSpeedMs is stopped
+  int lowSpeedBytes, lowSpeedMs;
+} RequestDeadline;
+
+// Set from any thread, or from a signal handler, to stop the requests of
+// every guard that shares it
+typedef struct RequestCancel
+{
+  volatile int cancelled;
+} RequestCancel;
+
+typedef struct RequestGuard
+{
+  S3RequestContext *context;
+  const RequestDeadline *deadline;
+  RequestCancel *cancel;
+  // The handlers and callback data of the request being guarded
+  S3ResponseHandler responseHandler;
+  S3PutObjectDataCallback *putObjectDataCallback;
+  S3GetObjectDataCallback *getObjectDataCallback;
+  S3MultipartInitialResponseCallback *initialResponseCallback;
+  S3MultipartCommitResponseCallback *commitResponseCallback;
+  void *callbackData;
+  // The handlers the request is made with, which call the ones above
+  S3ResponseHandler guardResponseHandler;
+  S3PutObjectHandler guardPutObjectHandler;
+  S3GetObjectHandler guardGetObjectHandler;
+  S3MultipartInitialHander guardInitialHandler;
+  S3MultipartCommitHandler guardCommitHandler;
+  // When the request started, first called back, made progress and got its
+  // response headers; zero until then
+  int64_t startMs, calledBackMs, progressMs, headersMs;
+  // How long the server took to answer once the request, or its body, was
+  // sent; -1 until the response headers arrive
+  int64_t responseMs;
+  // Bytes moved since windowStartMs, for the low speed limit
+  int64_t windowStartMs;
+  uint64_t windowBytes;
+  int completed;
+  // What stopped the last request, or 0
+  const char *interrupted;
+  RequestProfile profile;
+} RequestGuard;
+
+static RequestDeadline deadlineG;
+
+static void request_cancel(RequestCancel *cancel)
+{
+  __sync_lock_test_and_set(&(cancel->cancelled), 1);
+}
+
+static RequestCancel *interruptCancelG;
+
+static void interruptSignalHandler(int signalNumber)
+{
+  if (interruptCancelG) {
+    request_cancel(interruptCancelG);
+  }
+  // A second interrupt kills the process
+  signal(signalNumber, SIG_DFL);
+}
+
+// Makes SIGINT cancel the requests guarded with cancel, or with a null
+// cancel, restores the default
+static void cancel_on_interrupt(RequestCancel *cancel)
+{
+  interruptCancelG = cancel;
+  signal(SIGINT, cancel ? &interruptSignalHandler : SIG_DFL);
+}
+
+// deadline and cancel may be null, and must outlive the guard
+static S3Status guard_init(RequestGuard *guard, const RequestDeadline *deadline,
+    RequestCancel *cancel)
+{
+  memset(guard, 0, sizeof(RequestGuard));
+  guard->deadline = deadline;
+  guard->cancel = cancel;
+  return S3_create_request_context(&(guard->context));
+}
+
+static void guard_destroy(RequestGuard *guard)
+{
+  if (guard->context) {
+    S3_destroy_request_context(guard->context);
+    guard->context = 0;
+  }
+}
+
+static void guard_progress(RequestGuard *guard, int bytes)
+{
+  int64_t now = current_time_ms();
+
+  if (!guard->calledBackMs) {
+    guard->calledBackMs = now;
+    guard->windowStartMs = now;
+  }
+  guard->progressMs = now;
+  guard->windowBytes += bytes;
+}
+
+static S3Status guardPropertiesCallback(const S3ResponseProperties *properties,
+    void *callbackData)
+{
+  RequestGuard *guard = (RequestGuard *) callbackData;
+  ProfileMark mark;
+
+  int64_t sentMs = guard->progressMs ? guard->progressMs : guard->startMs;
+  guard_progress(guard, 0);
+  guard->headersMs = guard->progressMs;
+  guard->responseMs = guard->headersMs - sentMs;
+  if (!guard->responseHandler.propertiesCallback) {
+    return S3StatusOK;
+  }
+  profile_callback_begin(&mark);
+  S3Status status = (*(guard->responseHandler.propertiesCallback))(properties,
+      guard->callbackData);
+  profile_callback_end(&(guard->profile), &mark, "properties");
+  return status;
+}
+
+static void guardCompleteCallback(S3Status status, const S3ErrorDetails *error,
+    void *callbackData)
+{
+  RequestGuard *guard = (RequestGuard *) callbackData;
+  ProfileMark mark;
+
+  guard->completed = 1;
+  profile_callback_begin(&mark);
+  (*(guard->responseHandler.completeCallback))(status, error,
+      guard->callbackData);
+  profile_callback_end(&(guard->profile), &mark, "complete");
+  profile_request_end(&(guard->profile), status);
+}
+
+static int guardPutObjectDataCallback(int bufferSize, char *buffer,
+    void *callbackData)
+{
+  RequestGuard *guard = (RequestGuard *) callbackData;
+  ProfileMark mark;
+
+  profile_callback_begin(&mark);
+  int ret = (*(guard->putObjectDataCallback))(bufferSize, buffer,
+      guard->callbackData);
+  profile_callback_end(&(guard->profile), &mark, "data");
+
+  guard_progress(guard, (ret > 0) ? ret : 0);
+  return ret;
+}
+
+static S3Status guardGetObjectDataCallback(int bufferSize, const char *buffer,
+    void *callbackData)
+{
+  RequestGuard *guard = (RequestGuard *) callbackData;
+  ProfileMark mark;
+
+  guard_progress(guard, bufferSize);
+  profile_callback_begin(&mark);
+  S3Status status = (*(guard->getObjectDataCallback))(bufferSize, buffer,
+      guard->callbackData);
+  profile_callback_end(&(guard->profile), &mark, "data");
+  return status;
+}
+
+static S3Status guardInitialResponseCallback(const char *uploadId,
+    void *callbackData)
+{
+  RequestGuard *guard = (RequestGuard *) callbackData;
+
+  return (*(guard->initialResponseCallback))(uploadId, guard->callbackData);
+}
+
+static S3Status guardCommitResponseCallback(const char *location,
+    const char *eTag, void *callbackData)
+{
+  RequestGuard *guard = (RequestGuard *) callbackData;
+
+  if (!guard->commitResponseCallback) {
+    return S3StatusOK;
+  }
+  return (*(guard->commitResponseCallback))(location, eTag,
+      guard->callbackData);
+}
+
+static void guard_begin(RequestGuard *guard, const char *operation,
+    const char *key, const S3ResponseHandler *handler, void *callbackData)
+{
+  guard->responseHandler = *handler;
+  guard->callbackData = callbackData;
+  guard->guardResponseHandler.propertiesCallback = &guardPropertiesCallback;
+  guard->guardResponseHandler.completeCallback = &guardCompleteCallback;
+  guard->startMs = current_time_ms();
+  guard->calledBackMs = guard->progressMs = guard->headersMs = 0;
+  guard->responseMs = -1;
+  guard->windowStartMs = 0;
+  guard->windowBytes = 0;
+  guard->completed = 0;
+  guard->interrupted = 0;
+  profile_request_begin(&(guard->profile), operation, key);
+}
+
+// These return the handler to make a request with on guard->context, with
+// guard as its callback data, in place of handler and callbackData.  The
+// request is then run by guard_run().  operation and key name the request
+// in its profile, and must stay valid until it completes.
+static S3ResponseHandler *guard_response_handler(RequestGuard *guard,
+    const char *operation, const char *key, const S3ResponseHandler *handler,
+    void *callbackData)
+{
+  guard_begin(guard, operation, key, handler, callbackData);
+  return &(guard->guardResponseHandler);
+}
+
+static S3PutObjectHandler *guard_put_object_handler(RequestGuard *guard,
+    const char *key, const S3PutObjectHandler *handler, void *callbackData)
+{
+  guard_begin(guard, "PUT", key, &(handler->responseHandler), callbackData);
+  guard->putObjectDataCallback = handler->putObjectDataCallback;
+  guard->guardPutObjectHandler.responseHandler = guard->guardResponseHandler;
+  guard->guardPutObjectHandler.putObjectDataCallback =
+    &guardPutObjectDataCallback;
+  return &(guard->guardPutObjectHandler);
+}
+
+static S3GetObjectHandler *guard_get_object_handler(RequestGuard *guard,
+    const char *key, const S3GetObjectHandler *handler, void *callbackData)
+{
+  guard_begin(guard, "GET", key, &(handler->responseHandler), callbackData);
+  guard->getObjectDataCallback = handler->getObjectDataCallback;
+  guard->guardGetObjectHandler.responseHandler = guard->guardResponseHandler;
+  guard->guardGetObjectHandler.getObjectDataCallback =
+    &guardGetObjectDataCallback;
+  return &(guard->guardGetObjectHandler);
+}
+
+static S3MultipartInitialHander *guard_initial_handler(RequestGuard *guard,
+    const char *key, const S3MultipartInitialHander *handler,
+    void *callbackData)
+{
+  guard_begin(guard, "INITIATE", key, &(handler->responseHandler),
+      callbackData);
+  guard->initialResponseCallback = handler->responseXmlCallback;
+  guard->guardInitialHandler.responseHandler = guard->guardResponseHandler;
+  guard->guardInitialHandler.responseXmlCallback =
+    &guardInitialResponseCallback;
+  return &(guard->guardInitialHandler);
+}
+
+static S3MultipartCommitHandler *guard_commit_handler(RequestGuard *guard,
+    const char *key, const S3MultipartCommitHandler *handler,
+    void *callbackData)
+{
+  guard_begin(guard, "COMPLETE", key, &(handler->responseHandler),
+      callbackData);
+  guard->putObjectDataCallback = handler->putObjectDataCallback;
+  guard->commitResponseCallback = handler->responseXmlCallback;
+  guard->guardCommitHandler.responseHandler = guard->guardResponseHandler;
+  guard->guardCommitHandler.putObjectDataCallback =
+    &guardPutObjectDataCallback;
+  guard->guardCommitHandler.responseXmlCallback =
+    &guardCommitResponseCallback;
+  return &(guard->guardCommitHandler);
+}
+
+// Returns what the request has run out of at now, or 0
+static const char *guard_check(RequestGuard *guard, int64_t now)
+{
+  const RequestDeadline *deadline = guard->deadline;
+
+  if (guard->cancel && guard->cancel->cancelled) {
+    return "cancelled";
+  }
+  if (!deadline) {
+    return 0;
+  }
+  if (deadline->totalMs && ((now - guard->startMs) >= deadline->totalMs)) {
+    return "timed out";
+  }
+  if (deadline->connectMs && !guard->calledBackMs &&
+      ((now - guard->startMs) >= deadline->connectMs)) {
+    return "timed out connecting";
+  }
+  if (deadline->firstByteMs && !guard->headersMs &&
+      ((now - (guard->progressMs ? guard->progressMs : guard->startMs)) >=
+       deadline->firstByteMs)) {
+    return "timed out waiting for a response";
+  }
+  if (deadline->lowSpeedBytes && deadline->lowSpeedMs &&
+      guard->calledBackMs &&
+      ((now - guard->windowStartMs) >= deadline->lowSpeedMs)) {
+    if (guard->windowBytes < (uint64_t) deadline->lowSpeedBytes) {
+      return "stopped below the low speed limit";
+    }
+    guard->windowStartMs = now;
+    guard->windowBytes = 0;
+  }
+  return 0;
+}
+
+// Drives the request made on guard->context until it completes, stopping it
+// if it is cancelled or runs out of time.  Returns what stopped it, or 0.
+// Without a context, which happens only if it could not be replaced after
+// an interruption, the request already ran to completion unguarded.
+static const char *guard_run(RequestGuard *guard)
+{
+  int remaining = 1;
+
+  if (!guard->context) {
+    return 0;
+  }
+
+  while (!guard->completed && remaining) {
+    if ((guard->interrupted = guard_check(guard, current_time_ms()))) {
+      break;
+    }
+    if (request_context_poll(guard->context, GUARD_TICK_MS, &remaining) !=
+        S3StatusOK) {
+      guard->interrupted = "failed";
+      break;
+    }
+  }
+
+  if (!guard->completed) {
+    if (!guard->interrupted) {
+      guard->interrupted = "failed";
+    }
+    // Completes the request with S3StatusInterrupted
+    S3_destroy_request_context(guard->context);
+    if (S3_create_request_context(&(guard->context)) != S3StatusOK) {
+      guard->context = 0;
+    }
+  }
+
+  return guard->interrupted;
+}
+
+static void guard_report(const char *interrupted)
+{
+  if (interrupted) {
+    fprintf(stderr, "\nERROR: Request %s\n", interrupted);
+  }
+}
+
+// Requests that go out in parallel can be spread over every address the S3
+// endpoint resolves to, instead of all landing on whichever front end the
+// resolver returned first.  A DnsCache keeps the addresses of hostNameG for
+// DNS_CACHE_TTL_SECONDS; once they expire they are refreshed by a background
+// thread while the old ones stay in use.  The picked address replaces the
+// hostName of a copy of the bucket context, which only works for path-style
+// URIs (the bucket is not part of the host name) over HTTP (certificates do
+// not name the addresses).
+//
+// The cache can instead hold a fixed list of equivalent endpoints given by
+// name with --endpoints, which works with any URI style and protocol.
+//
+// With DnsSpreadFastest, each address keeps moving averages of the latency
+// of the requests sent to it and of the share that failed, and requests go
+// to the address that scores best.  An address with DNS_EJECT_FAILURES
+// failures in a row, or whose error rate reaches DNS_EJECT_ERROR_RATE, is
+// ejected: nothing is sent to it for DNS_EJECT_MS, doubling with each
+// ejection in a row up to DNS_EJECT_MAX_MS, after which a single probe
+// request decides whether it is taken back.
+#define DNS_CACHE_TTL_SECONDS 60
+#define DNS_CACHE_MAX_ADDRESSES 16
+// Room for an endpoint host name, or a bracketed IPv6 address, and a port
+#define DNS_ADDRESS_SIZE 256
+#define DNS_HEALTH_ALPHA 0.2
+#define DNS_EJECT_FAILURES 3
+#define DNS_EJECT_ERROR_RATE 0.5
+// Samples needed before the error rate alone ejects an address
+#define DNS_EJECT_MIN_SAMPLES 10
+#define DNS_EJECT_MS 5000
+#define DNS_EJECT_MAX_MS 120000
+
+typedef enum
+{
+  DnsSpreadOff,
+  DnsSpreadRoundRobin,
+  DnsSpreadLeastLoaded,
+  DnsSpreadFastest
+} DnsSpread;
+
+typedef struct DnsHealth
+{
+  // Moving averages of the latency of successful requests in milliseconds
+  // and of the share of requests that failed
+  double latencyMs, errorRate;
+  uint64_t samples, failures;
+  int consecutiveFailures;
+  // Nonzero while ejected: the time the address may be probed again
+  int64_t ejectedUntilMs;
+  // Ejections in a row, and whether the probe request is in flight
+  int ejections, probing;
+} DnsHealth;
+
+typedef struct DnsCache
+{
+  pthread_mutex_t mutex;
+  // Host name to resolve and the ":port" suffix, if any, of hostNameG
+  char host[256], port[8];
+  char addresses[DNS_CACHE_MAX_ADDRESSES][DNS_ADDRESS_SIZE];
+  int count;
+  // Set when addresses are endpoints given by name, which are used as they
+  // are and never expire
+  int fixed;
+  // Requests in flight and requests made, per address
+  int load[DNS_CACHE_MAX_ADDRESSES];
+  uint64_t uses[DNS_CACHE_MAX_ADDRESSES];
+  DnsHealth health[DNS_CACHE_MAX_ADDRESSES];
+  // Round-robin position, also used to break ties between equal loads
+  unsigned cursor;
+  // Bumped whenever the addresses are replaced, so that tickets handed out
+  // for the old ones are not released against the new ones
+  unsigned generation;
+  time_t expires;
+  int refreshing, refresherStarted;
+  pthread_t refresher;
+} DnsCache;
+
+static DnsSpread dnsSpreadG = DnsSpreadOff;
+static DnsCache dnsCacheG = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+// Resolves host into up to DNS_CACHE_MAX_ADDRESSES distinct numeric
+// addresses with the port suffix appended.  Returns the count.
+static int dns_resolve(const char *host, const char *port,
+    char addresses[][DNS_ADDRESS_SIZE])
+{
+  struct addrinfo hints, *result, *ai;
+  int count = 0, i;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, 0, &hints, &result)) {
+    return 0;
+  }
+
+  for (ai = result; ai && (count < DNS_CACHE_MAX_ADDRESSES);
+      ai = ai->ai_next) {
+    char numeric[DNS_ADDRESS_SIZE];
+    if (getnameinfo(ai->ai_addr, ai->ai_addrlen, numeric, sizeof(numeric),
+          0, 0, NI_NUMERICHOST)) {
+      continue;
+    }
+    snprintf(addresses[count], DNS_ADDRESS_SIZE,
+        (ai->ai_family == AF_INET6) ? "[%s]%s" : "%s%s", numeric, port);
+    for (i = 0; (i < count) && strcmp(addresses[i], addresses[count]); i++) {
+    }
+    if (i == count) {
+      count++;
+    }
+  }
+
+  freeaddrinfo(result);
+  return count;
+}
+
+// Resolves the cache's host and swaps in the result; a failed resolution
+// keeps the previous addresses
+static void dns_cache_refresh(DnsCache *cache)
+{
+  char addresses[DNS_CACHE_MAX_ADDRESSES][DNS_ADDRESS_SIZE];
+  int count = dns_resolve(cache->host, cache->port, addresses);
+
+  pthread_mutex_lock(&(cache->mutex));
+  if (count) {
+    memcpy(cache->addresses, addresses, sizeof(addresses));
+    memset(cache->load, 0, sizeof(cache->load));
+    memset(cache->uses, 0, sizeof(cache->uses));
+    memset(cache->health, 0, sizeof(cache->health));
+    cache->count = count;
+    cache->generation++;
+  }
+  // Retry failures sooner than a full TTL
+  cache->expires = time(0) + (count ? DNS_CACHE_TTL_SECONDS :
+      (DNS_CACHE_TTL_SECONDS / 10));
+  cache->refreshing = 0;
+  pthread_mutex_unlock(&(cache->mutex));
+}
+
+static void *dns_cache_refresher(void *arg)
+{
+  dns_cache_refresh((DnsCache *) arg);
+  return 0;
+}
+
+// Fills the cache with the comma-separated endpoints, each a host name with
+// an optional ":port".  Returns the count.
+static int dns_cache_set_endpoints(DnsCache *cache, const char *endpoints)
+{
+  const char *start = endpoints;
+
+  pthread_mutex_lock(&(cache->mutex));
+  cache->count = 0;
+  while (*start && (cache->count < DNS_CACHE_MAX_ADDRESSES)) {
+    const char *end = strchr(start, ',');
+    int len = end ? (end - start) : (int) strlen(start);
+    if (len && (len < DNS_ADDRESS_SIZE)) {
+      snprintf(cache->addresses[cache->count], DNS_ADDRESS_SIZE, "%.*s", len,
+          start);
+      cache->count++;
+    }
+    start += len + (end ? 1 : 0);
+  }
+  memset(cache->load, 0, sizeof(cache->load));
+  memset(cache->uses, 0, sizeof(cache->uses));
+  memset(cache->health, 0, sizeof(cache->health));
+  cache->fixed = (cache->count > 0);
+  cache->generation++;
+  pthread_mutex_unlock(&(cache->mutex));
+
+  return cache->count;
+}
+
+// Returns the address for the next request under DnsSpreadFastest: one whose
+// ejection is over gets its probe, then addresses not measured yet go first,
+// least loaded first, then the one with the lowest expected latency scaled
+// by its load and error rate.  If all are ejected, the first back is used.
+// Called with the mutex held.
+static int dns_cache_pick_fastest(DnsCache *cache, int start)
+{
+  int64_t now = current_time_ms();
+  int i, best = -1, soonest = -1;
+  double bestScore = 0;
+
+  for (i = 0; i < cache->count; i++) {
+    int candidate = (start + i) % cache->count;
+    DnsHealth *health = &(cache->health[candidate]);
+    double score;
+
+    if (health->ejectedUntilMs) {
+      if (!health->probing && (now >= health->ejectedUntilMs)) {
+        health->probing = 1;
+        return candidate;
+      }
+      if ((soonest < 0) || (health->ejectedUntilMs <
+            cache->health[soonest].ejectedUntilMs)) {
+        soonest = candidate;
+      }
+      continue;
+    }
+
+    if (!health->samples) {
+      score = -1.0 / (1 + cache->load[candidate]);
+    }
+    else {
+      score = (health->latencyMs + 1) * (1 + cache->load[candidate]) *
+        (1 + (4 * health->errorRate));
+    }
+    if ((best < 0) || (score < bestScore)) {
+      best = candidate;
+      bestScore = score;
+    }
+  }
+
+  return (best >= 0) ? best : soonest;
+}
+
+// Picks an address of hostNameG, or one of the fixed endpoints, according to
+// spread and copies it into address.  Returns a ticket to pass to dns_cache_release() once the request
+// is done, or -1 if no address is available.
+static int dns_cache_pick(DnsCache *cache, DnsSpread spread, char *address,
+    int addressSize)
+{
+  int i, best;
+
+  pthread_mutex_lock(&(cache->mutex));
+  if (!cache->fixed && !cache->host[0]) {
+    const char *colon = strrchr(hostNameG, ':');
+    int hostLen = colon ? (colon - hostNameG) : (int) strlen(hostNameG);
+    snprintf(cache->host, sizeof(cache->host), "%.*s", hostLen, hostNameG);
+    snprintf(cache->port, sizeof(cache->port), "%s", colon ? colon : "");
+  }
+
+  if (!cache->count) {
+    // Nothing to use meanwhile, so the first resolution is waited for
+    pthread_mutex_unlock(&(cache->mutex));
+    dns_cache_refresh(cache);
+    pthread_mutex_lock(&(cache->mutex));
+  }
+  else if (!cache->fixed && (time(0) >= cache->expires) &&
+      !cache->refreshing) {
+    if (cache->refresherStarted) {
+      pthread_join(cache->refresher, 0);
+    }
+    cache->refreshing = 1;
+    cache->refresherStarted = !pthread_create(&(cache->refresher), 0,
+        &dns_cache_refresher, cache);
+    if (!cache->refresherStarted) {
+      cache->refreshing = 0;
+      cache->expires = time(0) + DNS_CACHE_TTL_SECONDS;
+    }
+  }
+
+  if (!cache->count) {
+    pthread_mutex_unlock(&(cache->mutex));
+    return -1;
+  }
+
+  best = cache->cursor++ % cache->count;
+  if (spread == DnsSpreadFastest) {
+    best = dns_cache_pick_fastest(cache, best);
+  }
+  else if (spread == DnsSpreadLeastLoaded) {
+    for (i = 1; i < cache->count; i++) {
+      int candidate = (best + i) % cache->count;
+      if (cache->load[candidate] < cache->load[best]) {
+        best = candidate;
+      }
+    }
+  }
+  cache->load[best]++;
+  cache->uses[best]++;
+  snprintf(address, addressSize, "%s", cache->addresses[best]);
+  int ticket = ((cache->generation & 0xffffff) << 7) | best;
+  pthread_mutex_unlock(&(cache->mutex));
+
+  return ticket;
+}
+
+static void dns_cache_release(DnsCache *cache, int ticket)
+{
+  if (ticket < 0) {
+    return;
+  }
+  pthread_mutex_lock(&(cache->mutex));
+  if ((unsigned) (ticket >> 7) == (cache->generation & 0xffffff)) {
+    cache->load[ticket & 0x7f]--;
+  }
+  pthread_mutex_unlock(&(cache->mutex));
+}
+
+// Records how a request sent to the address of ticket went, for
+// DnsSpreadFastest.  Failures that retrying elsewhere could avoid count
+// against the address; a negative latencyMs adds no latency sample.
+static void dns_cache_report(DnsCache *cache, int ticket, S3Status status,
+    int64_t latencyMs)
+{
+  int failed = (status != S3StatusOK) &&
+    (S3_status_is_retryable(status) || (status == S3StatusInterrupted));
+
+  if (ticket < 0) {
+    return;
+  }
+  pthread_mutex_lock(&(cache->mutex));
+  if ((unsigned) (ticket >> 7) != (cache->generation & 0xffffff)) {
+    pthread_mutex_unlock(&(cache->mutex));
+    return;
+  }
+
+  DnsHealth *health = &(cache->health[ticket & 0x7f]);
+  if (!health->samples) {
+    health->errorRate = failed;
+  }
+  else {
+    health->errorRate += DNS_HEALTH_ALPHA * (failed - health->errorRate);
+  }
+  if (!failed && (latencyMs >= 0)) {
+    health->latencyMs = (health->latencyMs > 0) ?
+      (health->latencyMs + (DNS_HEALTH_ALPHA *
+                            (latencyMs - health->latencyMs))) : latencyMs;
+  }
+  health->samples++;
+  if (failed) {
+    health->failures++;
+    health->consecutiveFailures++;
+  }
+  else {
+    health->consecutiveFailures = 0;
+  }
+
+  int eject = 0;
+  if (health->probing) {
+    health->probing = 0;
+    if (failed) {
+      eject = 1;
+    }
+    else {
+      health->ejectedUntilMs = 0;
+      health->ejections = 0;
+      health->errorRate = 0;
+    }
+  }
+  else if (!health->ejectedUntilMs && failed &&
+      ((health->consecutiveFailures >= DNS_EJECT_FAILURES) ||
+       ((health->samples >= DNS_EJECT_MIN_SAMPLES) &&
+        (health->errorRate >= DNS_EJECT_ERROR_RATE)))) {
+    eject = 1;
+  }
+  if (eject) {
+    int64_t backoff = ((int64_t) DNS_EJECT_MS) <<
+      ((health->ejections < 5) ? health->ejections : 5);
+    health->ejections++;
+    health->ejectedUntilMs = current_time_ms() +
+      ((backoff < DNS_EJECT_MAX_MS) ? backoff : DNS_EJECT_MAX_MS);
+  }
+  pthread_mutex_unlock(&(cache->mutex));
+}
+
+// Prints how many requests went to each address, and how they went
+static void dns_cache_print_stats(DnsCache *cache)
+{
+  int i;
+
+  pthread_mutex_lock(&(cache->mutex));
+  for (i = 0; i < cache->count; i++) {
+    DnsHealth *health = &(cache->health[i]);
+    fprintf(stderr, "%s\t%llu requests", cache->addresses[i],
+        (unsigned long long) cache->uses[i]);
+    if (health->samples) {
+      fprintf(stderr, ", %.0f ms, %llu failed", health->latencyMs,
+          (unsigned long long) health->failures);
+    }
+    if (health->ejectedUntilMs) {
+      fprintf(stderr, ", ejected");
+    }
+    fprintf(stderr, "\n");
+  }
+  pthread_mutex_unlock(&(cache->mutex));
+}
+
+// Waits for a running refresh, so the cache can be left at exit
+static void dns_cache_shutdown(DnsCache *cache)
+{
+  pthread_mutex_lock(&(cache->mutex));
+  int started = cache->refresherStarted;
+  cache->refresherStarted = 0;
+  pthread_mutex_unlock(&(cache->mutex));
+
+  if (started) {
+    pthread_join(cache->refresher, 0);
+  }
+}
+
+// Copies base into context, pointed at an address picked from dnsCacheG when
+// requests are spread and base allows it.  host must stay valid for the
+// requests made with context.  Returns the ticket to release afterwards, or
+// -1 if context simply uses the configured host.
+static int dns_bucket_context(const S3BucketContext *base,
+    S3BucketContext *context, char *host, int hostSize)
+{
+  int ticket = -1;
+
+  *context = *base;
+  if ((dnsSpreadG != DnsSpreadOff) && !base->hostName &&
+      (dnsCacheG.fixed || ((base->uriStyle == S3UriStylePath) &&
+                           (base->protocol == S3ProtocolHTTP))) &&
+      ((ticket = dns_cache_pick(&dnsCacheG, dnsSpreadG, host, hostSize))
+       >= 0)) {
+    context->hostName = host;
+  }
+  return ticket;
+}
+
+// Transfers report progress through a ProgressMeter, which the data callbacks
+// feed with byte counts and which calls its ProgressCallback at most once per
+// interval and/or byte step, so reporting stays off the per-buffer path.
+typedef void (ProgressCallback)(uint64_t done, uint64_t total, double rate,
+    void *callbackData);
+
+typedef struct ProgressMeter
+{
+  // total is 0 while unknown
+  uint64_t done, total;
+  // Report when this many milliseconds or bytes passed since the last
+  // report; 0 disables either trigger
+  int intervalMs;
+  uint64_t byteStep;
+  struct timeval last;
+  uint64_t lastDone;
+  ProgressCallback *callback;
+  void *callbackData;
+} ProgressMeter;
+
+static void progress_init(ProgressMeter *meter, uint64_t total,
+    int intervalMs, uint64_t byteStep, ProgressCallback *callback,
+    void *callbackData)
+{
+  memset(meter, 0, sizeof(ProgressMeter));
+  meter->total = total;
+  meter->intervalMs = intervalMs;
+  meter->byteStep = byteStep;
+  meter->callback = callback;
+  meter->callbackData = callbackData;
+  gettimeofday(&(meter->last), 0);
+}
+
+static void progress_report(ProgressMeter *meter, const struct timeval *now)
+{
+  double elapsed = (now->tv_sec - meter->last.tv_sec) +
+    ((now->tv_usec - meter->last.tv_usec) / 1000000.0);
+  double rate = (elapsed > 0) ? ((meter->done - meter->lastDone) / elapsed) :
+    0;
+
+  (*(meter->callback))(meter->done, meter->total, rate,
+      meter->callbackData);
+  meter->last = *now;
+  meter->lastDone = meter->done;
+}
+
+static void progress_update(ProgressMeter *meter, uint64_t bytes)
+{
+  struct timeval now;
+
+  if (!meter || !meter->callback) {
+    return;
+  }
+  meter->done += bytes;
+
+  if (meter->byteStep &&
+      ((meter->done - meter->lastDone) >= meter->byteStep)) {
+    gettimeofday(&now, 0);
+    progress_report(meter, &now);
+  }
+  else if (meter->intervalMs) {
+    gettimeofday(&now, 0);
+    if ((((now.tv_sec - meter->last.tv_sec) * 1000) +
+          ((now.tv_usec - meter->last.tv_usec) / 1000)) >=
+        meter->intervalMs) {
+      progress_report(meter, &now);
+    }
+  }
+}
+
+// Reports the final count if it was not reported yet
+static void progress_finish(ProgressMeter *meter)
+{
+  struct timeval now;
+
+  if (meter->callback && (meter->done != meter->lastDone)) {
+    gettimeofday(&now, 0);
+    progress_report(meter, &now);
+  }
+}
+
+static void progressPrintCallback(uint64_t done, uint64_t total, double rate,
+    void *callbackData)
+{
+  (void) callbackData;
+
+  // Avoid a weird bug in MingW, which won't print the second integer
+  // value properly when it's in the same call, so print separately
+  fprintf(stderr, "%llu ", (unsigned long long) done);
+  if (total) {
+    fprintf(stderr, "of %llu ", (unsigned long long) total);
+    fprintf(stderr, "bytes (%d%% complete)",
+        (int) ((done * 100) / total));
+  }
+  else {
+    fprintf(stderr, "bytes");
+  }
+  fprintf(stderr, ", %.2f MB/s\n", rate / (1024 * 1024));
+}
+
+// Uploads read their input through a ReadAhead: an I/O thread fills a ring
+// of aligned buffers from the file ahead of the upload, so the data callback,
+// which runs in the middle of the send path, only copies out of a buffer that
+// is already full and never waits for the disk while data is ready.
+// Alignment of buffers, offsets and read sizes required by O_DIRECT
+#define READ_AHEAD_ALIGNMENT 4096
+
+typedef struct ReadAhead
+{
+  int fd;
+  // Nonzero while reads bypass the page cache
+  int direct;
+  // File offset of the next read, and the offset reading stops at
+  uint64_t offset, end;
+  char **buffers;
+  int *sizes;
+  int bufferSize, bufferCount;
+  // The buffer being consumed, how much of it was consumed, and the number
+  // of full buffers starting at head
+  int head, headUsed, full;
+  // Set when the I/O thread has stopped reading, with the errno of the
+  // failed read if any
+  int done, error;
+  int running, stop;
+  pthread_mutex_t mutex;
+  pthread_cond_t fillCond, drainCond;
+  pthread_t thread;
+} ReadAhead;
+
+static void *read_ahead_thread(void *arg)
+{
+  ReadAhead *readAhead = (ReadAhead *) arg;
+  int tail = 0;
+
+  for (;;) {
+    pthread_mutex_lock(&(readAhead->mutex));
+    while ((readAhead->full == readAhead->bufferCount) && !readAhead->stop) {
+      pthread_cond_wait(&(readAhead->drainCond), &(readAhead->mutex));
+    }
+    int stop = readAhead->stop;
+    pthread_mutex_unlock(&(readAhead->mutex));
+    if (stop) {
+      return 0;
+    }
+
+    // The tail buffer is not visible to the consumer until it is counted in
+    // full, so it is filled without holding the mutex
+    uint64_t remaining = readAhead->end - readAhead->offset;
+    size_t toRead = readAhead->bufferSize;
+    if (!readAhead->direct && (remaining < toRead)) {
+      toRead = remaining;
+    }
+    ssize_t n = pread(readAhead->fd, readAhead->buffers[tail], toRead,
+        readAhead->offset);
+#ifdef O_DIRECT
+    if ((n < 0) && (errno == EINVAL) && readAhead->direct) {
+      // The file system does not support direct I/O after all
+      fcntl(readAhead->fd, F_SETFL,
+          fcntl(readAhead->fd, F_GETFL) & ~O_DIRECT);
+      readAhead->direct = 0;
+      continue;
+    }
+#endif
+    // A direct read asks for a whole buffer and may get data past the size
+    // being read, which is not counted
+    if ((n > 0) && ((size_t) n > toRead)) {
+      n = toRead;
+    }
+    if ((n > 0) && ((uint64_t) n > remaining)) {
+      n = remaining;
+    }
+
+    pthread_mutex_lock(&(readAhead->mutex));
+    if (n < 0) {
+      readAhead->error = errno;
+      readAhead->done = 1;
+    }
+    else {
+      if (n) {
+        readAhead->sizes[tail] = n;
+        tail = (tail + 1) % readAhead->bufferCount;
+        readAhead->full++;
+        readAhead->offset += n;
+      }
+      // A read short of a whole buffer only happens at the end of the file
+      if (!n || (readAhead->offset == readAhead->end) ||
+          ((size_t) n < toRead)) {
+        readAhead->done = 1;
+      }
+    }
+    int done = readAhead->done;
+    pthread_cond_signal(&(readAhead->fillCond));
+    pthread_mutex_unlock(&(readAhead->mutex));
+    if (done) {
+      return 0;
+    }
+  }
+}
+
+static void read_ahead_close(ReadAhead *readAhead);
+
+// Opens filename and starts reading its first size bytes ahead into the
+// buffers described by options.  With options->directIo set, O_DIRECT is used
+// where the platform and file system support it.  Returns zero on failure
+// with errno set.
+static int read_ahead_open(ReadAhead *readAhead, const char *filename,
+    uint64_t size, const TransferOptions *options)
+{
+  int i, flags = O_RDONLY | O_BINARY;
+
+  memset(readAhead, 0, sizeof(ReadAhead));
+  readAhead->end = size;
+  // Direct reads must be whole multiples of the alignment
+  readAhead->bufferSize = (options->ioBufferSize + READ_AHEAD_ALIGNMENT - 1) &
+    ~(READ_AHEAD_ALIGNMENT - 1);
+  readAhead->bufferCount = options->ioBufferCount;
+  pthread_mutex_init(&(readAhead->mutex), 0);
+  pthread_cond_init(&(readAhead->fillCond), 0);
+  pthread_cond_init(&(readAhead->drainCond), 0);
+
+#ifdef O_DIRECT
+  if (options->directIo &&
+      ((readAhead->fd = open(filename, flags | O_DIRECT)) >= 0)) {
+    readAhead->direct = 1;
+  }
+  else
+#endif
+  if ((readAhead->fd = open(filename, flags)) < 0) {
+    return 0;
+  }
+
+  readAhead->buffers = (char **) calloc(readAhead->bufferCount,
+      sizeof(char *));
+  readAhead->sizes = (int *) calloc(readAhead->bufferCount, sizeof(int));
+  if (!readAhead->buffers || !readAhead->sizes) {
+    read_ahead_close(readAhead);
+    errno = ENOMEM;
+    return 0;
+  }
+  for (i = 0; i < readAhead->bufferCount; i++) {
+#ifdef _WIN32
+    readAhead->buffers[i] = (char *)
+      _aligned_malloc(readAhead->bufferSize, READ_AHEAD_ALIGNMENT);
+#else
+    if (posix_memalign((void **) &(readAhead->buffers[i]),
+          READ_AHEAD_ALIGNMENT, readAhead->bufferSize)) {
+      readAhead->buffers[i] = 0;
+    }
+#endif
+    if (!readAhead->buffers[i]) {
+      read_ahead_close(readAhead);
+      errno = ENOMEM;
+      return 0;
+    }
+  }
+
+  if ((errno = pthread_create(&(readAhead->thread), 0, &read_ahead_thread,
+          readAhead))) {
+    read_ahead_close(readAhead);
+    return 0;
+  }
+  readAhead->running = 1;
+
+  return 1;
+}
+
+// Copies up to size bytes of the file into buffer, waiting for the I/O
+// thread only if no data at all is ready.  Returns the number of bytes
+// copied, 0 at the end of the data, or -1 if reading failed.
+static int read_ahead_read(ReadAhead *readAhead, char *buffer, int size)
+{
+  int total = 0;
+
+  pthread_mutex_lock(&(readAhead->mutex));
+  while (total < size) {
+    if (!readAhead->full) {
+      if (total || readAhead->done) {
+        break;
+      }
+      pthread_cond_wait(&(readAhead->fillCond), &(readAhead->mutex));
+      continue;
+    }
+
+    int head = readAhead->head;
+    int toCopy = readAhead->sizes[head] - readAhead->headUsed;
+    if (toCopy > (size - total)) {
+      toCopy = size - total;
+    }
+    memcpy(&(buffer[total]), &(readAhead->buffers[head][readAhead->headUsed]),
+        toCopy);
+    total += toCopy;
+    readAhead->headUsed += toCopy;
+
+    if (readAhead->headUsed == readAhead->sizes[head]) {
+      readAhead->head = (head + 1) % readAhead->bufferCount;
+      readAhead->headUsed = 0;
+      readAhead->full--;
+      pthread_cond_signal(&(readAhead->drainCond));
+    }
+  }
+  if (!total && readAhead->error) {
+    total = -1;
+  }
+  pthread_mutex_unlock(&(readAhead->mutex));
+
+  return total;
+}
+
+static void read_ahead_close(ReadAhead *readAhead)
+{
+  int i;
+
+  if (readAhead->running) {
+    pthread_mutex_lock(&(readAhead->mutex));
+    readAhead->stop = 1;
+    pthread_cond_signal(&(readAhead->drainCond));
+    pthread_mutex_unlock(&(readAhead->mutex));
+    pthread_join(readAhead->thread, 0);
+  }
+  if (readAhead->fd >= 0) {
+    close(readAhead->fd);
+  }
+  for (i = 0; readAhead->buffers && (i < readAhead->bufferCount); i++) {
+#ifdef _WIN32
+    _aligned_free(readAhead->buffers[i]);
+#else
+    free(readAhead->buffers[i]);
+#endif
+  }
+  free(readAhead->buffers);
+  free(readAhead->sizes);
+  pthread_cond_destroy(&(readAhead->fillCond));
+  pthread_cond_destroy(&(readAhead->drainCond));
+  pthread_mutex_destroy(&(readAhead->mutex));
+}
+
+typedef struct put_object_callback_data
+{
+  ReadAhead *source;
+  uint64_t contentLength, originalContentLength;
+  // Shared by all parts of a multipart upload
+  ProgressMeter *progress;
+} put_object_callback_data;
+
+static int putObjectDataCallback(int bufferSize, char *buffer,
+    void *callbackData)
+{
+  put_object_callback_data *data = 
+    (put_object_callback_data *) callbackData;
+
+  int ret = 0;
+
+  if (data->contentLength) {
+    int toRead = ((data->contentLength > (unsigned) bufferSize) ?
+        (unsigned) bufferSize : data->contentLength);
+    if (data->source &&
+        ((ret = read_ahead_read(data->source, buffer, toRead)) < 0)) {
+      return -1;
+    }
+  }
+
+  data->contentLength -= ret;
+  progress_update(data->progress, ret);
+
+  return ret;
+}
+
+typedef struct MultipartPartData {
+  put_object_callback_data put_object_data;
+  int seq;
+  UploadManager * manager;
+} MultipartPartData;
+
+static S3Status initial_multipart_callback(const char * upload_id, void * callbackData) {
+  UploadManager *manager = (UploadManager *) callbackData;
+  manager->upload_id = strdup(upload_id);
+  return S3StatusOK;
+}
+
+static S3Status MultipartResponseProperiesCallback(const S3ResponseProperties *properties, void *callbackData) {
+
+  responsePropertiesCallback(properties, callbackData);
+  MultipartPartData * data = (MultipartPartData*) callbackData;
+  int seq = data->seq;
+  const char *etag = properties->eTag;
+  data->manager->etags[seq - 1] = strdup(etag);
+  data->manager->next_etags_pos = seq;
+  return S3StatusOK;
+}
+
+static int multipartPutXmlCallback(int bufferSize, char *buffer, void *callbackData) {
+  UploadManager * manager = (UploadManager*)callbackData;
+  int ret = 0;
+  if (manager->remaining) {
+    int toRead = ((manager->remaining > bufferSize) ?
+        bufferSize : manager->remaining);
+    growbuffer_read(&(manager->gb), toRead, &ret, buffer);
+  }
+  manager->remaining -= ret;
+  return ret;
+}
+
+// Returns the part size to upload contentLength bytes with: the configured
+// one, grown if needed to stay within MULTIPART_MAX_PARTS parts
+static uint64_t transfer_part_size(const TransferOptions *options,
+    uint64_t contentLength)
+{
+  uint64_t partSize = options->partSize;
+
+  if (partSize < MULTIPART_CHUNK_SIZE) {
+    partSize = MULTIPART_CHUNK_SIZE;
+  }
+  while (((contentLength + partSize - 1) / partSize) > MULTIPART_MAX_PARTS) {
+    partSize *= 2;
+  }
+  return partSize;
+}
+
+static void put_object(const char *filename, const char *bucketName, const char *key,
+    const TransferOptions *options)
+{
+  uint64_t contentLength = 0;
+  const char *cacheControl = 0, *contentType = 0, *md5 = 0;
+  const char *contentDispositionFilename = 0, *contentEncoding = 0;
+  int64_t expires = -1;
+  S3CannedAcl cannedAcl = S3CannedAclPublicRead;
+  int metaPropertiesCount = 0;
+  S3NameValue metaProperties[S3_MAX_METADATA_COUNT];
+  char useServerSideEncryption = 0;
+
+  put_object_callback_data data;
+  ReadAhead readAhead;
+  data.source = 0;
+  if (filename) {
+    if (!contentLength) {
+      struct stat statbuf;
+      // Stat the file to get its length
+      if (stat(filename, &statbuf) == -1) {
+        fprintf(stderr, "\nERROR: Failed to stat file %s: ",
+            filename);
+        perror(0);
+        exit(-1);
+      }
+      contentLength = statbuf.st_size;
+    }
+    // Open the file and start reading it ahead of the upload
+    if (!read_ahead_open(&readAhead, filename, contentLength, options)) {
+      fprintf(stderr, "\nERROR: Failed to open input file %s: ",
+          filename);
+      perror(0);
+      exit(-1);
+    }
+    data.source = &readAhead;
+  }
+  data.contentLength = data.originalContentLength = contentLength;
+
+  ProgressMeter progress;
+  progress_init(&progress, contentLength, options->progressIntervalMs, 0,
+      options->progressIntervalMs ? &progressPrintCallback : 0, 0);
+
+  uint64_t partSize = transfer_part_size(options, contentLength);
+  data.progress = &progress;
+
+  S3_init();
+
+  RequestCancel cancel = { 0 };
+  RequestGuard guard;
+  guard_init(&guard, &deadlineG, &cancel);
+  cancel_on_interrupt(&cancel);
+
+  S3BucketContext bucketContext =
+  {
+    0,
+    bucketName,
+    protocolG,
+    uriStyleG,
+    accessKeyIdG,
+    secretAccessKeyG,
+    0
+  };
+
+  S3PutProperties putProperties =
+  {
+    contentType,
+    md5,
+    cacheControl,
+    contentDispositionFilename,
+    contentEncoding,
+    expires,
+    cannedAcl,
+    metaPropertiesCount,
+    metaProperties,
+    useServerSideEncryption
+  };
+
+  if (contentLength <= partSize) {
+    S3PutObjectHandler putObjectHandler =
+    {
+      { &responsePropertiesCallback, &responseCompleteCallback },
+      &putObjectDataCallback
+    };
+
+    S3PutObjectHandler *handler =
+      guard_put_object_handler(&guard, key, &putObjectHandler, &data);
+    S3_put_object(&bucketContext, key, contentLength, &putProperties,
+        guard.context, handler, &guard);
+    guard_report(guard_run(&guard));
+
+    if (statusG != S3StatusOK) {
+      printError();
+    }
+    else if (data.contentLength) {
+      fprintf(stderr, "\nERROR: Failed to read remaining %llu bytes from "
+          "input\n", (unsigned long long) data.contentLength);
+    }
+  }
+  else {
+    UploadManager manager;
+    manager.upload_id = 0;
+    manager.gb = 0;
+
+    //div round up
+    int seq;
+    int totalSeq = (contentLength + partSize - 1) / partSize;
+
+    MultipartPartData partData;
+    int partContentLength = 0;
+
+    S3MultipartInitialHander handler = {
+      {
+        &responsePropertiesCallback,
+        &responseCompleteCallback
+      },
+      &initial_multipart_callback    
+    };
+
+    S3PutObjectHandler putObjectHandler = {
+      {
+        &MultipartResponseProperiesCallback,
+        &responseCompleteCallback
+      },
+      &putObjectDataCallback
+    };
+
+    S3MultipartCommitHandler commit_handler = {
+      {
+        &responsePropertiesCallback,
+        &responseCompleteCallback
+      },
+      &multipartPutXmlCallback,
+      0
+    };
+
+    manager.etags = (char**)malloc(sizeof(char*) * totalSeq);
+    manager.next_etags_pos = 0;
+
+    S3MultipartInitialHander *initialHandler =
+      guard_initial_handler(&guard, key, &handler, &manager);
+    S3_initiate_multipart(&bucketContext, key, 0, initialHandler,
+        guard.context, &guard);
+    guard_report(guard_run(&guard));
+    if (manager.upload_id == 0 || statusG != S3StatusOK) {
+      printError();
+      goto clean;
+    }
+
+    for(seq = manager.next_etags_pos+1 ; seq <= totalSeq ; seq ++) {
+      memset(&partData, 0, sizeof(MultipartPartData));
+      partData.manager = &manager;
+      partData.seq = seq;
+      partData.put_object_data = data;
+      partContentLength = (contentLength > partSize) ? partSize : contentLength;
+      printf("Sending Part Seq %d, length=%d\n", seq, partContentLength);
+      partData.put_object_data.contentLength = partContentLength;
+      putProperties.md5 = 0;
+      S3PutObjectHandler *partHandler =
+        guard_put_object_handler(&guard, key, &putObjectHandler,
+            &partData);
+      S3_upload_part(&bucketContext, key, &putProperties, partHandler, seq, manager.upload_id, partContentLength, guard.context, &guard);
+      guard_report(guard_run(&guard));
+      if (statusG != S3StatusOK) {
+        printError();
+        goto clean;
+      }
+      contentLength -= partContentLength;
+    }
+
+    int i;
+    int size = 0;
+    size += growbuffer_append(&(manager.gb), "<CompleteMultipartUpload>", strlen("<CompleteMultipartUpload>"));
+    char buf[256];
+    int n;
+    for(i=0;i<totalSeq;i++) {
+      n = snprintf(buf,256,"<Part><PartNumber>%d</PartNumber><ETag>%s</ETag></Part>",
+          i + 1,manager.etags[i]);
+      size += growbuffer_append(&(manager.gb), buf, n);
+    }
+    size += growbuffer_append(&(manager.gb), "</CompleteMultipartUpload>",strlen("</CompleteMultipartUpload>"));
+    manager.remaining = size;
+
+    S3MultipartCommitHandler *commitHandler =
+      guard_commit_handler(&guard, key, &commit_handler, &manager);
+    S3_complete_multipart_upload(&bucketContext, key, commitHandler,
+        manager.upload_id, manager.remaining, guard.context, &guard);
+    guard_report(guard_run(&guard));
+    if (statusG != S3StatusOK) {
+      printError();
+      goto clean;
+    }
+
+clean:
+    if ((statusG != S3StatusOK) && manager.upload_id) {
+      // Don't leave the parts sent so far behind as an orphaned upload
+      S3Status status = statusG;
+      S3AbortMultipartUploadHandler abortHandler =
+      {
+        { &responsePropertiesCallback, &responseCompleteCallback }
+      };
+      S3_abort_multipart_upload(&bucketContext, key, manager.upload_id,
+          &abortHandler);
+      statusG = status;
+    }
+    if(manager.upload_id)
+      free(manager.upload_id);
+    for(i=0;i<manager.next_etags_pos;i++) {
+      free(manager.etags[i]);
+    }
+    growbuffer_destroy(manager.gb);
+    free(manager.etags);
+  }
+
+  if (data.source) {
+    read_ahead_close(data.source);
+    data.source = 0;
+  }
+  if (statusG == S3StatusOK) {
+    progress_finish(&progress);
+  }
+
+  cancel_on_interrupt(0);
+  guard_destroy(&guard);
+  S3_deinitialize();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Integrity: MD5 (RFC 1321) and CRC32C, to compare data with object ETags and
+// checksums
+
+typedef struct MD5Context
+{
+  uint32_t state[4];
+  uint64_t length;
+  unsigned char buffer[64];
+} MD5Context;
+
+static const uint32_t md5K[64] =
+{
+  0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
+  0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+  0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+  0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+  0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
+  0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+  0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
+  0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+  0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+  0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+  0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05,
+  0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+  0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039,
+  0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+  0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+  0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+
+static const unsigned char md5R[64] =
+{
+  7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+  5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+  4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+  6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
+};
+
+static void md5_transform(uint32_t state[4], const unsigned char *block)
+{
+  uint32_t w[16];
+  uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+  int i;
+
+  for (i = 0; i < 16; i++) {
+    w[i] = ((uint32_t) block[i * 4]) |
+      (((uint32_t) block[i * 4 + 1]) << 8) |
+      (((uint32_t) block[i * 4 + 2]) << 16) |
+      (((uint32_t) block[i * 4 + 3]) << 24);
+  }
+
+  for (i = 0; i < 64; i++) {
+    uint32_t f;
+    int g;
+    if (i < 16) {
+      f = (b & c) | (~b & d);
+      g = i;
+    }
+    else if (i < 32) {
+      f = (d & b) | (~d & c);
+      g = (5 * i + 1) & 15;
+    }
+    else if (i < 48) {
+      f = b ^ c ^ d;
+      g = (3 * i + 5) & 15;
+    }
+    else {
+      f = c ^ (b | ~d);
+      g = (7 * i) & 15;
+    }
+    uint32_t x = a + f + md5K[i] + w[g];
+    a = d;
+    d = c;
+    c = b;
+    b += (x << md5R[i]) | (x >> (32 - md5R[i]));
+  }
+
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+}
+
+static void md5_init(MD5Context *context)
+{
+  context->state[0] = 0x67452301;
+  context->state[1] = 0xefcdab89;
+  context->state[2] = 0x98badcfe;
+  context->state[3] = 0x10325476;
+  context->length = 0;
+}
+
+static void md5_update(MD5Context *context, const void *data, size_t len)
+{
+  const unsigned char *in = (const unsigned char *) data;
+  size_t used = context->length & 63;
+
+  context->length += len;
+
+  if (used) {
+    size_t toCopy = 64 - used;
+    if (toCopy > len) {
+      toCopy = len;
+    }
+    memcpy(&(context->buffer[used]), in, toCopy);
+    in += toCopy, len -= toCopy, used += toCopy;
+    if (used < 64) {
+      return;
+    }
+    md5_transform(context->state, context->buffer);
+  }
+
+  while (len >= 64) {
+    md5_transform(context->state, in);
+    in += 64, len -= 64;
+  }
+
+  memcpy(context->buffer, in, len);
+}
+
+static void md5_final(MD5Context *context, unsigned char digest[16])
+{
+  static const unsigned char padding[64] = { 0x80 };
+  unsigned char bits[8];
+  uint64_t length = context->length * 8;
+  size_t used = context->length & 63;
+  int i;
+
+  for (i = 0; i < 8; i++) {
+    bits[i] = (unsigned char) (length >> (i * 8));
+  }
+  md5_update(context, padding, (used < 56) ? (56 - used) : (120 - used));
+  md5_update(context, bits, 8);
+
+  for (i = 0; i < 16; i++) {
+    digest[i] = (unsigned char) (context->state[i / 4] >> ((i % 4) * 8));
+  }
+}
+
+static void md5_hex(const unsigned char digest[16], char hex[33])
+{
+  int i;
+
+  for (i = 0; i < 16; i++) {
+    sprintf(&(hex[i * 2]), "%02x", digest[i]);
+  }
+}
+
+// CRC32C (Castagnoli), which objects may carry in x-amz-meta-crc32c as 8 hex
+// digits.  x86 CPUs with SSE4.2 compute it in hardware.
+
+static uint32_t crc32cTableG[256];
+static pthread_once_t crc32cOnceG = PTHREAD_ONCE_INIT;
+static int crc32cHardwareG;
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CRC32C_HARDWARE
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hardware(uint32_t crc, const unsigned char *data,
+    size_t len)
+{
+#ifdef __x86_64__
+  uint64_t crc64 = crc;
+  while (len >= 8) {
+    uint64_t v;
+    memcpy(&v, data, 8);
+    crc64 = __builtin_ia32_crc32di(crc64, v);
+    data += 8, len -= 8;
+  }
+  crc = (uint32_t) crc64;
+#endif
+  while (len >= 4) {
+    uint32_t v;
+    memcpy(&v, data, 4);
+    crc = __builtin_ia32_crc32si(crc, v);
+    data += 4, len -= 4;
+  }
+  while (len--) {
+    crc = __builtin_ia32_crc32qi(crc, *data++);
+  }
+  return crc;
+}
+#endif
+
+static void crc32c_init_once()
+{
+  uint32_t i, j;
+
+  for (i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (j = 0; j < 8; j++) {
+      crc = (crc >> 1) ^ ((crc & 1) ? 0x82f63b78 : 0);
+    }
+    crc32cTableG[i] = crc;
+  }
+#ifdef CRC32C_HARDWARE
+  __builtin_cpu_init();
+  crc32cHardwareG = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+// Continues crc, 0 to start, over len more bytes of data
+static uint32_t crc32c_update(uint32_t crc, const void *data, size_t len)
+{
+  const unsigned char *in = (const unsigned char *) data;
+
+  pthread_once(&crc32cOnceG, &crc32c_init_once);
+  crc = ~crc;
+#ifdef CRC32C_HARDWARE
+  if (crc32cHardwareG) {
+    return ~crc32c_hardware(crc, in, len);
+  }
+#endif
+  while (len--) {
+    crc = (crc >> 8) ^ crc32cTableG[(crc ^ *in++) & 0xff];
+  }
+  return ~crc;
+}
+
+// Splits an ETag into the MD5 it gives, in hex, and its part count: 0 for
+// the MD5 of the data, N for "md5-of-part-md5s-N".  Returns zero if the ETag
+// is not of either form, as for objects encrypted with SSE-KMS or SSE-C.
+static int etag_parse(const char *eTag, char hex[33], int *partCountReturn)
+{
+  int i;
+
+  if (!eTag) {
+    return 0;
+  }
+  if (*eTag == '"') {
+    eTag++;
+  }
+  for (i = 0; i < 32; i++) {
+    if (!isxdigit((unsigned char) eTag[i])) {
+      return 0;
+    }
+    hex[i] = tolower((unsigned char) eTag[i]);
+  }
+  hex[32] = 0;
+  eTag += 32;
+
+  *partCountReturn = 0;
+  if (*eTag == '-') {
+    char *end;
+    long partCount = strtol(eTag + 1, &end, 10);
+    if ((partCount < 1) || (partCount > MULTIPART_MAX_PARTS)) {
+      return 0;
+    }
+    *partCountReturn = (int) partCount;
+    eTag = end;
+  }
+  return (!*eTag || ((*eTag == '"') && !eTag[1]));
+}
+
+// A composite ETag only says how many parts there were, not how large they
+// were; at most this many part sizes that give that count are hashed for
+#define ETAG_VERIFY_MAX_CANDIDATES 3
+
+typedef struct ETagCandidate
+{
+  // 0 when the ETag is the MD5 of the data
+  uint64_t partSize;
+  // MD5 of the part MD5s so far, and of the part being received
+  MD5Context whole, part;
+  uint64_t partUsed;
+} ETagCandidate;
+
+// Checks downloaded data, as it is received, against the ETag and CRC32C
+// of the object
+typedef struct ETagVerifier
+{
+  char expected[33];
+  int partCount;
+  ETagCandidate candidates[ETAG_VERIFY_MAX_CANDIDATES];
+  int candidateCount;
+  int hasCrc32c;
+  uint32_t expectedCrc32c, crc32c;
+} ETagVerifier;
+
+static void etag_verifier_add_candidate(ETagVerifier *verifier,
+    uint64_t size, uint64_t partSize)
+{
+  int i;
+
+  if (!partSize || (verifier->candidateCount == ETAG_VERIFY_MAX_CANDIDATES) ||
+      (((size + partSize - 1) / partSize) != (uint64_t) verifier->partCount)) {
+    return;
+  }
+  for (i = 0; i < verifier->candidateCount; i++) {
+    if (verifier->candidates[i].partSize == partSize) {
+      return;
+    }
+  }
+
+  ETagCandidate *candidate = &(verifier->candidates[verifier->candidateCount++]);
+  candidate->partSize = partSize;
+  md5_init(&(candidate->whole));
+  md5_init(&(candidate->part));
+  candidate->partUsed = 0;
+}
+
+// Sets up verification of an object of the given properties, hashing with
+// partSize parts for a composite ETag when given.  Returns zero if nothing
+// about the object can be verified.
+static int etag_verifier_init(ETagVerifier *verifier,
+    const S3ResponseProperties *properties, uint64_t partSize)
+{
+  uint64_t size = properties->contentLength;
+  int i;
+
+  memset(verifier, 0, sizeof(*verifier));
+
+  for (i = 0; i < properties->metaDataCount; i++) {
+    if (!strcasecmp(properties->metaData[i].name, "crc32c")) {
+      char *end;
+      verifier->expectedCrc32c =
+        (uint32_t) strtoul(properties->metaData[i].value, &end, 16);
+      verifier->hasCrc32c = !*end;
+    }
+  }
+
+  if (etag_parse(properties->eTag, verifier->expected,
+          &(verifier->partCount))) {
+    if (!verifier->partCount) {
+      verifier->candidateCount = 1;
+      verifier->candidates[0].partSize = 0;
+      md5_init(&(verifier->candidates[0].part));
+    }
+    else {
+      // The given part size, the default one, then whole megabytes
+      etag_verifier_add_candidate(verifier, size, partSize);
+      etag_verifier_add_candidate(verifier, size, MULTIPART_CHUNK_SIZE);
+      uint64_t mb = 1024 * 1024;
+      etag_verifier_add_candidate(verifier, size,
+          (((size + verifier->partCount - 1) / verifier->partCount + mb - 1) /
+           mb) * mb);
+    }
+  }
+
+  return (verifier->candidateCount || verifier->hasCrc32c);
+}
+
+static void etag_verifier_update(ETagVerifier *verifier, const char *data,
+    int len)
+{
+  int i;
+
+  if (verifier->hasCrc32c) {
+    verifier->crc32c = crc32c_update(verifier->crc32c, data, len);
+  }
+
+  for (i = 0; i < verifier->candidateCount; i++) {
+    ETagCandidate *candidate = &(verifier->candidates[i]);
+    const char *in = data;
+    int remaining = len;
+    while (remaining > 0) {
+      int toHash = remaining;
+      if (candidate->partSize &&
+          ((uint64_t) toHash > (candidate->partSize - candidate->partUsed))) {
+        toHash = (int) (candidate->partSize - candidate->partUsed);
+      }
+      md5_update(&(candidate->part), in, toHash);
+      candidate->partUsed += toHash;
+      in += toHash, remaining -= toHash;
+      if (candidate->partSize && (candidate->partUsed == candidate->partSize)) {
+        unsigned char digest[16];
+        md5_final(&(candidate->part), digest);
+        md5_update(&(candidate->whole), digest, sizeof(digest));
+        md5_init(&(candidate->part));
+        candidate->partUsed = 0;
+      }
+    }
+  }
+}
+
+// Returns 1 if the data received matched, zero if it did not (its CRC32C or
+// the MD5 of a single-part object differs), or -1 if it could not be told:
+// no part size tried reproduces a composite ETag, which proves nothing as
+// the object may have been uploaded in parts of some other size.
+static int etag_verifier_final(ETagVerifier *verifier)
+{
+  int i, matched = !verifier->candidateCount;
+
+  if (verifier->hasCrc32c && (verifier->crc32c != verifier->expectedCrc32c)) {
+    return 0;
+  }
+
+  for (i = 0; i < verifier->candidateCount; i++) {
+    ETagCandidate *candidate = &(verifier->candidates[i]);
+    unsigned char digest[16];
+    char hex[33];
+    if (candidate->partSize && candidate->partUsed) {
+      md5_final(&(candidate->part), digest);
+      md5_update(&(candidate->whole), digest, sizeof(digest));
+    }
+    md5_final(candidate->partSize ? &(candidate->whole) : &(candidate->part),
+        digest);
+    md5_hex(digest, hex);
+    if (!strcmp(hex, verifier->expected)) {
+      matched = 1;
+    }
+  }
+
+  if (matched) {
+    return 1;
+  }
+  if (!verifier->partCount) {
+    return 0;
+  }
+  return verifier->hasCrc32c ? 1 : -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Downloads write their output through a WriteBehind: the data callback
+// copies received data into a ring of buffers and an I/O thread writes the
+// full ones to the file, so a slow disk does not hold up the receive path
+// until every buffer is waiting to be written.
+typedef struct WriteBehind
+{
+  int fd;
+  // Nonzero if fd supports pwrite; pipes are written sequentially
+  int seekable;
+  // File offset of the next byte received
+  uint64_t offset;
+  char **buffers;
+  int *sizes;
+  uint64_t *offsets;
+  int bufferSize, bufferCount;
+  // The oldest buffer waiting to be written, and the number of buffers
+  // waiting; the buffer after them is the one being filled
+  int head, full;
+  // errno of the first failed write
+  int error;
+  int running, stop;
+  pthread_mutex_t mutex;
+  pthread_cond_t fillCond, drainCond;
+  pthread_t thread;
+} WriteBehind;
+
+static void *write_behind_thread(void *arg)
+{
+  WriteBehind *writeBehind = (WriteBehind *) arg;
+
+  for (;;) {
+    pthread_mutex_lock(&(writeBehind->mutex));
+    while (!writeBehind->full && !writeBehind->stop) {
+      pthread_cond_wait(&(writeBehind->fillCond), &(writeBehind->mutex));
+    }
+    if (!writeBehind->full) {
+      pthread_mutex_unlock(&(writeBehind->mutex));
+      return 0;
+    }
+    int head = writeBehind->head;
+    int failed = writeBehind->error;
+    pthread_mutex_unlock(&(writeBehind->mutex));
+
+    // Queued buffers are not touched by the receive side, so the write
+    // happens without holding the mutex
+    const char *data = writeBehind->buffers[head];
+    uint64_t offset = writeBehind->offsets[head];
+    int remaining = writeBehind->sizes[head];
+    while (!failed && (remaining > 0)) {
+      ssize_t n = writeBehind->seekable ?
+        pwrite(writeBehind->fd, data, remaining, offset) :
+        write(writeBehind->fd, data, remaining);
+      if (n <= 0) {
+        failed = n ? errno : EIO;
+        break;
+      }
+      data += n, offset += n, remaining -= n;
+    }
+
+    pthread_mutex_lock(&(writeBehind->mutex));
+    if (failed && !writeBehind->error) {
+      writeBehind->error = failed;
+    }
+    writeBehind->sizes[head] = 0;
+    writeBehind->head = (head + 1) % writeBehind->bufferCount;
+    writeBehind->full--;
+    pthread_cond_signal(&(writeBehind->drainCond));
+    pthread_mutex_unlock(&(writeBehind->mutex));
+  }
+}
+
+static void write_behind_release(WriteBehind *writeBehind)
+{
+  int i;
+
+  for (i = 0; writeBehind->buffers && (i < writeBehind->bufferCount); i++) {
+    free(writeBehind->buffers[i]);
+  }
+  free(writeBehind->buffers);
+  free(writeBehind->sizes);
+  free(writeBehind->offsets);
+  pthread_cond_destroy(&(writeBehind->fillCond));
+  pthread_cond_destroy(&(writeBehind->drainCond));
+  pthread_mutex_destroy(&(writeBehind->mutex));
+}
+
+// Starts writing behind to fd from its current offset, or with sequential
+// set, with plain writes that follow whatever else is written to fd, through
+// the buffers described by options.  Returns zero on failure with errno set.
+static int write_behind_open(WriteBehind *writeBehind, int fd, int sequential,
+    const TransferOptions *options)
+{
+  int i;
+
+  memset(writeBehind, 0, sizeof(WriteBehind));
+  writeBehind->fd = fd;
+  writeBehind->bufferSize = options->ioBufferSize;
+  writeBehind->bufferCount = options->ioBufferCount;
+  pthread_mutex_init(&(writeBehind->mutex), 0);
+  pthread_cond_init(&(writeBehind->fillCond), 0);
+  pthread_cond_init(&(writeBehind->drainCond), 0);
+
+  off_t offset = sequential ? -1 : lseek(fd, 0, SEEK_CUR);
+  if (offset != (off_t) -1) {
+    writeBehind->seekable = 1;
+    writeBehind->offset = offset;
+  }
+
+  writeBehind->buffers = (char **) calloc(writeBehind->bufferCount,
+      sizeof(char *));
+  writeBehind->sizes = (int *) calloc(writeBehind->bufferCount, sizeof(int));
+  writeBehind->offsets = (uint64_t *) calloc(writeBehind->bufferCount,
+      sizeof(uint64_t));
+  if (!writeBehind->buffers || !writeBehind->sizes || !writeBehind->offsets) {
+    write_behind_release(writeBehind);
+    errno = ENOMEM;
+    return 0;
+  }
+  for (i = 0; i < writeBehind->bufferCount; i++) {
+    if (!(writeBehind->buffers[i] =
+          (char *) malloc(writeBehind->bufferSize))) {
+      write_behind_release(writeBehind);
+      errno = ENOMEM;
+      return 0;
+    }
+  }
+
+  if ((errno = pthread_create(&(writeBehind->thread), 0,
+          &write_behind_thread, writeBehind))) {
+    write_behind_release(writeBehind);
+    return 0;
+  }
+  writeBehind->running = 1;
+
+  return 1;
+}
+
+// Reserves disk space for length more bytes, so that the file does not
+// fragment as it grows and a full disk is found before the transfer
+static void write_behind_allocate(WriteBehind *writeBehind, uint64_t length)
+{
+  if (!writeBehind->seekable || !length) {
+    return;
+  }
+#if defined(__linux__) && defined(FALLOC_FL_KEEP_SIZE)
+  // Keep the size, so that a failed transfer does not leave a file padded
+  // with zeros
+  fallocate(writeBehind->fd, FALLOC_FL_KEEP_SIZE, writeBehind->offset,
+      length);
+#endif
+}
+
+// Queues the buffer in the tail slot for writing; mutex must be held
+static void write_behind_queue(WriteBehind *writeBehind, int tail, int size)
+{
+  writeBehind->sizes[tail] = size;
+  writeBehind->offsets[tail] = writeBehind->offset - size;
+  writeBehind->full++;
+  pthread_cond_signal(&(writeBehind->fillCond));
+}
+
+// Copies size bytes into the write buffers, waiting only when every buffer
+// is queued for writing.  Returns zero if an earlier write failed.
+static int write_behind_write(WriteBehind *writeBehind, const char *data,
+    int size)
+{
+  int ret = 1;
+
+  pthread_mutex_lock(&(writeBehind->mutex));
+  while (size > 0) {
+    while ((writeBehind->full == writeBehind->bufferCount) &&
+        !writeBehind->error) {
+      pthread_cond_wait(&(writeBehind->drainCond), &(writeBehind->mutex));
+    }
+    if (writeBehind->error) {
+      ret = 0;
+      break;
+    }
+
+    int tail = (writeBehind->head + writeBehind->full) %
+      writeBehind->bufferCount;
+    // The tail may be partly filled by earlier writes
+    int used = writeBehind->sizes[tail];
+    int toCopy = writeBehind->bufferSize - used;
+    if (toCopy > size) {
+      toCopy = size;
+    }
+    memcpy(&(writeBehind->buffers[tail][used]), data, toCopy);
+    writeBehind->sizes[tail] = used + toCopy;
+    writeBehind->offset += toCopy;
+    data += toCopy, size -= toCopy;
+
+    if (writeBehind->sizes[tail] == writeBehind->bufferSize) {
+      write_behind_queue(writeBehind, tail, writeBehind->bufferSize);
+    }
+  }
+  pthread_mutex_unlock(&(writeBehind->mutex));
+
+  return ret;
+}
+
+// Writes out what is still buffered, stops the I/O thread and releases the
+// buffers; fd stays open.  Returns 0, or the errno of the first failed write.
+static int write_behind_close(WriteBehind *writeBehind)
+{
+  if (writeBehind->running) {
+    pthread_mutex_lock(&(writeBehind->mutex));
+    int tail = (writeBehind->head + writeBehind->full) %
+      writeBehind->bufferCount;
+    if ((writeBehind->full < writeBehind->bufferCount) &&
+        writeBehind->sizes[tail]) {
+      write_behind_queue(writeBehind, tail, writeBehind->sizes[tail]);
+    }
+    writeBehind->stop = 1;
+    pthread_cond_signal(&(writeBehind->fillCond));
+    pthread_mutex_unlock(&(writeBehind->mutex));
+    pthread_join(writeBehind->thread, 0);
+    writeBehind->running = 0;
+  }
+
+  int error = writeBehind->error;
+  write_behind_release(writeBehind);
+  return error;
+}
+
+typedef struct get_object_callback_data
+{
+  WriteBehind sink;
+  // Nonzero once the sink was closed by the complete callback
+  int closed;
+  ProgressMeter progress;
+  // Nonzero while the data is being verified, with partSize as the first
+  // guess at the parts of a composite ETag
+  int verify;
+  uint64_t partSize;
+  ETagVerifier verifier;
+} get_object_callback_data;
+
+static S3Status getObjectPropertiesCallback(
+    const S3ResponseProperties *properties, void *callbackData)
+{
+  get_object_callback_data *data = (get_object_callback_data *) callbackData;
+
+  write_behind_allocate(&(data->sink), properties->contentLength);
+  data->progress.total = properties->contentLength;
+  if (data->verify && !(data->verify = etag_verifier_init(&(data->verifier),
+              properties, data->partSize))) {
+    fprintf(stderr, "\nWARNING: Neither the ETag nor a CRC32C of the object "
+        "can be checked; the download is not verified\n");
+  }
+  responsePropertiesCallback(properties, callbackData);
+  // The properties may go to the same stdout as the data
+  fflush(stdout);
+  return S3StatusOK;
+}
+
+static S3Status getObjectDataCallback(int bufferSize, const char *buffer,
+    void *callbackData)
+{
+  get_object_callback_data *data = (get_object_callback_data *) callbackData;
+
+  if (!write_behind_write(&(data->sink), buffer, bufferSize)) {
+    return S3StatusAbortedByCallback;
+  }
+  if (data->verify) {
+    etag_verifier_update(&(data->verifier), buffer, bufferSize);
+  }
+  progress_update(&(data->progress), bufferSize);
+  return S3StatusOK;
+}
+
+// The download is complete only once the data is written, so the sink is
+// flushed here and a failed write is reported as the status of the request
+static void getObjectCompleteCallback(S3Status status,
+    const S3ErrorDetails *error, void *callbackData)
+{
+  get_object_callback_data *data = (get_object_callback_data *) callbackData;
+  int writeError = write_behind_close(&(data->sink));
+
+  data->closed = 1;
+  if (writeError) {
+    fprintf(stderr, "\nERROR: Failed to write output: %s\n",
+        strerror(writeError));
+    if ((status == S3StatusOK) || (status == S3StatusAbortedByCallback)) {
+      status = S3StatusAbortedByCallback;
+    }
+  }
+  if ((status == S3StatusOK) && data->verify) {
+    int verified = etag_verifier_final(&(data->verifier));
+    if (!verified) {
+      fprintf(stderr, "\nERROR: The data received does not match the ETag "
+          "or CRC32C of the object\n");
+      status = S3StatusErrorBadDigest;
+    }
+    else if (verified < 0) {
+      fprintf(stderr, "\nWARNING: The object was uploaded in parts of an "
+          "unknown size, so the data received could not be verified\n");
+    }
+  }
+
+  responseCompleteCallback(status, error, 0);
+}
+
+static void get_object(const char *filename, const char *bucketName, const char *key,
+    const TransferOptions *options)
+{
+  int64_t ifModifiedSince = -1, ifNotModifiedSince = -1;
+  const char *ifMatch = 0, *ifNotMatch = 0;
+  uint64_t startByte = 0, byteCount = 0;
+
+  int fd = STDOUT_FILENO;
+  if (filename) {
+    // Stat the file, and if it doesn't exist, create it
+    struct stat buf;
+    if (stat(filename, &buf) == -1) {
+      fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+    }
+    else {
+      // Don't truncate the file, just in case there is an error and we
+      // write no bytes, we leave the file unmodified
+      fd = open(filename, O_WRONLY | O_BINARY);
+    }
+
+    if (fd < 0) {
+      fprintf(stderr, "\nERROR: Failed to open output file %s: ",
+          filename);
+      perror(0);
+      exit(-1);
+    }
+  }
+  else {
+    fflush(stdout);
+  }
+
+  get_object_callback_data data;
+  if (!write_behind_open(&(data.sink), fd, !filename, options)) {
+    perror("\nERROR: Failed to start the output writer");
+    exit(-1);
+  }
+  data.closed = 0;
+  data.verify = options->verify;
+  data.partSize = options->partSize;
+  // Progress would mix with the data on stdout
+  progress_init(&(data.progress), 0,
+      filename ? options->progressIntervalMs : 0, 0,
+      (filename && options->progressIntervalMs) ? &progressPrintCallback : 0,
+      0);
+
+  S3_init();
+
+  S3BucketContext bucketContext =
+  {
+    0,
+    bucketName,
+    protocolG,
+    uriStyleG,
+    accessKeyIdG,
+    secretAccessKeyG,
+    0
+  };
+
+  S3GetConditions getConditions =
+  {
+    ifModifiedSince,
+    ifNotModifiedSince,
+    ifMatch,
+    ifNotMatch
+  };
+
+  S3GetObjectHandler getObjectHandler =
+  {
+    { &getObjectPropertiesCallback, &getObjectCompleteCallback },
+    &getObjectDataCallback
+  };
+
+  RequestCancel cancel = { 0 };
+  RequestGuard guard;
+  guard_init(&guard, &deadlineG, &cancel);
+  cancel_on_interrupt(&cancel);
+
+  S3GetObjectHandler *handler =
+    guard_get_object_handler(&guard, key, &getObjectHandler, &data);
+  S3_get_object(&bucketContext, key, &getConditions, startByte,
+      byteCount, guard.context, handler, &guard);
+  guard_report(guard_run(&guard));
+
+  cancel_on_interrupt(0);
+  guard_destroy(&guard);
+
+  if (!data.closed) {
+    write_behind_close(&(data.sink));
+  }
+  if (filename) {
+    // Cut off what remains of a longer file that was overwritten
+    if (statusG == S3StatusOK) {
+      if (ftruncate(fd, data.sink.offset) < 0) {
+        fprintf(stderr, "\nERROR: Failed to truncate output: %s\n",
+            strerror(errno));
+        statusG = S3StatusAbortedByCallback;
+      }
+      else {
+        progress_finish(&(data.progress));
+      }
+    }
+    close(fd);
+  }
+
+  if (statusG != S3StatusOK) {
+    printError();
+  }
+
+  S3_deinitialize();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#define LIST_MAX_KEYS 1000
+// A partition that is not being written out stops listing once it has
+// buffered this many bytes of output, until it becomes the head
+#define LIST_PARTITION_BUFFER_MAX (4 * 1024 * 1024)
+
+// Split characters used when the keyspace is partitioned without an explicit
+// split= parameter; partition boundaries are picked evenly from these
+#define LIST_DEFAULT_SPLIT_CHARS \
+  "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz"
+
+struct ListBucketJob;
+
+// One lexicographic range of the keyspace: (lowerBound, upperBound]
+typedef struct ListPartition
+{
+  struct ListBucketJob *job;
+  // Listing starts after this key
+  char *lowerBound;
+  // Listing stops after this key; 0 for the last partition
+  char *upperBound;
+  char marker[S3_MAX_KEY_SIZE + 1];
+  int pending, done;
+  S3Status status;
+  // Output lines not written yet because an earlier partition is unfinished
+  growbuffer *output;
+  int buffered;
+} ListPartition;
+
+typedef struct ListBucketJob
+{
+  RequestPipeline pipeline;
+  const char *prefix, *delimiter;
+  int maxKeys;
+  ListPartition *partitions;
+  int partitionCount;
+  // The first partition whose output has not been completely written
+  int head;
+  uint64_t keyCount, commonPrefixCount;
+  S3Status status;
+} ListBucketJob;
+
+static int list_partition_append(ListPartition *partition, const char *line,
+    int len)
+{
+  if (partition == &(partition->job->partitions[partition->job->head])) {
+    return (fwrite(line, 1, len, stdout) == (size_t) len);
+  }
+  partition->buffered += len;
+  return growbuffer_append(&(partition->output), line, len);
+}
+
+static void list_partition_flush(ListPartition *partition)
+{
+  char buf[4096];
+  int n;
+
+  while (partition->output) {
+    growbuffer_read(&(partition->output), sizeof(buf), &n, buf);
+    fwrite(buf, 1, n, stdout);
+  }
+  partition->buffered = 0;
+}
+
+static S3Status listBucketCallback(int isTruncated, const char *nextMarker,
+    int contentsCount, const S3ListBucketContent *contents,
+    int commonPrefixesCount, const char **commonPrefixes, void *callbackData)
+{
+  ListPartition *partition = (ListPartition *) callbackData;
+  const char *last = 0;
+  int pastUpperBound = 0;
+  char line[S3_MAX_KEY_SIZE + 256];
+  int c = 0, p = 0, len;
+
+  // Contents and common prefixes both come back sorted; merge them so that
+  // the output stays in key order
+  while ((c < contentsCount) || (p < commonPrefixesCount)) {
+    const S3ListBucketContent *content = 0;
+    const char *name;
+    if ((p == commonPrefixesCount) || ((c < contentsCount) &&
+          (strcmp(contents[c].key, commonPrefixes[p]) < 0))) {
+      content = &(contents[c++]);
+      name = content->key;
+    }
+    else {
+      name = commonPrefixes[p++];
+    }
+
+    if (partition->upperBound && (strcmp(name, partition->upperBound) > 0)) {
+      pastUpperBound = 1;
+      break;
+    }
+
+    if (content) {
+      char timebuf[256];
+      time_t t = (time_t) content->lastModified;
+      strftime(timebuf, sizeof(timebuf), "%Y-%m-%dT%H:%M:%SZ", gmtime(&t));
+      len = snprintf(line, sizeof(line), "%s\t%llu\t%s\t%s\n", name,
+          (unsigned long long) content->size, timebuf,
+          content->eTag ? content->eTag : "");
+      partition->job->keyCount++;
+    }
+    else {
+      len = snprintf(line, sizeof(line), "%s\tPRE\n", name);
+      partition->job->commonPrefixCount++;
+    }
+    if (!list_partition_append(partition, line, len)) {
+      return S3StatusOutOfMemory;
+    }
+    last = name;
+  }
+
+  // S3 only returns NextMarker when a delimiter is given; otherwise the last
+  // key returned is the marker for the next page
+  if (nextMarker && nextMarker[0]) {
+    last = nextMarker;
+  }
+
+  if (!isTruncated || pastUpperBound || !last) {
+    partition->done = 1;
+  }
+  else {
+    snprintf(partition->marker, sizeof(partition->marker), "%s", last);
+  }
+
+  return S3StatusOK;
+}
+
+static void listBucketCompleteCallback(S3Status status,
+    const S3ErrorDetails *error, void *callbackData)
+{
+  ListPartition *partition = (ListPartition *) callbackData;
+  ListBucketJob *job = partition->job;
+
+  partition->pending = 0;
+  if (status != S3StatusOK) {
+    partition->status = status;
+    partition->done = 1;
+    if (job->status == S3StatusOK) {
+      responseCompleteCallback(status, error, 0);
+      job->status = status;
+    }
+  }
+  pipeline_release(&(job->pipeline));
+}
+
+// Builds the partitions (marker, b1], (b1, b2], ... (bn, end) where each
+// boundary bi is the prefix followed by one split character
+static int list_partitions_init(ListBucketJob *job, const char *marker,
+    const char *splitChars, int partitionCount)
+{
+  char chars[256];
+  int charCount = 0, i;
+
+  // Sort and deduplicate the split characters so the ranges are ordered
+  for (i = 1; i < 256; i++) {
+    if (strchr(splitChars, i)) {
+      chars[charCount++] = (char) i;
+    }
+  }
+  if (partitionCount > charCount + 1) {
+    partitionCount = charCount + 1;
+  }
+  if (partitionCount < 1) {
+    partitionCount = 1;
+  }
+
+  job->partitions = (ListPartition *)
+    calloc(partitionCount, sizeof(ListPartition));
+  if (!job->partitions) {
+    return 0;
+  }
+  job->partitionCount = partitionCount;
+
+  int prefixLen = job->prefix ? strlen(job->prefix) : 0;
+  int count = 0;
+  const char *previous = marker ? marker : "";
+  for (i = 0; i < partitionCount; i++) {
+    ListPartition *partition = &(job->partitions[count]);
+    partition->job = job;
+    partition->status = S3StatusOK;
+    if (i < partitionCount - 1) {
+      int c = ((i + 1) * charCount) / partitionCount;
+      partition->upperBound = (char *) malloc(prefixLen + 2);
+      if (!partition->upperBound) {
+        return 0;
+      }
+      memcpy(partition->upperBound, job->prefix, prefixLen);
+      partition->upperBound[prefixLen] = chars[c];
+      partition->upperBound[prefixLen + 1] = 0;
+      // A partition lying completely before the user's marker is skipped
+      if (strcmp(partition->upperBound, previous) <= 0) {
+        free(partition->upperBound);
+        partition->upperBound = 0;
+        continue;
+      }
+    }
+    partition->lowerBound = strdup(previous);
+    if (!partition->lowerBound) {
+      return 0;
+    }
+    snprintf(partition->marker, sizeof(partition->marker), "%s", previous);
+    if (partition->upperBound) {
+      previous = partition->upperBound;
+    }
+    count++;
+  }
+  job->partitionCount = count;
+
+  return 1;
+}
+
+static void list_partitions_destroy(ListBucketJob *job)
+{
+  int i;
+
+  for (i = 0; i < job->partitionCount; i++) {
+    free(job->partitions[i].lowerBound);
+    free(job->partitions[i].upperBound);
+    growbuffer_destroy(job->partitions[i].output);
+  }
+  free(job->partitions);
+}
+
+// Lists the bucket with up to parallel list requests in flight, each one
+// working on its own range of the keyspace.  Results are written to stdout
+// in key order: the output of the first unfinished partition is streamed
+// and later partitions are buffered, up to LIST_PARTITION_BUFFER_MAX each,
+// until it completes.
+static void list_bucket(const char *bucketName, const char *prefix,
+    const char *marker, const char *delimiter, int maxKeys, int parallel,
+    const char *splitChars)
+{
+  ListBucketJob job;
+  memset(&job, 0, sizeof(job));
+  job.prefix = prefix ? prefix : "";
+  job.delimiter = delimiter;
+  job.maxKeys = ((maxKeys > 0) && (maxKeys <= LIST_MAX_KEYS)) ?
+    maxKeys : LIST_MAX_KEYS;
+  job.status = S3StatusOK;
+
+  S3_init();
+
+  S3BucketContext bucketContext =
+  {
+    0,
+    bucketName,
+    protocolG,
+    uriStyleG,
+    accessKeyIdG,
+    secretAccessKeyG,
+    0
+  };
+
+  S3ListBucketHandler listBucketHandler =
+  {
+    { &responsePropertiesCallback, &listBucketCompleteCallback },
+    &listBucketCallback
+  };
+
+  if (!list_partitions_init(&job, marker,
+        splitChars ? splitChars : LIST_DEFAULT_SPLIT_CHARS,
+        splitChars ? (int) strlen(splitChars) + 1 : parallel)) {
+    statusG = S3StatusOutOfMemory;
+    printError();
+    goto clean;
+  }
+
+  if ((statusG = pipeline_create(&(job.pipeline), parallel)) != S3StatusOK) {
+    printError();
+    goto clean;
+  }
+
+  while (job.head < job.partitionCount) {
+    int i;
+    for (i = job.head; i < job.partitionCount; i++) {
+      ListPartition *partition = &(job.partitions[i]);
+      if (partition->done || partition->pending ||
+          ((i != job.head) &&
+           (partition->buffered >= LIST_PARTITION_BUFFER_MAX))) {
+        continue;
+      }
+      if (job.pipeline.inFlight == job.pipeline.maxInFlight) {
+        break;
+      }
+      if (!pipeline_acquire(&(job.pipeline))) {
+        printError();
+        goto clean;
+      }
+      partition->pending = 1;
+      S3_list_bucket(&bucketContext, job.prefix[0] ? job.prefix : 0,
+          partition->marker[0] ? partition->marker : 0, job.delimiter,
+          job.maxKeys, job.pipeline.context, &listBucketHandler, partition);
+    }
+
+    if (job.pipeline.inFlight &&
+        !pipeline_wait(&(job.pipeline), job.pipeline.inFlight - 1)) {
+      printError();
+      goto clean;
+    }
+
+    while ((job.head < job.partitionCount) &&
+        job.partitions[job.head].done) {
+      job.head++;
+      if (job.head < job.partitionCount) {
+        list_partition_flush(&(job.partitions[job.head]));
+      }
+    }
+  }
+
+  if (job.status != S3StatusOK) {
+    statusG = job.status;
+    printError();
+  }
+  else {
+    statusG = S3StatusOK;
+    fprintf(stderr, "%llu keys, %llu common prefixes\n",
+        (unsigned long long) job.keyCount,
+        (unsigned long long) job.commonPrefixCount);
+  }
+
+clean:
+  pipeline_destroy(&(job.pipeline));
+  list_partitions_destroy(&job);
+  S3_deinitialize();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Number of pages a list iterator fetches ahead of the page being consumed
+#define LIST_ITERATOR_DEFAULT_LOOKAHEAD 2
+
+// A page of list results copied out of the libs3 callback, whose arguments
+// only live for the duration of the call
+typedef struct ListPage
+{
+  // The items of the page followed by the strings they point to
+  char *items;
+  int count;
+  struct ListPage *next;
+} ListPage;
+
+struct ListIterator;
+
+typedef void (ListIteratorFetch)(struct ListIterator *iterator);
+
+// Pages through S3_list_bucket, S3_list_multipart_uploads or S3_list_parts.
+// While the caller consumes one page, up to lookahead following pages are
+// requested in the background on the iterator's request context.
+typedef struct ListIterator
+{
+  RequestPipeline pipeline;
+  S3BucketContext *bucketContext;
+  ListIteratorFetch *fetch;
+  size_t itemSize;
+  int lookahead;
+  const char *prefix, *key, *uploadId;
+  // Where the next page starts; updated as each page arrives
+  char keyMarker[S3_MAX_KEY_SIZE + 1];
+  char uploadIdMarker[256];
+  char partNumberMarker[32];
+  ListPage *pages, *lastPage;
+  int pageCount, position;
+  int pending, done;
+  S3Status status;
+} ListIterator;
+
+static ListPage *list_page_create(int count, size_t itemSize,
+    size_t stringsSize)
+{
+  size_t offset = (sizeof(ListPage) + 7) & ~((size_t) 7);
+  ListPage *page = (ListPage *)
+    malloc(offset + (count * itemSize) + stringsSize);
+
+  if (page) {
+    page->items = ((char *) page) + offset;
+    page->count = count;
+    page->next = 0;
+  }
+  return page;
+}
+
+static size_t list_page_string_size(const char *s)
+{
+  return s ? (strlen(s) + 1) : 0;
+}
+
+static const char *list_page_copy_string(char **cursor, const char *s)
+{
+  if (!s) {
+    return 0;
+  }
+  size_t len = strlen(s) + 1;
+  char *ret = (char *) memcpy(*cursor, s, len);
+  *cursor += len;
+  return ret;
+}
+
+static void list_iterator_push(ListIterator *iterator, ListPage *page)
+{
+  if (iterator->lastPage) {
+    iterator->lastPage->next = page;
+  }
+  else {
+    iterator->pages = page;
+  }
+  iterator->lastPage = page;
+  iterator->pageCount++;
+}
+
+static S3Status listBucketIteratorCallback(int isTruncated,
+    const char *nextMarker, int contentsCount,
+    const S3ListBucketContent *contents, int commonPrefixesCount,
+    const char **commonPrefixes, void *callbackData)
+{
+  ListIterator *iterator = (ListIterator *) callbackData;
+  size_t stringsSize = 0;
+  int i;
+
+  (void) commonPrefixesCount;
+  (void) commonPrefixes;
+
+  if (contentsCount > 0) {
+    for (i = 0; i < contentsCount; i++) {
+      stringsSize += list_page_string_size(contents[i].key) +
+        list_page_string_size(contents[i].eTag) +
+        list_page_string_size(contents[i].ownerId) +
+        list_page_string_size(contents[i].ownerDisplayName);
+    }
+
+    ListPage *page = list_page_create(contentsCount,
+        sizeof(S3ListBucketContent), stringsSize);
+    if (!page) {
+      return S3StatusOutOfMemory;
+    }
+
+    S3ListBucketContent *copies = (S3ListBucketContent *) page->items;
+    char *cursor = page->items + (contentsCount * sizeof(S3ListBucketContent));
+    for (i = 0; i < contentsCount; i++) {
+      copies[i] = contents[i];
+      copies[i].key = list_page_copy_string(&cursor, contents[i].key);
+      copies[i].eTag = list_page_copy_string(&cursor, contents[i].eTag);
+      copies[i].ownerId = list_page_copy_string(&cursor, contents[i].ownerId);
+      copies[i].ownerDisplayName =
+        list_page_copy_string(&cursor, contents[i].ownerDisplayName);
+    }
+    list_iterator_push(iterator, page);
+  }
+
+  if ((!nextMarker || !nextMarker[0]) && (contentsCount > 0)) {
+    nextMarker = contents[contentsCount - 1].key;
+  }
+  if (isTruncated && nextMarker && nextMarker[0]) {
+    snprintf(iterator->keyMarker, sizeof(iterator->keyMarker), "%s",
+        nextMarker);
+  }
+  else {
+    iterator->done = 1;
+  }
+
+  return S3StatusOK;
+}
+
+static S3Status listUploadsIteratorCallback(int isTruncated,
+    const char *nextKeyMarker, const char *nextUploadIdMarker,
+    int uploadsCount, const S3ListMultipartUpload *uploads,
+    int commonPrefixesCount, const char **commonPrefixes, void *callbackData)
+{
+  ListIterator *iterator = (ListIterator *) callbackData;
+  size_t stringsSize = 0;
+  int i;
+
+  (void) commonPrefixesCount;
+  (void) commonPrefixes;
+
+  if (uploadsCount > 0) {
+    for (i = 0; i < uploadsCount; i++) {
+      const S3ListMultipartUpload *upload = &(uploads[i]);
+      stringsSize += list_page_string_size(upload->key) +
+        list_page_string_size(upload->uploadId) +
+        list_page_string_size(upload->initiatorId) +
+        list_page_string_size(upload->initiatorDisplayName) +
+        list_page_string_size(upload->ownerId) +
+        list_page_string_size(upload->ownerDisplayName) +
+        list_page_string_size(upload->storageClass);
+    }
+
+    ListPage *page = list_page_create(uploadsCount,
+        sizeof(S3ListMultipartUpload), stringsSize);
+    if (!page) {
+      return S3StatusOutOfMemory;
+    }
+
+    S3ListMultipartUpload *copies = (S3ListMultipartUpload *) page->items;
+    char *cursor = page->items + (uploadsCount * sizeof(S3ListMultipartUpload));
+    for (i = 0; i < uploadsCount; i++) {
+      const S3ListMultipartUpload *upload = &(uploads[i]);
+      S3ListMultipartUpload *copy = &(copies[i]);
+      copy->key = list_page_copy_string(&cursor, upload->key);
+      copy->uploadId = list_page_copy_string(&cursor, upload->uploadId);
+      copy->initiatorId = list_page_copy_string(&cursor, upload->initiatorId);
+      copy->initiatorDisplayName =
+        list_page_copy_string(&cursor, upload->initiatorDisplayName);
+      copy->ownerId = list_page_copy_string(&cursor, upload->ownerId);
+      copy->ownerDisplayName =
+        list_page_copy_string(&cursor, upload->ownerDisplayName);
+      copy->storageClass =
+        list_page_copy_string(&cursor, upload->storageClass);
+      copy->initiated = upload->initiated;
+    }
+    list_iterator_push(iterator, page);
+  }
+
+  if (isTruncated && nextKeyMarker && nextKeyMarker[0]) {
+    snprintf(iterator->keyMarker, sizeof(iterator->keyMarker), "%s",
+        nextKeyMarker);
+    snprintf(iterator->uploadIdMarker, sizeof(iterator->uploadIdMarker), "%s",
+        nextUploadIdMarker ? nextUploadIdMarker : "");
+  }
+  else {
+    iterator->done = 1;
+  }
+
+  return S3StatusOK;
+}
+
+static S3Status listPartsIteratorCallback(int isTruncated,
+    const char *nextPartNumberMarker, const char *initiatorId,
+    const char *initiatorDisplayName, const char *ownerId,
+    const char *ownerDisplayName, const char *storageClass, int partsCount,
+    int lastPartNumber, const S3ListPart *parts, void *callbackData)
+{
+  ListIterator *iterator = (ListIterator *) callbackData;
+  size_t stringsSize = 0;
+  int i;
+
+  (void) initiatorId;
+  (void) initiatorDisplayName;
+  (void) ownerId;
+  (void) ownerDisplayName;
+  (void) storageClass;
+  (void) lastPartNumber;
+
+  if (partsCount > 0) {
+    for (i = 0; i < partsCount; i++) {
+      stringsSize += list_page_string_size(parts[i].eTag);
+    }
+
+    ListPage *page = list_page_create(partsCount, sizeof(S3ListPart),
+        stringsSize);
+    if (!page) {
+      return S3StatusOutOfMemory;
+    }
+
+    S3ListPart *copies = (S3ListPart *) page->items;
+    char *cursor = page->items + (partsCount * sizeof(S3ListPart));
+    for (i = 0; i < partsCount; i++) {
+      copies[i] = parts[i];
+      copies[i].eTag = list_page_copy_string(&cursor, parts[i].eTag);
+    }
+    list_iterator_push(iterator, page);
+  }
+
+  if (isTruncated && nextPartNumberMarker && nextPartNumberMarker[0]) {
+    snprintf(iterator->partNumberMarker, sizeof(iterator->partNumberMarker),
+        "%s", nextPartNumberMarker);
+  }
+  else {
+    iterator->done = 1;
+  }
+
+  return S3StatusOK;
+}
+
+static void listIteratorCompleteCallback(S3Status status,
+    const S3ErrorDetails *error, void *callbackData)
+{
+  ListIterator *iterator = (ListIterator *) callbackData;
+
+  iterator->pending = 0;
+  if (status != S3StatusOK) {
+    responseCompleteCallback(status, error, 0);
+    iterator->status = status;
+    iterator->done = 1;
+  }
+  pipeline_release(&(iterator->pipeline));
+}
+
+static S3ListBucketHandler listBucketIteratorHandlerG =
+{
+  { &responsePropertiesCallback, &listIteratorCompleteCallback },
+  &listBucketIteratorCallback
+};
+
+static S3ListMultipartUploadsHandler listUploadsIteratorHandlerG =
+{
+  { &responsePropertiesCallback, &listIteratorCompleteCallback },
+  &listUploadsIteratorCallback
+};
+
+static S3ListPartsHandler listPartsIteratorHandlerG =
+{
+  { &responsePropertiesCallback, &listIteratorCompleteCallback },
+  &listPartsIteratorCallback
+};
+
+static void list_bucket_fetch(ListIterator *iterator)
+{
+  S3_list_bucket(iterator->bucketContext, iterator->prefix,
+      iterator->keyMarker[0] ? iterator->keyMarker : 0, 0, LIST_MAX_KEYS,
+      iterator->pipeline.context, &listBucketIteratorHandlerG, iterator);
+}
+
+static void list_uploads_fetch(ListIterator *iterator)
+{
+  S3_list_multipart_uploads(iterator->bucketContext, iterator->prefix,
+      iterator->keyMarker[0] ? iterator->keyMarker : 0,
+      iterator->uploadIdMarker[0] ? iterator->uploadIdMarker : 0, 0, 0, 0,
+      iterator->pipeline.context, &listUploadsIteratorHandlerG, iterator);
+}
+
+static void list_parts_fetch(ListIterator *iterator)
+{
+  S3_list_parts(iterator->bucketContext, iterator->key,
+      iterator->partNumberMarker[0] ? iterator->partNumberMarker : 0,
+      iterator->uploadId, 0, 0, iterator->pipeline.context,
+      &listPartsIteratorHandlerG, iterator);
+}
+
+static S3Status list_iterator_init(ListIterator *iterator,
+    S3BucketContext *bucketContext, ListIteratorFetch *fetch,
+    size_t itemSize, int lookahead)
+{
+  memset(iterator, 0, sizeof(ListIterator));
+  iterator->bucketContext = bucketContext;
+  iterator->fetch = fetch;
+  iterator->itemSize = itemSize;
+  iterator->lookahead = (lookahead > 0) ?
+    lookahead : LIST_ITERATOR_DEFAULT_LOOKAHEAD;
+  iterator->status = S3StatusOK;
+  return pipeline_create(&(iterator->pipeline), 1);
+}
+
+static S3Status list_bucket_iterator_init(ListIterator *iterator,
+    S3BucketContext *bucketContext, const char *prefix, const char *marker,
+    int lookahead)
+{
+  S3Status status = list_iterator_init(iterator, bucketContext,
+      &list_bucket_fetch, sizeof(S3ListBucketContent), lookahead);
+  iterator->prefix = prefix;
+  if (marker) {
+    snprintf(iterator->keyMarker, sizeof(iterator->keyMarker), "%s", marker);
+  }
+  return status;
+}
+
+static S3Status list_uploads_iterator_init(ListIterator *iterator,
+    S3BucketContext *bucketContext, const char *prefix, int lookahead)
+{
+  S3Status status = list_iterator_init(iterator, bucketContext,
+      &list_uploads_fetch, sizeof(S3ListMultipartUpload), lookahead);
+  iterator->prefix = prefix;
+  return status;
+}
+
+static S3Status list_parts_iterator_init(ListIterator *iterator,
+    S3BucketContext *bucketContext, const char *key, const char *uploadId,
+    int lookahead)
+{
+  S3Status status = list_iterator_init(iterator, bucketContext,
+      &list_parts_fetch, sizeof(S3ListPart), lookahead);
+  iterator->key = key;
+  iterator->uploadId = uploadId;
+  return status;
+}
+
+static void list_iterator_destroy(ListIterator *iterator)
+{
+  pipeline_destroy(&(iterator->pipeline));
+  while (iterator->pages) {
+    ListPage *next = iterator->pages->next;
+    free(iterator->pages);
+    iterator->pages = next;
+  }
+  iterator->lastPage = 0;
+}
+
+// Points *item at the next item of the listing; the item stays valid until
+// the next call.  Returns 1 if an item was returned, 0 at the end of the
+// listing, and -1 on error, in which case iterator->status tells why.
+static int list_iterator_next(ListIterator *iterator, const void **item)
+{
+  for (;;) {
+    ListPage *page = iterator->pages;
+    if (page && (iterator->position == page->count)) {
+      iterator->pages = page->next;
+      if (!iterator->pages) {
+        iterator->lastPage = 0;
+      }
+      iterator->pageCount--;
+      iterator->position = 0;
+      free(page);
+      continue;
+    }
+
+    if (!iterator->pending && !iterator->done &&
+        (iterator->pageCount <= iterator->lookahead)) {
+      if (!pipeline_acquire(&(iterator->pipeline))) {
+        iterator->status = (S3Status) statusG;
+        return -1;
+      }
+      iterator->pending = 1;
+      (*(iterator->fetch))(iterator);
+    }
+
+    if (page) {
+      // Let the prefetch make progress without blocking the caller
+      if (iterator->pending && !pipeline_poll(&(iterator->pipeline), 0)) {
+        iterator->status = (S3Status) statusG;
+        return -1;
+      }
+      *item = page->items + (iterator->position++ * iterator->itemSize);
+      return 1;
+    }
+
+    if (iterator->done && !iterator->pending) {
+      return (iterator->status == S3StatusOK) ? 0 : -1;
+    }
+
+    if (!pipeline_poll(&(iterator->pipeline), 100)) {
+      iterator->status = (S3Status) statusG;
+      return -1;
+    }
+  }
+}
+
+static void list_uploads(const char *bucketName, const char *prefix,
+    int lookahead)
+{
+  ListIterator iterator;
+  const S3ListMultipartUpload *upload;
+  uint64_t count = 0;
+  int ret;
+
+  S3_init();
+
+  S3BucketContext bucketContext =
+  {
+    0,
+    bucketName,
+    protocolG,
+    uriStyleG,
+    accessKeyIdG,
+    secretAccessKeyG,
+    0
+  };
+
+  if ((statusG = list_uploads_iterator_init(&iterator, &bucketContext, prefix,
+          lookahead)) == S3StatusOK) {
+    while ((ret = list_iterator_next(&iterator, (const void **) &upload))
+        > 0) {
+      char timebuf[256];
+      time_t t = (time_t) upload->initiated;
+      strftime(timebuf, sizeof(timebuf), "%Y-%m-%dT%H:%M:%SZ", gmtime(&t));
+      printf("%s\t%s\t%s\n", upload->key, upload->uploadId, timebuf);
+      count++;
+    }
+    statusG = (ret < 0) ? iterator.status : S3StatusOK;
+  }
+  list_iterator_destroy(&iterator);
+
+  if (statusG != S3StatusOK) {
+    printError();
+  }
+  else {
+    fprintf(stderr, "%llu uploads\n", (unsigned long long) count);
+  }
+
+  S3_deinitialize();
+}
+
+static void list_parts(const char *bucketName, const char *key,
+    const char *uploadId, int lookahead)
+{
+  ListIterator iterator;
+  const S3ListPart *part;
+  uint64_t count = 0, size = 0;
+  int ret;
+
+  S3_init();
+
+  S3BucketContext bucketContext =
+  {
+    0,
+    bucketName,
+    protocolG,
+    uriStyleG,
+    accessKeyIdG,
+    secretAccessKeyG,
+    0
+  };
+
+  if ((statusG = list_parts_iterator_init(&iterator, &bucketContext, key,
+          uploadId, lookahead)) == S3StatusOK) {
+    while ((ret = list_iterator_next(&iterator, (const void **) &part)) > 0) {
+      printf("%llu\t%llu\t%s\n", (unsigned long long) part->partNumber,
+          (unsigned long long) part->size, part->eTag ? part->eTag : "");
+      count++;
+      size += part->size;
+    }
+    statusG = (ret < 0) ? iterator.status : S3StatusOK;
+  }
+  list_iterator_destroy(&iterator);
+
+  if (statusG != S3StatusOK) {
+    printError();
+  }
+  else {
+    fprintf(stderr, "%llu parts, %llu bytes\n", (unsigned long long) count,
+        (unsigned long long) size);
+  }
+
+  S3_deinitialize();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Keys are read and reported in batches of this many
+#define DELETE_BATCH_SIZE 1000
+
+#define DELETE_DEFAULT_PARALLEL 32
+
+struct DeleteBatch;
+
+typedef struct DeleteRequest
+{
+  struct DeleteBatch *batch;
+  const char *key;
+} DeleteRequest;
+
+// Compact per-key failure record: the position of the key in the batch and
+// the status its delete completed with
+typedef struct DeleteFailure
+{
+  int index;
+  S3Status status;
+} DeleteFailure;
+
+typedef struct DeleteBatch
+{
+  struct DeleteJob *job;
+  // The keys of the batch, packed one after another
+  growbuffer *keyBuffer;
+  char *keys;
+  DeleteRequest requests[DELETE_BATCH_SIZE];
+  int count, remaining;
+  DeleteFailure failures[DELETE_BATCH_SIZE];
+  int failureCount;
+} DeleteBatch;
+
+typedef struct DeleteJob
+{
+  RequestPipeline pipeline;
+  uint64_t deleted, failed;
+  S3Status status;
+} DeleteJob;
+
+// Reports the failures of a finished batch on stdout, one "key<TAB>status"
+// line each, so that they can be fed back into another delete run
+static void delete_batch_finish(DeleteBatch *batch)
+{
+  int i;
+
+  for (i = 0; i < batch->failureCount; i++) {
+    DeleteFailure *failure = &(batch->failures[i]);
+    printf("%s\t%s\n", batch->requests[failure->index].key,
+        S3_get_status_name(failure->status));
+  }
+  batch->job->failed += batch->failureCount;
+  batch->job->deleted += batch->count - batch->failureCount;
+  free(batch->keys);
+  free(batch);
+}
+
+static void deleteCompleteCallback(S3Status status,
+    const S3ErrorDetails *error, void *callbackData)
+{
+  DeleteRequest *request = (DeleteRequest *) callbackData;
+  DeleteBatch *batch = request->batch;
+  DeleteJob *job = batch->job;
+
+  if (status != S3StatusOK) {
+    DeleteFailure *failure = &(batch->failures[batch->failureCount++]);
+    failure->index = request - batch->requests;
+    failure->status = status;
+    if (job->status == S3StatusOK) {
+      responseCompleteCallback(status, error, 0);
+      job->status = status;
+    }
+  }
+  pipeline_release(&(job->pipeline));
+
+  if (--batch->remaining == 0) {
+    delete_batch_finish(batch);
+  }
+}
+
+// Reads up to DELETE_BATCH_SIZE keys, one per line, skipping those that are
+// too long.  Returns 0 at the end of the input or if out of memory.
+static DeleteBatch *delete_batch_read(DeleteJob *job, FILE *in)
+{
+  DeleteBatch *batch = (DeleteBatch *) calloc(1, sizeof(DeleteBatch));
+  char line[S3_MAX_KEY_SIZE + 2];
+  int offsets[DELETE_BATCH_SIZE];
+  int size = 0;
+  int i;
+
+  if (!batch) {
+    return 0;
+  }
+  batch->job = job;
+
+  int len;
+  while ((batch->count < DELETE_BATCH_SIZE) &&
+      ((len = read_line(in, line, sizeof(line))) >= 0)) {
+    if (!len) {
+      continue;
+    }
+    if (len > S3_MAX_KEY_SIZE) {
+      // Nothing is deleted for a key that did not fit, not even its start
+      printf("%s\t%s\n", line, S3_get_status_name(S3StatusKeyTooLong));
+      job->failed++;
+      if (job->status == S3StatusOK) {
+        job->status = S3StatusKeyTooLong;
+      }
+      continue;
+    }
+    if (!growbuffer_append(&(batch->keyBuffer), line, len + 1)) {
+      break;
+    }
+    offsets[batch->count++] = size;
+    size += len + 1;
+  }
+
+  if (!batch->count || !(batch->keys = (char *) malloc(size))) {
+    growbuffer_destroy(batch->keyBuffer);
+    free(batch);
+    return 0;
+  }
+
+  int n, copied = 0;
+  while (batch->keyBuffer) {
+    growbuffer_read(&(batch->keyBuffer), size - copied, &n,
+        &(batch->keys[copied]));
+    copied += n;
+  }
+  for (i = 0; i < batch->count; i++) {
+    batch->requests[i].batch = batch;
+    batch->requests[i].key = &(batch->keys[offsets[i]]);
+  }
+  batch->remaining = batch->count;
+
+  return batch;
+}
+
+// Deletes every key listed in the input, keeping up to parallel DELETE
+// requests in flight.  Batches overlap: the next batch is read and started
+// as soon as there is room in the pipeline.
+static void delete_objects(const char *bucketName, FILE *in, int parallel)
+{
+  DeleteJob job;
+  memset(&job, 0, sizeof(job));
+  job.status = S3StatusOK;
+
+  S3_init();
+
+  S3BucketContext bucketContext =
+  {
+    0,
+    bucketName,
+    protocolG,
+    uriStyleG,
+    accessKeyIdG,
+    secretAccessKeyG,
+    0
+  };
+
+  S3ResponseHandler deleteHandler =
+  {
+    &responsePropertiesCallback, &deleteCompleteCallback
+  };
+
+  if ((statusG = pipeline_create(&(job.pipeline), parallel)) != S3StatusOK) {
+    printError();
+    goto clean;
+  }
+
+  DeleteBatch *batch;
+  while ((batch = delete_batch_read(&job, in))) {
+    int i, count = batch->count;
+    for (i = 0; i < count; i++) {
+      if (!pipeline_acquire(&(job.pipeline))) {
+        printError();
+        goto clean;
+      }
+      S3_delete_object(&bucketContext, batch->requests[i].key,
+          job.pipeline.context, &deleteHandler, &(batch->requests[i]));
+    }
+  }
+
+  if (!pipeline_wait(&(job.pipeline), 0)) {
+    printError();
+    goto clean;
+  }
+
+  fprintf(stderr, "%llu deleted, %llu failed\n",
+      (unsigned long long) job.deleted, (unsigned long long) job.failed);
+  statusG = job.status;
+  if (statusG != S3StatusOK) {
+    printError();
+  }
+
+clean:
+  pipeline_destroy(&(job.pipeline));
+  S3_deinitialize();
+}
+
+static void delete_object(const char *bucketName, const char *key)
+{
+  S3_init();
+
+  S3BucketContext bucketContext =
+  {
+    0,
+    bucketName,
+    protocolG,
+    uriStyleG,
+    accessKeyIdG,
+    secretAccessKeyG,
+    0
+  };
+
+  S3ResponseHandler responseHandler =
+  {
+    &responsePropertiesCallback, &responseCompleteCallback
+  };
+
+  S3_delete_object(&bucketContext, key, 0, &responseHandler, 0);
+
+  if (statusG != S3StatusOK) {
+    printError();
+  }
+
+  S3_deinitialize();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#define COPY_DEFAULT_PARALLEL 16
+
+// S3 refuses to copy objects larger than this in a single request
+#define COPY_MAX_SINGLE_SIZE (((uint64_t) 5) << 30)
+
+typedef struct CopyRequest
+{
+  struct CopyJob *job;
+  char key[S3_MAX_KEY_SIZE + 1];
+  char destinationKey[S3_MAX_KEY_SIZE + 1];
+  char eTag[256];
+  int64_t lastModified;
+  uint64_t size;
+  // The copy may be sent to its own address of the endpoint
+  S3BucketContext bucketContext;
+  char host[DNS_ADDRESS_SIZE];
+  int dnsTicket;
+  // When the copy was sent, and how long until its response headers; -1 if
+  // they never arrived
+  int64_t startMs, responseMs;
+  struct CopyRequest *next;
+} CopyRequest;
+
+typedef struct CopyJob
+{
+  RequestPipeline pipeline;
+  // One request per pipeline slot; idle ones are kept on freeRequests
+  CopyRequest *requests, *freeRequests;
+  uint64_t copied, failed, bytes;
+  S3Status status;
+} CopyJob;
+
+static void copy_failed(CopyJob *job, const char *key, S3Status status)
+{
+  printf("%s\t%s\n", key, S3_get_status_name(status));
+  job->failed++;
+}
+
+static S3Status copyPropertiesCallback(const S3ResponseProperties *properties,
+    void *callbackData)
+{
+  CopyRequest *request = (CopyRequest *) callbackData;
+
+  request->responseMs = current_time_ms() - request->startMs;
+  return responsePropertiesCallback(properties, 0);
+}
+
+static void copyCompleteCallback(S3Status status, const S3ErrorDetails *error,
+    void *callbackData)
+{
+  CopyRequest *request = (CopyRequest *) callbackData;
+  CopyJob *job = request->job;
+
+  if (status == S3StatusOK) {
+    job->copied++;
+    job->bytes += request->size;
+  }
+  else {
+    copy_failed(job, request->key, status);
+    if (job->status == S3StatusOK) {
+      responseCompleteCallback(status, error, 0);
+      job->status = status;
+    }
+  }
+
+  dns_cache_report(&dnsCacheG, request->dnsTicket, status,
+      request->responseMs);
+  dns_cache_release(&dnsCacheG, request->dnsTicket);
+  request->next = job->freeRequests;
+  job->freeRequests = request;
+  pipeline_release(&(job->pipeline));
+}
+
+// Copies every object under prefix to destinationBucket, replacing prefix by
+// destinationPrefix in the key, with up to parallel copies in flight.  The
+// data never leaves S3.
+static void copy_prefix(const char *bucketName, const char *prefix,
+    const char *destinationBucket, const char *destinationPrefix,
+    int parallel)
+{
+  CopyJob job;
+  ListIterator iterator;
+  const S3ListBucketContent *content;
+  int prefixLen = strlen(prefix), destinationPrefixLen;
+  int i, ret;
+
+  if (!destinationBucket) {
+    destinationBucket = bucketName;
+  }
+  if (!destinationPrefix) {
+    destinationPrefix = prefix;
+  }
+  destinationPrefixLen = strlen(destinationPrefix);
+
+  // Copies landing under the source prefix would be listed and copied again
+  if (!strcmp(destinationBucket, bucketName) &&
+      !strncmp(destinationPrefix, prefix, prefixLen)) {
+    fprintf(stderr, "\nERROR: Destination %s is inside source prefix %s\n",
+        destinationPrefix, prefix);
+    statusG = S3StatusErrorInvalidArgument;
+    return;
+  }
+
+  memset(&job, 0, sizeof(job));
+  job.status = S3StatusOK;
+  if (parallel < 1) {
+    parallel = 1;
+  }
+
+  S3_init();
+
+  S3BucketContext bucketContext =
+  {
+    0,
+    bucketName,
+    protocolG,
+    uriStyleG,
+    accessKeyIdG,
+    secretAccessKeyG,
+    0
+  };
+
+  S3ResponseHandler copyHandler =
+  {
+    &copyPropertiesCallback, &copyCompleteCallback
+  };
+
+  if ((statusG = list_bucket_iterator_init(&iterator, &bucketContext, prefix,
+          0, 0)) != S3StatusOK) {
+    printError();
+    goto clean;
+  }
+
+  if ((statusG = pipeline_create(&(job.pipeline), parallel)) != S3StatusOK) {
+    printError();
+    goto clean;
+  }
+
+  if (!(job.requests = (CopyRequest *) calloc(parallel, sizeof(CopyRequest)))) {
+    statusG = S3StatusOutOfMemory;
+    printError();
+    goto clean;
+  }
+  for (i = 0; i < parallel; i++) {
+    job.requests[i].job = &job;
+    job.requests[i].next = job.freeRequests;
+    job.freeRequests = &(job.requests[i]);
+  }
+
+  while ((ret = list_iterator_next(&iterator, (const void **) &content)) > 0) {
+    if (content->size > COPY_MAX_SINGLE_SIZE) {
+      copy_failed(&job, content->key, S3StatusErrorEntityTooLarge);
+      continue;
+    }
+    if ((destinationPrefixLen + strlen(content->key) - prefixLen) >
+        S3_MAX_KEY_SIZE) {
+      copy_failed(&job, content->key, S3StatusKeyTooLong);
+      continue;
+    }
+
+    if (!pipeline_acquire(&(job.pipeline))) {
+      printError();
+      goto clean;
+    }
+    CopyRequest *request = job.freeRequests;
+    job.freeRequests = request->next;
+    snprintf(request->key, sizeof(request->key), "%s", content->key);
+    snprintf(request->destinationKey, sizeof(request->destinationKey),
+        "%s%s", destinationPrefix, &(content->key[prefixLen]));
+    request->size = content->size;
+    request->eTag[0] = 0;
+    request->dnsTicket = dns_bucket_context(&bucketContext,
+        &(request->bucketContext), request->host, sizeof(request->host));
+    request->startMs = current_time_ms();
+    request->responseMs = -1;
+
+    S3_copy_object(&(request->bucketContext), request->key, destinationBucket,
+        request->destinationKey, 0, &(request->lastModified),
+        sizeof(request->eTag), request->eTag, job.pipeline.context,
+        &copyHandler, request);
+  }
+
+  if (!pipeline_wait(&(job.pipeline), 0)) {
+    printError();
+    goto clean;
+  }
+
+  if (ret < 0) {
+    statusG = iterator.status;
+  }
+  else {
+    statusG = job.status;
+  }
+
+  fprintf(stderr, "%llu copied (%llu bytes), %llu failed\n",
+      (unsigned long long) job.copied, (unsigned long long) job.bytes,
+      (unsigned long long) job.failed);
+  if (dnsSpreadG != DnsSpreadOff) {
+    dns_cache_print_stats(&dnsCacheG);
+  }
+  if (statusG != S3StatusOK) {
+    printError();
+  }
+
+clean:
+  list_iterator_destroy(&iterator);
+  pipeline_destroy(&(job.pipeline));
+  free(job.requests);
+  dns_cache_shutdown(&dnsCacheG);
+  S3_deinitialize();
+}
+
+static void copy_object(const char *bucketName, const char *key,
+    const char *destinationBucket, const char *destinationKey)
+{
+  int64_t lastModified;
+  char eTag[256];
+
+  S3_init();
+
+  S3BucketContext bucketContext =
+  {
+    0,
+    bucketName,
+    protocolG,
+    uriStyleG,
+    accessKeyIdG,
+    secretAccessKeyG,
+    0
+  };
+
+  S3ResponseHandler responseHandler =
+  {
+    &responsePropertiesCallback, &responseCompleteCallback
+  };
+
+  eTag[0] = 0;
+  S3_copy_object(&bucketContext, key, destinationBucket, destinationKey, 0,
+      &lastModified, sizeof(eTag), eTag, 0, &responseHandler, 0);
+
+  if (statusG != S3StatusOK) {
+    printError();
+  }
+  else if (eTag[0]) {
+    printf("ETag: %s\n", eTag);
+  }
+
+  S3_deinitialize();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// ETags of local files
+
+// Computes the ETag S3 would give the first size bytes of fd: the MD5 of the
+// data when partCount is 0, otherwise the MD5 of the concatenated part MD5s
+// followed by "-partCount".  Returns zero on read error.
+static int file_compute_etag(int fd, uint64_t size, uint64_t partSize,
+    int partCount, char *eTag, int eTagSize)
+{
+  MD5Context whole, part;
+  unsigned char digest[16];
+  char buf[64 * 1024];
+  uint64_t offset = 0;
+  char hex[33];
+
+  md5_init(&whole);
+  while (offset < size) {
+    uint64_t partEnd = partCount ? (offset + partSize) : size;
+    if (partEnd > size) {
+      partEnd = size;
+    }
+    md5_init(&part);
+    while (offset < partEnd) {
+      size_t toRead = ((partEnd - offset) > sizeof(buf)) ?
+        sizeof(buf) : (size_t) (partEnd - offset);
+      ssize_t n = pread(fd, buf, toRead, offset);
+      if (n <= 0) {
+        return 0;
+      }
+      md5_update(&part, buf, n);
+      offset += n;
+    }
+    md5_final(&part, digest);
+    md5_update(&whole, digest, sizeof(digest));
+  }
+
+  if (!partCount) {
+    if (!size) {
+      md5_init(&part);
+      md5_final(&part, digest);
+    }
+    md5_hex(digest, hex);
+    snprintf(eTag, eTagSize, "%s", hex);
+  }
+  else {
+    md5_final(&whole, digest);
+    md5_hex(digest, hex);
+    snprintf(eTag, eTagSize, "%s-%d", hex, partCount);
+  }
+
+  return 1;
+}
+
+// Returns nonzero if the first size bytes of fd have the given ETag.  A
+// multipart ETag can only be reproduced if it was uploaded with partSize
+// parts; any other part count is treated as a mismatch.
+static int file_matches_etag(int fd, uint64_t size, uint64_t partSize,
+    const char *eTag)
+{
+  char expected[33], actual[64];
+  int partCount;
+
+  if (!etag_parse(eTag, expected, &partCount)) {
+    return 0;
+  }
+  if (partCount) {
+    if (!partSize ||
+        ((uint64_t) partCount != ((size + partSize - 1) / partSize))) {
+      return 0;
+    }
+  }
+
+  if (!file_compute_etag(fd, size, partSize, partCount, actual,
+        sizeof(actual))) {
+    return 0;
+  }
+
+  // actual goes on with "-partCount" for a composite ETag
+  return !strncmp(expected, actual, 32);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Work-stealing thread pool: each worker owns a deque, takes its own newest
+// task first and steals the oldest task of another worker when idle
+
+struct WorkPool;
+
+typedef void (WorkPoolRun)(struct WorkPool *pool, void *task, int worker);
+
+typedef struct WorkDeque
+{
+  pthread_mutex_t mutex;
+  void **tasks;
+  // Ring buffer: thieves take from top, the owner pushes and pops at
+  // top + count
+  int top, count, capacity;
+} WorkDeque;
+
+typedef struct WorkPoolWorker
+{
+  struct WorkPool *pool;
+  int index;
+  pthread_t thread;
+} WorkPoolWorker;
+
+typedef struct WorkPool
+{
+  WorkPoolRun *run;
+  void *data;
+  int workerCount;
+  WorkDeque *deques;
+  WorkPoolWorker *workers;
+  pthread_mutex_t mutex;
+  pthread_cond_t workCond, doneCond;
+  // Tasks sitting in deques, and tasks submitted but not yet finished
+  int queued, pending;
+  // Submissions from outside the pool wait while this many are queued
+  int maxQueued;
+  int nextDeque;
+  int shutdown;
+} WorkPool;
+
+static int work_deque_push(WorkDeque *deque, void *task)
+{
+  pthread_mutex_lock(&(deque->mutex));
+  if (deque->count == deque->capacity) {
+    int capacity = deque->capacity ? (deque->capacity * 2) : 64;
+    void **tasks = (void **) malloc(capacity * sizeof(void *));
+    if (!tasks) {
+      pthread_mutex_unlock(&(deque->mutex));
+      return 0;
+    }
+    int i;
+    for (i = 0; i < deque->count; i++) {
+      tasks[i] = deque->tasks[(deque->top + i) % deque->capacity];
+    }
+    free(deque->tasks);
+    deque->tasks = tasks;
+    deque->top = 0;
+    deque->capacity = capacity;
+  }
+  deque->tasks[(deque->top + deque->count++) % deque->capacity] = task;
+  pthread_mutex_unlock(&(deque->mutex));
+  return 1;
+}
+
+static void *work_deque_pop(WorkDeque *deque)
+{
+  void *task = 0;
+
+  pthread_mutex_lock(&(deque->mutex));
+  if (deque->count) {
+    task = deque->tasks[(deque->top + --deque->count) % deque->capacity];
+  }
+  pthread_mutex_unlock(&(deque->mutex));
+  return task;
+}
+
+static void *work_deque_steal(WorkDeque *deque)
+{
+  void *task = 0;
+
+  pthread_mutex_lock(&(deque->mutex));
+  if (deque->count) {
+    task = deque->tasks[deque->top];
+    deque->top = (deque->top + 1) % deque->capacity;
+    deque->count--;
+  }
+  pthread_mutex_unlock(&(deque->mutex));
+  return task;
+}
+
+static void *work_pool_worker(void *arg)
+{
+  WorkPoolWorker *worker = (WorkPoolWorker *) arg;
+  WorkPool *pool = worker->pool;
+
+  for (;;) {
+    void *task = work_deque_pop(&(pool->deques[worker->index]));
+    int i;
+    for (i = 1; !task && (i < pool->workerCount); i++) {
+      task = work_deque_steal(
+          &(pool->deques[(worker->index + i) % pool->workerCount]));
+    }
+
+    pthread_mutex_lock(&(pool->mutex));
+    if (!task) {
+      if (pool->shutdown) {
+        pthread_mutex_unlock(&(pool->mutex));
+        return 0;
+      }
+      if (pool->queued <= 0) {
+        pthread_cond_wait(&(pool->workCond), &(pool->mutex));
+      }
+      pthread_mutex_unlock(&(pool->mutex));
+      continue;
+    }
+    pool->queued--;
+    pthread_mutex_unlock(&(pool->mutex));
+
+    (*(pool->run))(pool, task, worker->index);
+
+    pthread_mutex_lock(&(pool->mutex));
+    pool->pending--;
+    pthread_cond_broadcast(&(pool->doneCond));
+    pthread_mutex_unlock(&(pool->mutex));
+  }
+}
+
+static int work_pool_create(WorkPool *pool, int workerCount, int maxQueued,
+    WorkPoolRun *run, void *data)
+{
+  int i;
+
+  memset(pool, 0, sizeof(WorkPool));
+  pool->run = run;
+  pool->data = data;
+  pool->maxQueued = maxQueued;
+  pool->workerCount = (workerCount > 0) ? workerCount : 1;
+  pthread_mutex_init(&(pool->mutex), 0);
+  pthread_cond_init(&(pool->workCond), 0);
+  pthread_cond_init(&(pool->doneCond), 0);
+
+  pool->deques = (WorkDeque *) calloc(pool->workerCount, sizeof(WorkDeque));
+  pool->workers = (WorkPoolWorker *)
+    calloc(pool->workerCount, sizeof(WorkPoolWorker));
+  if (!pool->deques || !pool->workers) {
+    return 0;
+  }
+
+  for (i = 0; i < pool->workerCount; i++) {
+    pthread_mutex_init(&(pool->deques[i].mutex), 0);
+  }
+  for (i = 0; i < pool->workerCount; i++) {
+    pool->workers[i].pool = pool;
+    pool->workers[i].index = i;
+    if (pthread_create(&(pool->workers[i].thread), 0, &work_pool_worker,
+          &(pool->workers[i]))) {
+      pool->workerCount = i;
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+// Queues a task.  Workers pass their own index so that the tasks they spawn
+// go to their own deque; other threads pass -1, which spreads tasks over the
+// deques and blocks while maxQueued tasks are waiting.
+static int work_pool_submit(WorkPool *pool, int worker, void *task)
+{
+  pthread_mutex_lock(&(pool->mutex));
+  if (worker < 0) {
+    while (pool->maxQueued && (pool->queued >= pool->maxQueued)) {
+      pthread_cond_wait(&(pool->doneCond), &(pool->mutex));
+    }
+    worker = pool->nextDeque;
+    pool->nextDeque = (pool->nextDeque + 1) % pool->workerCount;
+  }
+  pool->queued++;
+  pool->pending++;
+  pthread_mutex_unlock(&(pool->mutex));
+
+  if (!work_deque_push(&(pool->deques[worker]), task)) {
+    pthread_mutex_lock(&(pool->mutex));
+    pool->queued--;
+    pool->pending--;
+    pthread_cond_broadcast(&(pool->doneCond));
+    pthread_mutex_unlock(&(pool->mutex));
+    return 0;
+  }
+  pthread_cond_signal(&(pool->workCond));
+  return 1;
+}
+
+// Waits until every submitted task, including those spawned by tasks, is done
+static void work_pool_wait(WorkPool *pool)
+{
+  pthread_mutex_lock(&(pool->mutex));
+  while (pool->pending > 0) {
+    pthread_cond_wait(&(pool->doneCond), &(pool->mutex));
+  }
+  pthread_mutex_unlock(&(pool->mutex));
+}
+
+static void work_pool_destroy(WorkPool *pool)
+{
+  int i;
+
+  pthread_mutex_lock(&(pool->mutex));
+  pool->shutdown = 1;
+  pthread_cond_broadcast(&(pool->workCond));
+  pthread_mutex_unlock(&(pool->mutex));
+
+  for (i = 0; i < pool->workerCount; i++) {
+    pthread_join(pool->workers[i].thread, 0);
+  }
+  if (pool->deques) {
+    for (i = 0; i < pool->workerCount; i++) {
+      pthread_mutex_destroy(&(pool->deques[i].mutex));
+      free(pool->deques[i].tasks);
+    }
+  }
+  free(pool->deques);
+  free(pool->workers);
+  pthread_cond_destroy(&(pool->workCond));
+  pthread_cond_destroy(&(pool->doneCond));
+  pthread_mutex_destroy(&(pool->mutex));
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Stale multipart upload cleanup.  S3_abort_multipart_upload() is the one
+// request that takes neither a request context nor callback data, so aborts
+// cannot go through a RequestPipeline.  An AbortQueue runs them on worker
+// threads instead; a synchronous request calls back on the thread that made
+// it, so a thread-specific pointer routes each completion to its abort.
+
+#define ABORT_DEFAULT_PARALLEL 16
+
+// Uploads initiated longer ago than this are stale unless told otherwise
+#define ABORT_DEFAULT_AGE (24 * 60 * 60)
+
+// Called on a worker thread when an abort has completed
+typedef void (AbortCompleteCallback)(const char *key, const char *uploadId,
+    S3Status status, void *callbackData);
+
+typedef struct AbortQueue
+{
+  WorkPool pool;
+  S3BucketContext bucketContext;
+  AbortCompleteCallback *complete;
+  void *callbackData;
+} AbortQueue;
+
+typedef struct AbortTask
+{
+  // Both point into the same allocation as the task
+  char *key, *uploadId;
+  S3Status status;
+} AbortTask;
+
+static pthread_key_t abortTaskKeyG;
+static pthread_once_t abortTaskKeyOnceG = PTHREAD_ONCE_INIT;
+
+static void abort_task_key_create()
+{
+  pthread_key_create(&abortTaskKeyG, 0);
+}
+
+static S3Status abortPropertiesCallback(
+    const S3ResponseProperties *properties, void *callbackData)
+{
+  (void) properties;
+  (void) callbackData;
+  return S3StatusOK;
+}
+
+static void abortCompleteCallback(S3Status status,
+    const S3ErrorDetails *error, void *callbackData)
+{
+  AbortTask *task = (AbortTask *) pthread_getspecific(abortTaskKeyG);
+
+  (void) error;
+  (void) callbackData;
+  if (task) {
+    task->status = status;
+  }
+}
+
+static S3AbortMultipartUploadHandler abortHandlerG =
+{
+  { &abortPropertiesCallback, &abortCompleteCallback }
+};
+
+static void abort_task_run(WorkPool *pool, void *taskData, int worker)
+{
+  AbortQueue *queue = (AbortQueue *) pool->data;
+  AbortTask *task = (AbortTask *) taskData;
+
+  (void) worker;
+  task->status = S3StatusInternalError;
+  pthread_setspecific(abortTaskKeyG, task);
+  S3_abort_multipart_upload(&(queue->bucketContext), task->key,
+      task->uploadId, &abortHandlerG);
+  pthread_setspecific(abortTaskKeyG, 0);
+
+  if (queue->complete) {
+    (*(queue->complete))(task->key, task->uploadId, task->status,
+        queue->callbackData);
+  }
+  free(task);
+}
+
+// Starts parallel worker threads that abort uploads of the bucket, calling
+// complete for each.  Returns zero on failure; the queue must be destroyed
+// either way.
+static int abort_queue_create(AbortQueue *queue,
+    const S3BucketContext *bucketContext, int parallel,
+    AbortCompleteCallback *complete, void *callbackData)
+{
+  pthread_once(&abortTaskKeyOnceG, &abort_task_key_create);
+  memset(queue, 0, sizeof(*queue));
+  queue->bucketContext = *bucketContext;
+  queue->complete = complete;
+  queue->callbackData = callbackData;
+  return work_pool_create(&(queue->pool), parallel, parallel * 16,
+      &abort_task_run, queue);
+}
+
+// Queues the abort of one upload, blocking while the queue is full.  key and
+// uploadId are copied.  Returns zero if out of memory.
+static int abort_upload_async(AbortQueue *queue, const char *key,
+    const char *uploadId)
+{
+  size_t keySize = strlen(key) + 1, uploadIdSize = strlen(uploadId) + 1;
+  AbortTask *task = (AbortTask *)
+    malloc(sizeof(AbortTask) + keySize + uploadIdSize);
+
+  if (!task) {
+    return 0;
+  }
+  task->key = memcpy((char *) (task + 1), key, keySize);
+  task->uploadId = memcpy(task->key + keySize, uploadId, uploadIdSize);
+  if (!work_pool_submit(&(queue->pool), -1, task)) {
+    free(task);
+    return 0;
+  }
+  return 1;
+}
+
+// Waits for every queued abort to complete
+static void abort_queue_wait(AbortQueue *queue)
+{
+  work_pool_wait(&(queue->pool));
+}
+
+static void abort_queue_destroy(AbortQueue *queue)
+{
+  work_pool_destroy(&(queue->pool));
+}
+
+typedef struct AbortJob
+{
+  pthread_mutex_t mutex;
+  uint64_t aborted, failed;
+} AbortJob;
+
+static void abortJobCompleteCallback(const char *key, const char *uploadId,
+    S3Status status, void *callbackData)
+{
+  AbortJob *job = (AbortJob *) callbackData;
+
+  pthread_mutex_lock(&(job->mutex));
+  if (status == S3StatusOK) {
+    job->aborted++;
+  }
+  else {
+    job->failed++;
+    printf("%s\t%s\t%s\n", key, uploadId, S3_get_status_name(status));
+  }
+  pthread_mutex_unlock(&(job->mutex));
+}
+
+// Aborts every upload under prefix initiated more than age seconds ago,
+// parallel at a time, while the listing pages ahead.  With dryRun the
+// uploads are only printed.
+static void abort_stale_uploads(const char *bucketName, const char *prefix,
+    int64_t age, int parallel, int dryRun)
+{
+  ListIterator iterator;
+  AbortQueue queue;
+  AbortJob job;
+  const S3ListMultipartUpload *upload;
+  uint64_t stale = 0, kept = 0;
+  int64_t cutoff = (int64_t) time(0) - age;
+  int ret;
+
+  memset(&job, 0, sizeof(job));
+  pthread_mutex_init(&(job.mutex), 0);
+
+  S3_init();
+
+  S3BucketContext bucketContext =
+  {
+    0,
+    bucketName,
+    protocolG,
+    uriStyleG,
+    accessKeyIdG,
+    secretAccessKeyG,
+    0
+  };
+
+  if (!abort_queue_create(&queue, &bucketContext, parallel,
+          &abortJobCompleteCallback, &job)) {
+    statusG = S3StatusInternalError;
+    printError();
+    abort_queue_destroy(&queue);
+    goto clean;
+  }
+
+  if ((statusG = list_uploads_iterator_init(&iterator, &bucketContext, prefix,
+          0)) == S3StatusOK) {
+    while ((ret = list_iterator_next(&iterator, (const void **) &upload))
+        > 0) {
+      if (upload->initiated >= cutoff) {
+        kept++;
+        continue;
+      }
+      stale++;
+      if (dryRun) {
+        printf("%s\t%s\n", upload->key, upload->uploadId);
+      }
+      else if (!abort_upload_async(&queue, upload->key, upload->uploadId)) {
+        pthread_mutex_lock(&(job.mutex));
+        job.failed++;
+        pthread_mutex_unlock(&(job.mutex));
+      }
+    }
+    statusG = (ret < 0) ? iterator.status : S3StatusOK;
+  }
+  list_iterator_destroy(&iterator);
+
+  abort_queue_wait(&queue);
+  abort_queue_destroy(&queue);
+
+  if (statusG != S3StatusOK) {
+    printError();
+  }
+  fprintf(stderr, "%llu stale, %llu aborted, %llu failed, %llu kept\n",
+      (unsigned long long) stale, (unsigned long long) job.aborted,
+      (unsigned long long) job.failed, (unsigned long long) kept);
+  if ((statusG == S3StatusOK) && job.failed) {
+    statusG = S3StatusInternalError;
+  }
+
+clean:
+  pthread_mutex_destroy(&(job.mutex));
+  S3_deinitialize();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Directory sync: every file is a task, and each part of a large file is a
+// task of its own in the same pool
+
+#define SYNC_DEFAULT_PARALLEL 8
+
+// A file is downloaded under its name with this appended, and renamed over
+// the local copy once complete
+#define SYNC_TEMP_SUFFIX ".sync-tmp"
+
+typedef struct SyncJob
+{
+  WorkPool pool;
+  S3BucketContext bucketContext;
+  int download, force;
+  uint64_t partSize;
+  // Check downloads against the ETag and CRC32C of each object
+  int verify;
+  // Protects the counters below and the part bookkeeping of every SyncFile
+  pthread_mutex_t mutex;
+  uint64_t bytes, transferred, skipped, failed;
+  // Downloads that verify was set for but that could not be checked
+  uint64_t unverified;
+  // One guard per worker for the requests it makes, all cancelled together
+  // by an interrupt
+  RequestGuard *guards;
+  RequestCancel cancel;
+} SyncJob;
+
+typedef struct SyncFile
+{
+  SyncJob *job;
+  char *path;
+  // Where a download is written until it completes
+  char *tempPath;
+  char *key;
+  uint64_t size;
+  // The remote ETag, when known from a listing
+  char *eTag;
+  int fd;
+  char *uploadId;
+  char **eTags;
+  // MD5 of each part downloaded, when verifying
+  unsigned char (*partDigests)[16];
+  int partCount, partsRemaining;
+  S3Status status;
+} SyncFile;
+
+typedef struct SyncTask
+{
+  SyncFile *file;
+  // 0 for the task that starts the file, otherwise a part number
+  int part;
+} SyncTask;
+
+// Callback data of one synchronous request made by a sync task
+typedef struct SyncRequest
+{
+  int fd;
+  uint64_t offset, remaining;
+  uint64_t contentLength;
+  char eTag[256];
+  // Set to check a whole-object GET; cleared if the object has nothing to
+  // check it against
+  ETagVerifier *verifier;
+  // Set to hash a part GET into md5
+  int hashPart;
+  MD5Context md5;
+  S3Status status;
+} SyncRequest;
+
+static S3Status syncPropertiesCallback(const S3ResponseProperties *properties,
+    void *callbackData)
+{
+  SyncRequest *request = (SyncRequest *) callbackData;
+
+  request->contentLength = properties->contentLength;
+  snprintf(request->eTag, sizeof(request->eTag), "%s",
+      properties->eTag ? properties->eTag : "");
+  if (request->verifier &&
+      !etag_verifier_init(request->verifier, properties, 0)) {
+    request->verifier = 0;
+  }
+  return S3StatusOK;
+}
+
+static void syncCompleteCallback(S3Status status, const S3ErrorDetails *error,
+    void *callbackData)
+{
+  (void) error;
+  ((SyncRequest *) callbackData)->status = status;
+}
+
+static int syncPutDataCallback(int bufferSize, char *buffer,
+    void *callbackData)
+{
+  SyncRequest *request = (SyncRequest *) callbackData;
+
+  if (!request->remaining) {
+    return 0;
+  }
+  size_t toRead = (request->remaining > (unsigned) bufferSize) ?
+    (size_t) bufferSize : (size_t) request->remaining;
+  ssize_t n = pread(request->fd, buffer, toRead, request->offset);
+  if (n <= 0) {
+    return -1;
+  }
+  request->offset += n;
+  request->remaining -= n;
+  return n;
+}
+
+static S3Status syncGetDataCallback(int bufferSize, const char *buffer,
+    void *callbackData)
+{
+  SyncRequest *request = (SyncRequest *) callbackData;
+
+  if (request->verifier) {
+    etag_verifier_update(request->verifier, buffer, bufferSize);
+  }
+  if (request->hashPart) {
+    md5_update(&(request->md5), buffer, bufferSize);
+  }
+  while (bufferSize > 0) {
+    ssize_t n = pwrite(request->fd, buffer, bufferSize, request->offset);
+    if (n <= 0) {
+      return S3StatusAbortedByCallback;
+    }
+    buffer += n, bufferSize -= n, request->offset += n;
+  }
+  return S3StatusOK;
+}
+
+static S3ResponseHandler syncResponseHandlerG =
+{
+  &syncPropertiesCallback, &syncCompleteCallback
+};
+
+static S3PutObjectHandler syncPutHandlerG =
+{
+  { &syncPropertiesCallback, &syncCompleteCallback },
+  &syncPutDataCallback
+};
+
+static S3GetObjectHandler syncGetHandlerG =
+{
+  { &syncPropertiesCallback, &syncCompleteCallback },
+  &syncGetDataCallback
+};
+
+static S3Status syncInitialMultipartCallback(const char *upload_id,
+    void *callbackData)
+{
+  SyncRequest *request = (SyncRequest *) callbackData;
+  snprintf(request->eTag, sizeof(request->eTag), "%s", upload_id);
+  return S3StatusOK;
+}
+
+static S3MultipartInitialHander syncInitialHandlerG =
+{
+  { &syncPropertiesCallback, &syncCompleteCallback },
+  &syncInitialMultipartCallback
+};
+
+static S3Status syncIgnorePropertiesCallback(
+    const S3ResponseProperties *properties, void *callbackData)
+{
+  (void) properties;
+  (void) callbackData;
+  return S3StatusOK;
+}
+
+static void syncIgnoreCompleteCallback(S3Status status,
+    const S3ErrorDetails *error, void *callbackData)
+{
+  (void) status;
+  (void) error;
+  (void) callbackData;
+}
+
+// The commit reuses multipartPutXmlCallback, so the UploadManager comes first
+typedef struct SyncCommit
+{
+  UploadManager manager;
+  S3Status status;
+} SyncCommit;
+
+static void syncCommitCompleteCallback(S3Status status,
+    const S3ErrorDetails *error, void *callbackData)
+{
+  (void) error;
+  ((SyncCommit *) callbackData)->status = status;
+}
+
+static S3MultipartCommitHandler syncCommitHandlerG =
+{
+  { &syncIgnorePropertiesCallback, &syncCommitCompleteCallback },
+  &multipartPutXmlCallback,
+  0
+};
+
+static S3AbortMultipartUploadHandler syncAbortHandlerG =
+{
+  { &syncIgnorePropertiesCallback, &syncIgnoreCompleteCallback }
+};
+
+static void sync_file_destroy(SyncFile *file)
+{
+  int i;
+
+  if (file->fd >= 0) {
+    close(file->fd);
+  }
+  if (file->eTags) {
+    for (i = 0; i < file->partCount; i++) {
+      free(file->eTags[i]);
+    }
+    free(file->eTags);
+  }
+  free(file->partDigests);
+  free(file->uploadId);
+  free(file->eTag);
+  free(file->key);
+  free(file->tempPath);
+  free(file->path);
+  free(file);
+}
+
+static void sync_file_done(SyncFile *file, int transferred)
+{
+  SyncJob *job = file->job;
+
+  if (file->tempPath) {
+    if (file->fd >= 0) {
+      close(file->fd);
+      file->fd = -1;
+    }
+    if ((file->status == S3StatusOK) &&
+        RENAME(file->tempPath, file->path)) {
+      fprintf(stderr, "ERROR: %s: ", file->path);
+      perror(0);
+      file->status = S3StatusInternalError;
+    }
+    if (file->status != S3StatusOK) {
+      remove(file->tempPath);
+    }
+  }
+
+  pthread_mutex_lock(&(job->mutex));
+  if (file->status != S3StatusOK) {
+    job->failed++;
+  }
+  else if (transferred) {
+    job->transferred++;
+  }
+  else {
+    job->skipped++;
+  }
+  pthread_mutex_unlock(&(job->mutex));
+
+  if (file->status != S3StatusOK) {
+    fprintf(stderr, "ERROR: %s: %s\n", file->key,
+        S3_get_status_name(file->status));
+  }
+  sync_file_destroy(file);
+}
+
+static void sync_add_bytes(SyncJob *job, uint64_t bytes)
+{
+  pthread_mutex_lock(&(job->mutex));
+  job->bytes += bytes;
+  pthread_mutex_unlock(&(job->mutex));
+}
+
+// Creates the directories leading to path
+static void sync_make_parents(const char *path)
+{
+  char dir[4096];
+  char *slash;
+
+  snprintf(dir, sizeof(dir), "%s", path);
+  for (slash = strchr(dir + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+    *slash = 0;
+    MKDIR(dir);
+    *slash = '/';
+  }
+}
+
+// Commits a multipart upload once its last part is done, or aborts it if any
+// part failed
+static void sync_upload_commit(SyncFile *file, RequestGuard *guard)
+{
+  SyncJob *job = file->job;
+  SyncCommit commit;
+  char buf[512];
+  int i, n, size = 0;
+
+  if (file->status == S3StatusOK) {
+    memset(&commit, 0, sizeof(commit));
+    commit.status = S3StatusInternalError;
+    n = snprintf(buf, sizeof(buf), "<CompleteMultipartUpload>");
+    growbuffer_append(&(commit.manager.gb), buf, n);
+    size += n;
+    for (i = 0; i < file->partCount; i++) {
+      n = snprintf(buf, sizeof(buf),
+          "<Part><PartNumber>%d</PartNumber><ETag>%s</ETag></Part>",
+          i + 1, file->eTags[i]);
+      growbuffer_append(&(commit.manager.gb), buf, n);
+      size += n;
+    }
+    n = snprintf(buf, sizeof(buf), "</CompleteMultipartUpload>");
+    growbuffer_append(&(commit.manager.gb), buf, n);
+    size += n;
+    commit.manager.remaining = size;
+
+    S3MultipartCommitHandler *handler =
+      guard_commit_handler(guard, file->key, &syncCommitHandlerG, &commit);
+    S3_complete_multipart_upload(&(job->bucketContext), file->key, handler,
+        file->uploadId, size, guard->context, guard);
+    guard_run(guard);
+    growbuffer_destroy(commit.manager.gb);
+    file->status = commit.status;
+  }
+
+  if (file->status != S3StatusOK) {
+    S3_abort_multipart_upload(&(job->bucketContext), file->key,
+        file->uploadId, &syncAbortHandlerG);
+  }
+}
+
+// Checks a file downloaded in parts against its ETag: possible if it is a
+// composite ETag of parts the size of the ones downloaded.  A composite ETag
+// with as many parts that does not match may come from parts of another
+// size, so the file only counts as unverified.
+static void sync_verify_parts(SyncFile *file)
+{
+  SyncJob *job = file->job;
+  MD5Context whole;
+  unsigned char digest[16];
+  char expected[33], hex[33];
+  int partCount, i;
+
+  if (file->partDigests && etag_parse(file->eTag, expected, &partCount) &&
+      (partCount == file->partCount)) {
+    md5_init(&whole);
+    for (i = 0; i < file->partCount; i++) {
+      md5_update(&whole, file->partDigests[i], sizeof(file->partDigests[i]));
+    }
+    md5_final(&whole, digest);
+    md5_hex(digest, hex);
+    if (!strcmp(hex, expected)) {
+      return;
+    }
+  }
+
+  pthread_mutex_lock(&(job->mutex));
+  job->unverified++;
+  pthread_mutex_unlock(&(job->mutex));
+}
+
+static void sync_part_run(SyncFile *file, int part, int worker)
+{
+  SyncJob *job = file->job;
+  RequestGuard *guard = &(job->guards[worker]);
+  SyncRequest request;
+  S3BucketContext bucketContext;
+  char host[DNS_ADDRESS_SIZE];
+  int ticket = dns_bucket_context(&(job->bucketContext), &bucketContext,
+      host, sizeof(host));
+  uint64_t offset = (part - 1) * job->partSize;
+  uint64_t length = file->size - offset;
+
+  if (length > job->partSize) {
+    length = job->partSize;
+  }
+
+  memset(&request, 0, sizeof(request));
+  request.fd = file->fd;
+  request.offset = offset;
+  request.remaining = length;
+  request.status = S3StatusInternalError;
+
+  if (job->download) {
+    S3GetConditions conditions = { -1, -1, file->eTag, 0 };
+    if (file->partDigests) {
+      request.hashPart = 1;
+      md5_init(&(request.md5));
+    }
+    S3GetObjectHandler *handler =
+      guard_get_object_handler(guard, file->key, &syncGetHandlerG,
+          &request);
+    S3_get_object(&bucketContext, file->key, &conditions, offset,
+        length, guard->context, handler, guard);
+    guard_run(guard);
+    if ((request.status == S3StatusOK) && request.hashPart) {
+      md5_final(&(request.md5), file->partDigests[part - 1]);
+    }
+  }
+  else {
+    S3PutObjectHandler *handler =
+      guard_put_object_handler(guard, file->key, &syncPutHandlerG,
+          &request);
+    S3_upload_part(&bucketContext, file->key, 0, handler, part,
+        file->uploadId, (int) length, guard->context, guard);
+    guard_run(guard);
+  }
+
+  dns_cache_report(&dnsCacheG, ticket, request.status, guard->responseMs);
+  dns_cache_release(&dnsCacheG, ticket);
+  if (request.status == S3StatusOK) {
+    sync_add_bytes(job, length);
+  }
+
+  pthread_mutex_lock(&(job->mutex));
+  if (request.status != S3StatusOK) {
+    file->status = request.status;
+  }
+  else if (!job->download) {
+    file->eTags[part - 1] = strdup(request.eTag);
+  }
+  int last = (--file->partsRemaining == 0);
+  pthread_mutex_unlock(&(job->mutex));
+
+  if (last) {
+    if (!job->download) {
+      sync_upload_commit(file, guard);
+    }
+    else if (job->verify && (file->status == S3StatusOK)) {
+      sync_verify_parts(file);
+    }
+    sync_file_done(file, 1);
+  }
+}
+
+static void sync_file_transfer(SyncFile *file, int worker,
+    S3BucketContext *bucketContext, int ticket)
+{
+  SyncJob *job = file->job;
+  RequestGuard *guard = &(job->guards[worker]);
+  SyncRequest request;
+  int i;
+
+  memset(&request, 0, sizeof(request));
+
+  if (job->download) {
+    if (!job->force && ((file->fd = open(file->path, O_RDONLY | O_BINARY))
+          >= 0)) {
+      struct stat statbuf;
+      int unchanged = !fstat(file->fd, &statbuf) &&
+        ((uint64_t) statbuf.st_size == file->size) &&
+        file_matches_etag(file->fd, file->size, job->partSize, file->eTag);
+      close(file->fd);
+      if (unchanged) {
+        file->fd = -1;
+        sync_file_done(file, 0);
+        return;
+      }
+    }
+    sync_make_parents(file->path);
+    // A failed download leaves the local copy as it was
+    if (!(file->tempPath = (char *) malloc(strlen(file->path) +
+                sizeof(SYNC_TEMP_SUFFIX)))) {
+      file->status = S3StatusOutOfMemory;
+      sync_file_done(file, 0);
+      return;
+    }
+    sprintf(file->tempPath, "%s" SYNC_TEMP_SUFFIX, file->path);
+    file->fd = open(file->tempPath, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY,
+        0666);
+  }
+  else {
+    file->fd = open(file->path, O_RDONLY | O_BINARY);
+  }
+
+  if (file->fd < 0) {
+    fprintf(stderr, "ERROR: %s: ", file->path);
+    perror(0);
+    file->status = S3StatusInternalError;
+    sync_file_done(file, 0);
+    return;
+  }
+
+  if (!job->download && !job->force) {
+    request.status = S3StatusInternalError;
+    S3ResponseHandler *handler =
+      guard_response_handler(guard, "HEAD", file->key,
+          &syncResponseHandlerG, &request);
+    S3_head_object(bucketContext, file->key, guard->context, handler, guard);
+    guard_run(guard);
+    dns_cache_report(&dnsCacheG, ticket, request.status, guard->responseMs);
+    if ((request.status == S3StatusOK) &&
+        (request.contentLength == file->size) &&
+        file_matches_etag(file->fd, file->size, job->partSize,
+          request.eTag)) {
+      sync_file_done(file, 0);
+      return;
+    }
+  }
+
+  // Small files go in one request
+  if (file->size <= job->partSize) {
+    ETagVerifier verifier;
+    request.fd = file->fd;
+    request.offset = 0;
+    request.remaining = file->size;
+    request.status = S3StatusInternalError;
+    if (job->download) {
+      S3GetConditions conditions = { -1, -1, file->eTag, 0 };
+      request.verifier = job->verify ? &verifier : 0;
+      S3GetObjectHandler *handler =
+        guard_get_object_handler(guard, file->key, &syncGetHandlerG,
+            &request);
+      S3_get_object(bucketContext, file->key, &conditions, 0, 0,
+          guard->context, handler, guard);
+      guard_run(guard);
+      if ((request.status == S3StatusOK) && job->verify) {
+        int verified = request.verifier ?
+          etag_verifier_final(request.verifier) : -1;
+        if (!verified) {
+          request.status = S3StatusErrorBadDigest;
+        }
+        else if (verified < 0) {
+          pthread_mutex_lock(&(job->mutex));
+          job->unverified++;
+          pthread_mutex_unlock(&(job->mutex));
+        }
+      }
+    }
+    else {
+      S3PutObjectHandler *handler =
+        guard_put_object_handler(guard, file->key, &syncPutHandlerG,
+            &request);
+      S3_put_object(bucketContext, file->key, file->size, 0, guard->context,
+          handler, guard);
+      guard_run(guard);
+    }
+    dns_cache_report(&dnsCacheG, ticket, request.status, guard->responseMs);
+    file->status = request.status;
+    if (file->status == S3StatusOK) {
+      sync_add_bytes(job, file->size);
+    }
+    sync_file_done(file, 1);
+    return;
+  }
+
+  // Large files are split into part tasks, pushed on this worker's deque
+  // where idle workers can steal them
+  file->partCount = (file->size + job->partSize - 1) / job->partSize;
+  file->partsRemaining = file->partCount;
+
+  if (job->download) {
+    if (ftruncate(file->fd, file->size)) {
+      file->status = S3StatusInternalError;
+      sync_file_done(file, 0);
+      return;
+    }
+    if (job->verify && !(file->partDigests = calloc(file->partCount,
+                sizeof(*(file->partDigests))))) {
+      file->status = S3StatusOutOfMemory;
+      sync_file_done(file, 0);
+      return;
+    }
+  }
+  else {
+    request.status = S3StatusInternalError;
+    S3MultipartInitialHander *handler =
+      guard_initial_handler(guard, file->key, &syncInitialHandlerG,
+          &request);
+    S3_initiate_multipart(bucketContext, file->key, 0, handler,
+        guard->context, guard);
+    guard_run(guard);
+    file->eTags = (char **) calloc(file->partCount, sizeof(char *));
+    if ((request.status != S3StatusOK) || !file->eTags ||
+        !(file->uploadId = strdup(request.eTag))) {
+      file->status = (request.status != S3StatusOK) ?
+        request.status : S3StatusOutOfMemory;
+      sync_file_done(file, 0);
+      return;
+    }
+  }
+
+  for (i = file->partCount; i > 0; i--) {
+    SyncTask *task = (SyncTask *) malloc(sizeof(SyncTask));
+    if (task) {
+      task->file = file;
+      task->part = i;
+    }
+    if (!task || !work_pool_submit(&(job->pool), worker, task)) {
+      free(task);
+      // Account for the parts that will never run
+      pthread_mutex_lock(&(job->mutex));
+      file->status = S3StatusOutOfMemory;
+      int last = ((file->partsRemaining -= i) == 0);
+      pthread_mutex_unlock(&(job->mutex));
+      if (last) {
+        if (!job->download) {
+          sync_upload_commit(file, guard);
+        }
+        sync_file_done(file, 0);
+      }
+      return;
+    }
+  }
+}
+
+static void sync_file_start(SyncFile *file, int worker)
+{
+  S3BucketContext bucketContext;
+  char host[DNS_ADDRESS_SIZE];
+  int ticket = dns_bucket_context(&(file->job->bucketContext),
+      &bucketContext, host, sizeof(host));
+
+  // file may be gone once this returns
+  sync_file_transfer(file, worker, &bucketContext, ticket);
+  dns_cache_release(&dnsCacheG, ticket);
+}
+
+static void sync_task_run(WorkPool *pool, void *taskData, int worker)
+{
+  SyncTask *task = (SyncTask *) taskData;
+  SyncFile *file = task->file;
+  int part = task->part;
+
+  (void) pool;
+  free(task);
+
+  if (part) {
+    sync_part_run(file, part, worker);
+  }
+  else {
+    sync_file_start(file, worker);
+  }
+}
+
+static void sync_submit(SyncJob *job, const char *path, const char *key,
+    uint64_t size, const char *eTag)
+{
+  SyncFile *file = (SyncFile *) calloc(1, sizeof(SyncFile));
+  SyncTask *task = (SyncTask *) malloc(sizeof(SyncTask));
+
+  if (!file || !task || !(file->path = strdup(path)) ||
+      !(file->key = strdup(key)) || (eTag && !(file->eTag = strdup(eTag)))) {
+    fprintf(stderr, "ERROR: %s: out of memory\n", key);
+    pthread_mutex_lock(&(job->mutex));
+    job->failed++;
+    pthread_mutex_unlock(&(job->mutex));
+    if (file) {
+      file->fd = -1;
+      sync_file_destroy(file);
+    }
+    free(task);
+    return;
+  }
+  file->job = job;
+  file->size = size;
+  file->fd = -1;
+  file->status = S3StatusOK;
+  task->file = file;
+  task->part = 0;
+  work_pool_submit(&(job->pool), -1, task);
+}
+
+// Queues every regular file below the directory path; relative is its path
+// relative to the sync root, used to build the key
+static void sync_walk(SyncJob *job, const char *path, const char *prefix,
+    const char *relative)
+{
+  DIR *dir = opendir(path);
+  struct dirent *entry;
+
+  if (!dir) {
+    fprintf(stderr, "ERROR: %s: ", path);
+    perror(0);
+    return;
+  }
+
+  while ((entry = readdir(dir))) {
+    char childPath[4096], childRelative[S3_MAX_KEY_SIZE + 1];
+    char key[S3_MAX_KEY_SIZE + 1];
+    struct stat statbuf;
+
+    if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) {
+      continue;
+    }
+    snprintf(childPath, sizeof(childPath), "%s/%s", path, entry->d_name);
+    snprintf(childRelative, sizeof(childRelative), "%s%s%s", relative,
+        relative[0] ? "/" : "", entry->d_name);
+    if (stat(childPath, &statbuf) == -1) {
+      continue;
+    }
+    if (S_ISDIR(statbuf.st_mode)) {
+      sync_walk(job, childPath, prefix, childRelative);
+    }
+    else if (S_ISREG(statbuf.st_mode)) {
+      snprintf(key, sizeof(key), "%s%s", prefix, childRelative);
+      sync_submit(job, childPath, key, statbuf.st_size, 0);
+    }
+  }
+
+  closedir(dir);
+}
+
+// Uploads localDir to bucketName/prefix, or with download set, downloads
+// bucketName/prefix into localDir.  Files whose size and ETag already match
+// the other side are skipped unless force is set.
+static void sync_directory(const char *localDir, const char *bucketName,
+    const char *prefix, int download, int parallel, uint64_t partSize,
+    int force, int verify)
+{
+  SyncJob job;
+  struct timeval start, end;
+  int i;
+
+  memset(&job, 0, sizeof(job));
+  job.download = download;
+  job.force = force;
+  job.verify = verify;
+  job.partSize = partSize ? partSize : MULTIPART_CHUNK_SIZE;
+  if (!prefix) {
+    prefix = "";
+  }
+  // Each worker has one request in flight, so the same bound as for a
+  // RequestPipeline keeps TLS sessions in libs3's handle cache
+  if ((protocolG == S3ProtocolHTTPS) &&
+      (parallel > REQUEST_HANDLE_CACHE_SIZE)) {
+    fprintf(stderr, "Limiting parallel to %d so that TLS sessions are "
+        "reused\n", REQUEST_HANDLE_CACHE_SIZE);
+    parallel = REQUEST_HANDLE_CACHE_SIZE;
+  }
+  S3_init();
+
+  S3BucketContext bucketContext =
+  {
+    0,
+    bucketName,
+    protocolG,
+    uriStyleG,
+    accessKeyIdG,
+    secretAccessKeyG,
+    0
+  };
+  job.bucketContext = bucketContext;
+
+  pthread_mutex_init(&(job.mutex), 0);
+  gettimeofday(&start, 0);
+
+  if (parallel < 1) {
+    parallel = 1;
+  }
+  if (!(job.guards = (RequestGuard *)
+        calloc(parallel, sizeof(RequestGuard)))) {
+    statusG = S3StatusOutOfMemory;
+    printError();
+    goto clean;
+  }
+  for (i = 0; i < parallel; i++) {
+    if ((statusG = guard_init(&(job.guards[i]), &deadlineG, &(job.cancel)))
+        != S3StatusOK) {
+      printError();
+      goto clean;
+    }
+  }
+  cancel_on_interrupt(&(job.cancel));
+
+  if (!work_pool_create(&(job.pool), parallel, parallel * 16, &sync_task_run,
+        &job)) {
+    statusG = S3StatusInternalError;
+    printError();
+    work_pool_destroy(&(job.pool));
+    goto clean;
+  }
+
+  statusG = S3StatusOK;
+  if (download) {
+    ListIterator iterator;
+    const S3ListBucketContent *content;
+    int prefixLen = strlen(prefix), ret;
+
+    if ((statusG = list_bucket_iterator_init(&iterator, &(job.bucketContext),
+            prefix[0] ? prefix : 0, 0, 0)) == S3StatusOK) {
+      while ((ret = list_iterator_next(&iterator, (const void **) &content))
+          > 0) {
+        char path[4096];
+        int len = strlen(content->key);
+        if (len && (content->key[len - 1] == '/')) {
+          continue;
+        }
+        // A prefix without a trailing '/' leaves one at the start of the
+        // rest of the key, which names the file under localDir
+        const char *name = &(content->key[prefixLen]);
+        while (name[0] == '/') {
+          name++;
+        }
+        // A key such as "a/../../x" would be written outside localDir
+        if (!path_is_relative_below(name)) {
+          fprintf(stderr, "ERROR: %s: %s\n", content->key,
+              S3_get_status_name(S3StatusErrorInvalidArgument));
+          pthread_mutex_lock(&(job.mutex));
+          job.failed++;
+          pthread_mutex_unlock(&(job.mutex));
+          continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", localDir, name);
+        sync_submit(&job, path, content->key, content->size, content->eTag);
+      }
+      if (ret < 0) {
+        statusG = iterator.status;
+      }
+    }
+    list_iterator_destroy(&iterator);
+  }
+  else {
+    sync_walk(&job, localDir, prefix, "");
+  }
+
+  work_pool_wait(&(job.pool));
+  work_pool_destroy(&(job.pool));
+
+  gettimeofday(&end, 0);
+  double elapsed = (end.tv_sec - start.tv_sec) +
+    ((end.tv_usec - start.tv_usec) / 1000000.0);
+  fprintf(stderr, "%llu transferred, %llu unchanged, %llu failed: "
+      "%llu bytes in %.2f s (%.2f MB/s)\n",
+      (unsigned long long) job.transferred,
+      (unsigned long long) job.skipped, (unsigned long long) job.failed,
+      (unsigned long long) job.bytes, elapsed,
+      (elapsed > 0) ? ((job.bytes / elapsed) / (1024 * 1024)) : 0.0);
+  if (job.unverified) {
+    fprintf(stderr, "%llu downloaded that could not be verified\n",
+        (unsigned long long) job.unverified);
+  }
+  if (dnsSpreadG != DnsSpreadOff) {
+    dns_cache_print_stats(&dnsCacheG);
+  }
+
+  if (job.cancel.cancelled) {
+    fprintf(stderr, "Interrupted\n");
+  }
+
+  if (statusG != S3StatusOK) {
+    printError();
+  }
+  else if (job.failed) {
+    statusG = S3StatusInternalError;
+  }
+
+clean:
+  cancel_on_interrupt(0);
+  if (job.guards) {
+    for (i = 0; i < parallel; i++) {
+      guard_destroy(&(job.guards[i]));
+    }
+    free(job.guards);
+  }
+  pthread_mutex_destroy(&(job.mutex));
+  dns_cache_shutdown(&dnsCacheG);
+  S3_deinitialize();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Streaming upload: data of unknown length, such as a pipe, is cut into parts
+// as it arrives.  Each full part is sent while the next one fills, with up to
+// the pipeline's limit in flight, so at most that many part buffers plus the
+// one filling exist at a time.  Data that never fills a part goes up as one
+// PUT instead of a multipart upload.
+
+#define STREAM_DEFAULT_PARALLEL 4
+
+typedef struct StreamPart
+{
+  struct StreamUpload *upload;
+  struct StreamPart *next;
+  int seq;
+  char *data;
+  int size, offset;
+  char eTag[256];
+} StreamPart;
+
+typedef struct StreamUpload
+{
+  RequestPipeline pipeline;
+  S3BucketContext bucketContext;
+  const char *key;
+  int partSize;
+  // Set once the data outgrows one part
+  char *uploadId;
+  // The part being filled
+  char *buffer;
+  int bufferUsed;
+  // Bytes appended so far
+  uint64_t offset;
+  // ETags of the parts sent so far, by part number - 1
+  char **eTags;
+  int partCount, eTagsCapacity;
+  // Parts that completed, with their buffers, for the next part
+  StreamPart *freeParts;
+  S3Status status;
+} StreamUpload;
+
+static S3Status streamPartPropertiesCallback(
+    const S3ResponseProperties *properties, void *callbackData)
+{
+  StreamPart *part = (StreamPart *) callbackData;
+
+  snprintf(part->eTag, sizeof(part->eTag), "%s",
+      properties->eTag ? properties->eTag : "");
+  return S3StatusOK;
+}
+
+static int streamPartDataCallback(int bufferSize, char *buffer,
+    void *callbackData)
+{
+  StreamPart *part = (StreamPart *) callbackData;
+  int toCopy = part->size - part->offset;
+
+  if (toCopy > bufferSize) {
+    toCopy = bufferSize;
+  }
+  memcpy(buffer, &(part->data[part->offset]), toCopy);
+  part->offset += toCopy;
+  return toCopy;
+}
+
+static void streamPartCompleteCallback(S3Status status,
+    const S3ErrorDetails *error, void *callbackData)
+{
+  StreamPart *part = (StreamPart *) callbackData;
+  StreamUpload *upload = part->upload;
+
+  if ((status == S3StatusOK) &&
+      !(upload->eTags[part->seq - 1] = strdup(part->eTag))) {
+    status = S3StatusOutOfMemory;
+  }
+  if ((status != S3StatusOK) && (upload->status == S3StatusOK)) {
+    responseCompleteCallback(status, error, 0);
+    upload->status = status;
+  }
+
+  pipeline_release(&(upload->pipeline));
+  part->next = upload->freeParts;
+  upload->freeParts = part;
+}
+
+static S3PutObjectHandler streamPartHandlerG =
+{
+  { &streamPartPropertiesCallback, &streamPartCompleteCallback },
+  &streamPartDataCallback
+};
+
+// Sets up upload of key in parts of partSize bytes, with up to parallel
+// parts in flight.  Returns zero, with statusG set, on failure; the upload
+// must be closed with stream_upload_close() either way.
+static int stream_upload_open(StreamUpload *upload,
+    const S3BucketContext *bucketContext, const char *key, int partSize,
+    int parallel)
+{
+  memset(upload, 0, sizeof(*upload));
+  upload->bucketContext = *bucketContext;
+  upload->key = key;
+  upload->partSize = partSize;
+  upload->status = S3StatusOK;
+
+  if ((statusG = pipeline_create(&(upload->pipeline), parallel)) !=
+      S3StatusOK) {
+    return 0;
+  }
+  if (!(upload->buffer = (char *) malloc(partSize))) {
+    statusG = S3StatusOutOfMemory;
+    return 0;
+  }
+  return 1;
+}
+
+// Sends the filled buffer as the next part, starting the multipart upload
+// on the first call.  Returns zero on failure.
+static int stream_upload_flush(StreamUpload *upload)
+{
+  if (!upload->bufferUsed) {
+    return 1;
+  }
+
+  if (upload->partCount == MULTIPART_MAX_PARTS) {
+    fprintf(stderr, "\nERROR: More than %d parts of %d bytes; use a larger "
+        "part size\n", MULTIPART_MAX_PARTS, upload->partSize);
+    upload->status = S3StatusErrorEntityTooLarge;
+    return 0;
+  }
+
+  if (!upload->uploadId) {
+    UploadManager manager;
+    S3MultipartInitialHander handler =
+    {
+      { &responsePropertiesCallback, &responseCompleteCallback },
+      &initial_multipart_callback
+    };
+    memset(&manager, 0, sizeof(manager));
+    S3_initiate_multipart(&(upload->bucketContext), upload->key, 0, &handler,
+        0, &manager);
+    if (statusG != S3StatusOK) {
+      free(manager.upload_id);
+      upload->status = statusG;
+      return 0;
+    }
+    upload->uploadId = manager.upload_id;
+  }
+
+  if (upload->partCount == upload->eTagsCapacity) {
+    int capacity = upload->eTagsCapacity ? (upload->eTagsCapacity * 2) : 64;
+    char **eTags = (char **) realloc(upload->eTags,
+        capacity * sizeof(char *));
+    if (!eTags) {
+      upload->status = S3StatusOutOfMemory;
+      return 0;
+    }
+    memset(&(eTags[upload->eTagsCapacity]), 0,
+        (capacity - upload->eTagsCapacity) * sizeof(char *));
+    upload->eTags = eTags;
+    upload->eTagsCapacity = capacity;
+  }
+
+  if (!pipeline_acquire(&(upload->pipeline))) {
+    upload->status = statusG;
+    return 0;
+  }
+
+  // Completed parts are only put back while acquiring waits on the pipeline
+  StreamPart *part = upload->freeParts;
+  char *buffer;
+  if (part) {
+    upload->freeParts = part->next;
+    buffer = part->data;
+    alloc_stats_count(1);
+  }
+  else {
+    part = (StreamPart *) malloc(sizeof(StreamPart));
+    buffer = (char *) malloc(upload->partSize);
+    alloc_stats_count(0);
+    if (!part || !buffer) {
+      free(part);
+      free(buffer);
+      pipeline_release(&(upload->pipeline));
+      upload->status = S3StatusOutOfMemory;
+      return 0;
+    }
+  }
+
+  memset(part, 0, sizeof(*part));
+  part->upload = upload;
+  part->seq = ++upload->partCount;
+  part->data = upload->buffer;
+  part->size = upload->bufferUsed;
+  upload->buffer = buffer;
+  upload->bufferUsed = 0;
+
+  S3_upload_part(&(upload->bucketContext), upload->key, 0,
+      &streamPartHandlerG, part->seq, upload->uploadId, part->size,
+      upload->pipeline.context, part);
+
+  // A part that failed early makes the rest pointless
+  return (upload->status == S3StatusOK);
+}
+
+// Returns zero if the upload failed.
+static int stream_upload_append(StreamUpload *upload, const char *data,
+    int len)
+{
+  while (len > 0) {
+    int toCopy = upload->partSize - upload->bufferUsed;
+    if (toCopy > len) {
+      toCopy = len;
+    }
+    memcpy(&(upload->buffer[upload->bufferUsed]), data, toCopy);
+    upload->bufferUsed += toCopy;
+    upload->offset += toCopy;
+    data += toCopy, len -= toCopy;
+    if ((upload->bufferUsed == upload->partSize) &&
+        !stream_upload_flush(upload)) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+// Appends everything read from fd until end of file, reading straight into
+// the part buffers.  Returns zero if reading or the upload failed.
+static int stream_upload_read_fd(StreamUpload *upload, int fd)
+{
+  for (;;) {
+    ssize_t n = read(fd, &(upload->buffer[upload->bufferUsed]),
+        upload->partSize - upload->bufferUsed);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("\nERROR: Failed to read input");
+      upload->status = S3StatusAbortedByCallback;
+      return 0;
+    }
+    if (n == 0) {
+      return 1;
+    }
+    upload->bufferUsed += n;
+    upload->offset += n;
+    if ((upload->bufferUsed == upload->partSize) &&
+        !stream_upload_flush(upload)) {
+      return 0;
+    }
+  }
+}
+
+// Commits the upload: a single PUT if it fit in one part, otherwise the
+// last part and the multipart commit, or an abort if anything failed.
+// Leaves the result in statusG.
+static void stream_upload_finish(StreamUpload *upload)
+{
+  char buf[512];
+  int i, n, size = 0;
+
+  if (!upload->uploadId) {
+    if (upload->status == S3StatusOK) {
+      StreamPart part;
+      S3PutObjectHandler putHandler =
+      {
+        { &responsePropertiesCallback, &responseCompleteCallback },
+        &streamPartDataCallback
+      };
+      memset(&part, 0, sizeof(part));
+      part.upload = upload;
+      part.data = upload->buffer;
+      part.size = upload->bufferUsed;
+      S3_put_object(&(upload->bucketContext), upload->key, part.size, 0, 0,
+          &putHandler, &part);
+      upload->status = statusG;
+    }
+    statusG = upload->status;
+    return;
+  }
+
+  if (upload->status == S3StatusOK) {
+    stream_upload_flush(upload);
+  }
+  if (!pipeline_wait(&(upload->pipeline), 0) &&
+      (upload->status == S3StatusOK)) {
+    upload->status = statusG;
+  }
+
+  if (upload->status == S3StatusOK) {
+    UploadManager manager;
+    S3MultipartCommitHandler commitHandler =
+    {
+      { &responsePropertiesCallback, &responseCompleteCallback },
+      &multipartPutXmlCallback,
+      0
+    };
+    memset(&manager, 0, sizeof(manager));
+    n = snprintf(buf, sizeof(buf), "<CompleteMultipartUpload>");
+    growbuffer_append(&(manager.gb), buf, n);
+    size += n;
+    for (i = 0; i < upload->partCount; i++) {
+      n = snprintf(buf, sizeof(buf),
+          "<Part><PartNumber>%d</PartNumber><ETag>%s</ETag></Part>",
+          i + 1, upload->eTags[i]);
+      growbuffer_append(&(manager.gb), buf, n);
+      size += n;
+    }
+    n = snprintf(buf, sizeof(buf), "</CompleteMultipartUpload>");
+    growbuffer_append(&(manager.gb), buf, n);
+    size += n;
+    manager.remaining = size;
+
+    S3_complete_multipart_upload(&(upload->bucketContext), upload->key,
+        &commitHandler, upload->uploadId, size, 0, &manager);
+    growbuffer_destroy(manager.gb);
+    upload->status = statusG;
+  }
+
+  if (upload->status != S3StatusOK) {
+    S3AbortMultipartUploadHandler abortHandler =
+    {
+      { &responsePropertiesCallback, &responseCompleteCallback }
+    };
+    S3_abort_multipart_upload(&(upload->bucketContext), upload->key,
+        upload->uploadId, &abortHandler);
+  }
+  statusG = upload->status;
+}
+
+static void stream_upload_close(StreamUpload *upload)
+{
+  int i;
+
+  pipeline_destroy(&(upload->pipeline));
+  for (i = 0; i < upload->partCount; i++) {
+    free(upload->eTags[i]);
+  }
+  free(upload->eTags);
+  free(upload->uploadId);
+  free(upload->buffer);
+  while (upload->freeParts) {
+    StreamPart *part = upload->freeParts;
+    upload->freeParts = part->next;
+    free(part->data);
+    free(part);
+  }
+}
+
+// Uploads everything read from fd to key
+static void stream_object(const char *bucketName, const char *key, int fd,
+    const TransferOptions *options, int parallel)
+{
+  StreamUpload upload;
+  struct timeval start, end;
+
+  S3_init();
+
+  S3BucketContext bucketContext =
+  {
+    0,
+    bucketName,
+    protocolG,
+    uriStyleG,
+    accessKeyIdG,
+    secretAccessKeyG,
+    0
+  };
+
+  gettimeofday(&start, 0);
+
+  if (stream_upload_open(&upload, &bucketContext, key,
+          (int) options->partSize, parallel)) {
+    stream_upload_read_fd(&upload, fd);
+    stream_upload_finish(&upload);
+  }
+
+  if (statusG != S3StatusOK) {
+    printError();
+  }
+  else {
+    gettimeofday(&end, 0);
+    double seconds = (end.tv_sec - start.tv_sec) +
+      ((end.tv_usec - start.tv_usec) / 1000000.0);
+    fprintf(stderr, "%llu bytes in %d part%s, %.1f MB/s\n",
+        (unsigned long long) upload.offset,
+        upload.partCount ? upload.partCount : 1,
+        (upload.partCount > 1) ? "s" : "",
+        (seconds > 0) ? ((upload.offset / seconds) / (1024 * 1024)) : 0.0);
+  }
+
+  stream_upload_close(&upload);
+  S3_deinitialize();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Small-object packing: many small files are appended into one container
+// object, and an index object next to it gives the offset and length of each
+// member, so that members cost a fraction of a request each to write and read
+
+#define PACK_INDEX_SUFFIX ".idx"
+
+#define PACK_DEFAULT_PARALLEL 4
+
+// Members closer than this in the container are read with one ranged GET
+#define PACK_COALESCE_GAP (64 * 1024)
+
+// Upper bound on the span of one coalesced read
+#define PACK_MAX_READ (8 << 20)
+
+typedef struct PackJob
+{
+  // The container, written as a stream of member data
+  StreamUpload upload;
+  // One "offset\tlength\tname" line per member
+  growbuffer *index;
+  int indexSize;
+  uint64_t members;
+} PackJob;
+
+// Appends the contents of path to the container as member name.  Returns
+// zero if the job failed; a file that cannot be read is skipped, and one
+// that fails part way is left out of the index.
+static int pack_add_file(PackJob *job, const char *path, const char *name)
+{
+  char buf[64 * 1024];
+  uint64_t start = job->upload.offset;
+  size_t n;
+  FILE *in;
+
+  if (strchr(name, '\t')) {
+    fprintf(stderr, "\nERROR: Member name contains a tab: %s\n", name);
+    return 1;
+  }
+  // unpack refuses to extract anything else
+  if (!path_is_relative_below(name)) {
+    fprintf(stderr, "\nERROR: Member name leaves the directory it is "
+        "extracted to: %s\n", name);
+    return 1;
+  }
+  if (!(in = fopen(path, "r" FOPEN_EXTRA_FLAGS))) {
+    fprintf(stderr, "\nERROR: Failed to open input file %s: ", path);
+    perror(0);
+    return 1;
+  }
+
+  while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+    if (!stream_upload_append(&(job->upload), buf, n)) {
+      fclose(in);
+      return 0;
+    }
+  }
+  if (ferror(in)) {
+    fprintf(stderr, "\nERROR: Failed to read input file %s: ", path);
+    perror(0);
+    fclose(in);
+    return 1;
+  }
+  fclose(in);
+
+  n = snprintf(buf, sizeof(buf), "%llu\t%llu\t%s\n",
+      (unsigned long long) start, (unsigned long long) (job->upload.offset - start),
+      name);
+  if (!growbuffer_append(&(job->index), buf, n)) {
+    job->upload.status = S3StatusOutOfMemory;
+    return 0;
+  }
+  job->indexSize += n;
+  job->members++;
+  return 1;
+}
+
+// Packs the files listed one per line in names into the container object
+// key, with up to parallel parts in flight, then writes the index
+static void pack_objects(const char *bucketName, const char *key, FILE *names,
+    int parallel)
+{
+  PackJob job;
+  char path[4096], indexKey[S3_MAX_KEY_SIZE + 1];
+  int len;
+
+  memset(&job, 0, sizeof(job));
+
+  if (snprintf(indexKey, sizeof(indexKey), "%s" PACK_INDEX_SUFFIX, key) >=
+      (int) sizeof(indexKey)) {
+    statusG = S3StatusKeyTooLong;
+    printError();
+    return;
+  }
+
+  S3_init();
+
+  S3BucketContext bucketContext =
+  {
+    0,
+    bucketName,
+    protocolG,
+    uriStyleG,
+    accessKeyIdG,
+    secretAccessKeyG,
+    0
+  };
+
+  if (!stream_upload_open(&(job.upload), &bucketContext, key,
+          MULTIPART_CHUNK_SIZE, parallel)) {
+    printError();
+    goto clean;
+  }
+
+  while ((len = read_line(names, path, sizeof(path))) >= 0) {
+    if (len == (int) sizeof(path)) {
+      fprintf(stderr, "\nERROR: Path too long: %s\n", path);
+      continue;
+    }
+    // Members are named by their path made relative, so that "/a/b" and
+    // "./a/b" are extracted as "a/b"
+    const char *name = path;
+    while ((name[0] == '/') || !strncmp(name, "./", 2)) {
+      name += (name[0] == '/') ? 1 : 2;
+    }
+    if (len && !pack_add_file(&job, path, name)) {
+      break;
+    }
+  }
+
+  stream_upload_finish(&(job.upload));
+
+  if (job.upload.status == S3StatusOK) {
+    UploadManager manager;
+    S3PutObjectHandler indexHandler =
+    {
+      { &responsePropertiesCallback, &responseCompleteCallback },
+      &multipartPutXmlCallback
+    };
+    memset(&manager, 0, sizeof(manager));
+    manager.gb = job.index;
+    manager.remaining = job.indexSize;
+    S3_put_object(&(job.upload.bucketContext), indexKey, job.indexSize, 0, 0,
+        &indexHandler, &manager);
+    job.index = manager.gb;
+  }
+
+  if (statusG != S3StatusOK) {
+    printError();
+  }
+  else {
+    fprintf(stderr, "%llu members, %llu bytes in %d part%s\n",
+        (unsigned long long) job.members,
+        (unsigned long long) job.upload.offset,
+        job.upload.partCount ? job.upload.partCount : 1,
+        (job.upload.partCount > 1) ? "s" : "");
+  }
+
+clean:
+  stream_upload_close(&(job.upload));
+  if (job.index) {
+    growbuffer_destroy(job.index);
+  }
+  S3_deinitialize();
+}
+
+typedef struct PackMember
+{
+  const char *name;
+  uint64_t offset, length;
+  FILE *out;
+} PackMember;
+
+// One ranged GET covering members [first, first + count)
+typedef struct PackRead
+{
+  struct UnpackJob *job;
+  PackMember *first;
+  int count;
+  // Container offset of the next byte to arrive
+  uint64_t position;
+} PackRead;
+
+typedef struct UnpackJob
+{
+  RequestPipeline pipeline;
+  const char *outputDir;
+  uint64_t extracted, failed, requests;
+  S3Status status;
+} UnpackJob;
+
+static int packMemberCompare(const void *a, const void *b)
+{
+  const PackMember *ma = (const PackMember *) a, *mb = (const PackMember *) b;
+
+  return (ma->offset < mb->offset) ? -1 : (ma->offset > mb->offset);
+}
+
+static FILE *pack_open_member(UnpackJob *job, const PackMember *member)
+{
+  char path[4096];
+  FILE *out;
+
+  snprintf(path, sizeof(path), "%s/%s", job->outputDir, member->name);
+  sync_make_parents(path);
+  if (!(out = fopen(path, "w" FOPEN_EXTRA_FLAGS))) {
+    fprintf(stderr, "\nERROR: Failed to open output file %s: ", path);
+    perror(0);
+  }
+  return out;
+}
+
+static S3Status packReadDataCallback(int bufferSize, const char *buffer,
+    void *callbackData)
+{
+  PackRead *read = (PackRead *) callbackData;
+
+  while ((bufferSize > 0) && read->count) {
+    PackMember *member = read->first;
+    uint64_t end = member->offset + member->length;
+    uint64_t toCopy;
+
+    if (read->position < member->offset) {
+      // The gap between two coalesced members
+      toCopy = member->offset - read->position;
+      if (toCopy > (uint64_t) bufferSize) {
+        toCopy = bufferSize;
+      }
+    }
+    else {
+      toCopy = end - read->position;
+      if (toCopy > (uint64_t) bufferSize) {
+        toCopy = bufferSize;
+      }
+      if (!member->out && !(member->out = pack_open_member(read->job,
+              member))) {
+        return S3StatusAbortedByCallback;
+      }
+      if (fwrite(buffer, 1, toCopy, member->out) < toCopy) {
+        return S3StatusAbortedByCallback;
+      }
+    }
+
+    buffer += toCopy, bufferSize -= toCopy, read->position += toCopy;
+
+    if (read->position == end) {
+      fclose(member->out);
+      member->out = 0;
+      read->job->extracted++;
+      read->first++, read->count--;
+    }
+  }
+
+  return S3StatusOK;
+}
+
+static void packReadCompleteCallback(S3Status status,
+    const S3ErrorDetails *error, void *callbackData)
+{
+  PackRead *read = (PackRead *) callbackData;
+  UnpackJob *job = read->job;
+
+  if ((status == S3StatusOK) && read->count) {
+    status = S3StatusErrorIncompleteBody;
+  }
+  for (; read->count; read->first++, read->count--) {
+    printf("%s\t%s\n", read->first->name, S3_get_status_name(status));
+    if (read->first->out) {
+      fclose(read->first->out);
+      read->first->out = 0;
+    }
+    job->failed++;
+  }
+  if ((status != S3StatusOK) && (job->status == S3StatusOK)) {
+    responseCompleteCallback(status, error, 0);
+    job->status = status;
+  }
+
+  pipeline_release(&(job->pipeline));
+  free(read);
+}
+
+static S3Status packIndexDataCallback(int bufferSize, const char *buffer,
+    void *callbackData)
+{
+  return growbuffer_append((growbuffer **) callbackData, buffer, bufferSize) ?
+    S3StatusOK : S3StatusOutOfMemory;
+}
+
+// Extracts the named members of the container key (all of them if
+// nameCount is 0) into outputDir.  Members are read in container order, and
+// neighbours are fetched by one ranged GET, with up to parallel in flight.
+static void unpack_objects(const char *bucketName, const char *key,
+    const char *outputDir, int parallel, int nameCount, char **names)
+{
+  UnpackJob job;
+  growbuffer *gb = 0;
+  char *index = 0, indexKey[S3_MAX_KEY_SIZE + 1];
+  PackMember *members = 0;
+  int memberCount = 0, i, j, n;
+
+  memset(&job, 0, sizeof(job));
+  job.outputDir = outputDir ? outputDir : ".";
+  job.status = S3StatusOK;
+
+  if (snprintf(indexKey, sizeof(indexKey), "%s" PACK_INDEX_SUFFIX, key) >=
+      (int) sizeof(indexKey)) {
+    statusG = S3StatusKeyTooLong;
+    printError();
+    return;
+  }
+
+  S3_init();
+
+  S3BucketContext bucketContext =
+  {
+    0,
+    bucketName,
+    protocolG,
+    uriStyleG,
+    accessKeyIdG,
+    secretAccessKeyG,
+    0
+  };
+
+  S3GetObjectHandler indexHandler =
+  {
+    { &responsePropertiesCallback, &responseCompleteCallback },
+    &packIndexDataCallback
+  };
+
+  S3GetObjectHandler readHandler =
+  {
+    { &responsePropertiesCallback, &packReadCompleteCallback },
+    &packReadDataCallback
+  };
+
+  S3_get_object(&bucketContext, indexKey, 0, 0, 0, 0, &indexHandler, &gb);
+  if (statusG != S3StatusOK) {
+    printError();
+    goto clean;
+  }
+
+  // Read the whole index into one string and parse it in place
+  int indexSize = 0;
+  growbuffer *buf = gb;
+  while (buf) {
+    indexSize += buf->size;
+    buf = (buf->next == gb) ? 0 : buf->next;
+  }
+  if (!(index = (char *) malloc(indexSize + 1)) ||
+      !(members = (PackMember *) calloc(indexSize / 5 + 1,
+          sizeof(PackMember)))) {
+    statusG = S3StatusOutOfMemory;
+    printError();
+    goto clean;
+  }
+  for (i = 0; gb && (i < indexSize); i += n) {
+    growbuffer_read(&gb, indexSize - i, &n, &(index[i]));
+  }
+  index[i] = 0;
+
+  char *line, *next;
+  for (line = index; *line; line = next) {
+    char *name;
+    unsigned long long offset, length;
+    if ((next = strchr(line, '\n'))) {
+      *next++ = 0;
+    }
+    else {
+      next = &(line[strlen(line)]);
+    }
+    offset = strtoull(line, &name, 10);
+    if (*name++ != '\t') {
+      continue;
+    }
+    length = strtoull(name, &name, 10);
+    if (*name++ != '\t') {
+      continue;
+    }
+    if (nameCount) {
+      for (i = 0; (i < nameCount) && strcmp(names[i], name); i++) {
+      }
+      if (i == nameCount) {
+        continue;
+      }
+    }
+    // Members are written below outputDir only
+    if (!path_is_relative_below(name)) {
+      fprintf(stderr, "\nERROR: Skipping unsafe member name %s\n", name);
+      continue;
+    }
+    members[memberCount].name = name;
+    members[memberCount].offset = offset;
+    members[memberCount].length = length;
+    memberCount++;
+  }
+
+  qsort(members, memberCount, sizeof(PackMember), &packMemberCompare);
+
+  if ((statusG = pipeline_create(&(job.pipeline), parallel)) != S3StatusOK) {
+    printError();
+    goto clean;
+  }
+
+  for (i = 0; i < memberCount; i = j) {
+    // Empty members need no request
+    if (!members[i].length) {
+      if ((members[i].out = pack_open_member(&job, &(members[i])))) {
+        fclose(members[i].out);
+        members[i].out = 0;
+        job.extracted++;
+      }
+      else {
+        job.failed++;
+      }
+      j = i + 1;
+      continue;
+    }
+
+    uint64_t start = members[i].offset;
+    uint64_t end = start + members[i].length;
+    for (j = i + 1; j < memberCount; j++) {
+      uint64_t memberEnd = members[j].offset + members[j].length;
+      if (!members[j].length || (members[j].offset < end) ||
+          ((members[j].offset - end) > PACK_COALESCE_GAP) ||
+          ((memberEnd - start) > PACK_MAX_READ)) {
+        break;
+      }
+      end = memberEnd;
+    }
+
+    PackRead *read = (PackRead *) malloc(sizeof(PackRead));
+    if (!read) {
+      statusG = S3StatusOutOfMemory;
+      break;
+    }
+    if (!pipeline_acquire(&(job.pipeline))) {
+      free(read);
+      break;
+    }
+    read->job = &job;
+    read->first = &(members[i]);
+    read->count = j - i;
+    read->position = start;
+    job.requests++;
+    S3_get_object(&bucketContext, key, 0, start, end - start,
+        job.pipeline.context, &readHandler, read);
+  }
+
+  if (!pipeline_wait(&(job.pipeline), 0) || (statusG != S3StatusOK)) {
+    printError();
+    goto clean;
+  }
+
+  statusG = job.status;
+  fprintf(stderr, "%llu extracted with %llu requests, %llu failed\n",
+      (unsigned long long) job.extracted, (unsigned long long) job.requests,
+      (unsigned long long) job.failed);
+  if (statusG != S3StatusOK) {
+    printError();
+  }
+
+clean:
+  pipeline_destroy(&(job.pipeline));
+  for (i = 0; i < memberCount; i++) {
+    if (members[i].out) {
+      fclose(members[i].out);
+    }
+  }
+  free(members);
+  free(index);
+  if (gb) {
+    growbuffer_destroy(gb);
+  }
+  S3_deinitialize();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Fetching many small objects.  The libcurl that libs3.dll is built with has
+// no HTTP/2, so requests cannot be multiplexed over one connection; what
+// keeps small GETs from paying a connection setup each is reuse instead:
+// with at most REQUEST_HANDLE_CACHE_SIZE in flight every GET after the first
+// round goes out on a warm connection from libs3's handle cache.
+
+#define FETCH_MAX_PARALLEL REQUEST_HANDLE_CACHE_SIZE
+
+// A GET whose response has not started after a delay can be hedged: the same
+// GET is sent again on another connection and whichever response starts
+// first is kept.  The delay is either fixed or the given percentile of the
+// first-byte times of the last HEDGE_LATENCY_SAMPLES GETs, once at least
+// HEDGE_MIN_SAMPLES of them are known.  budget caps the hedges at that
+// percentage of the GETs sent.
+//
+// libs3 cannot cancel one request of a context, so the losing GET is aborted
+// from its next callback, and one that never answers keeps its pipeline slot
+// until the end of the fetch, when destroying the context interrupts it.
+#define HEDGE_LATENCY_SAMPLES 256
+#define HEDGE_MIN_SAMPLES 32
+#define HEDGE_DEFAULT_BUDGET 5
+#define HEDGE_POLL_MS 5
+
+typedef struct FetchHedge
+{
+  // Fixed delay, or zero to use percentile
+  int delayMs;
+  // Percentile of recent first-byte times, or zero
+  int percentile;
+  // The most hedges, as a percentage of the GETs sent
+  int budget;
+} FetchHedge;
+
+typedef struct FetchAttempt
+{
+  struct FetchRequest *request;
+  int64_t startMs;
+  // Nonzero while the GET is in the pipeline
+  int active;
+} FetchAttempt;
+
+typedef struct FetchRequest
+{
+  struct FetchJob *job;
+  char key[S3_MAX_KEY_SIZE + 1];
+  growbuffer *data;
+  uint64_t size;
+  // The first GET and its hedge
+  FetchAttempt attempts[2];
+  // The attempt whose response started first, or -1
+  int winner;
+  // Nonzero once the result of the request has been counted
+  int done;
+  struct FetchRequest *next;
+} FetchRequest;
+
+typedef struct FetchJob
+{
+  RequestPipeline pipeline;
+  const char *outputDir;
+  // One request per pipeline slot; idle ones are kept on freeRequests
+  FetchRequest *requests, *freeRequests;
+  int requestCount;
+  // Requests sent whose result is not counted yet
+  int unfinished;
+  uint64_t fetched, failed, bytes;
+  S3Status status;
+  const FetchHedge *hedge;
+  uint64_t sent, hedged, hedgesWon;
+  // Ring of the latest first-byte times
+  int latencies[HEDGE_LATENCY_SAMPLES];
+  int latencyCount, latencyNext;
+  // The hedge delay in effect, or -1 while too few latencies are known
+  int hedgeDelayMs;
+  int hedgeDelayStale;
+} FetchJob;
+
+static int latencyCompare(const void *a, const void *b)
+{
+  int la = *((const int *) a), lb = *((const int *) b);
+
+  return (la < lb) ? -1 : (la > lb);
+}
+
+static void fetch_record_latency(FetchJob *job, int latencyMs)
+{
+  job->latencies[job->latencyNext] = latencyMs;
+  job->latencyNext = (job->latencyNext + 1) % HEDGE_LATENCY_SAMPLES;
+  if (job->latencyCount < HEDGE_LATENCY_SAMPLES) {
+    job->latencyCount++;
+  }
+  job->hedgeDelayStale = 1;
+}
+
+// Returns the delay after which a GET without response is hedged, or -1 if
+// none is known yet
+static int fetch_hedge_delay(FetchJob *job)
+{
+  if (job->hedge->delayMs) {
+    return job->hedge->delayMs;
+  }
+
+  if (job->hedgeDelayStale) {
+    job->hedgeDelayStale = 0;
+    if (job->latencyCount < HEDGE_MIN_SAMPLES) {
+      job->hedgeDelayMs = -1;
+    }
+    else {
+      int sorted[HEDGE_LATENCY_SAMPLES];
+      memcpy(sorted, job->latencies, job->latencyCount * sizeof(int));
+      qsort(sorted, job->latencyCount, sizeof(int), &latencyCompare);
+      job->hedgeDelayMs =
+        sorted[((job->latencyCount - 1) * job->hedge->percentile) / 100];
+    }
+  }
+
+  return job->hedgeDelayMs;
+}
+
+static S3Status fetchPropertiesCallback(const S3ResponseProperties *properties,
+    void *callbackData)
+{
+  FetchAttempt *attempt = (FetchAttempt *) callbackData;
+  FetchRequest *request = attempt->request;
+
+  if (request->winner < 0) {
+    request->winner = attempt - request->attempts;
+    if (request->winner) {
+      request->job->hedgesWon++;
+    }
+    fetch_record_latency(request->job,
+        (int) (current_time_ms() - attempt->startMs));
+  }
+  else if (request->winner != (attempt - request->attempts)) {
+    return S3StatusAbortedByCallback;
+  }
+
+  return responsePropertiesCallback(properties, 0);
+}
+
+static S3Status fetchDataCallback(int bufferSize, const char *buffer,
+    void *callbackData)
+{
+  FetchAttempt *attempt = (FetchAttempt *) callbackData;
+  FetchRequest *request = attempt->request;
+
+  if (request->winner != (attempt - request->attempts)) {
+    return S3StatusAbortedByCallback;
+  }
+  if (!growbuffer_append(&(request->data), buffer, bufferSize)) {
+    return S3StatusOutOfMemory;
+  }
+  request->size += bufferSize;
+  return S3StatusOK;
+}
+
+// Writes the data of a finished request to its file.  Returns zero on
+// failure.
+static int fetch_write(FetchRequest *request)
+{
+  char path[4096];
+  FILE *out;
+  int n, ok = 1;
+
+  snprintf(path, sizeof(path), "%s/%s", request->job->outputDir,
+      request->key);
+  sync_make_parents(path);
+  if (!(out = fopen(path, "w" FOPEN_EXTRA_FLAGS))) {
+    return 0;
+  }
+  while (request->data) {
+    char buf[64 * 1024];
+    growbuffer_read(&(request->data), sizeof(buf), &n, buf);
+    if (fwrite(buf, 1, n, out) < (size_t) n) {
+      ok = 0;
+      break;
+    }
+  }
+  return (fclose(out) == 0) && ok;
+}
+
+static void fetch_finish(FetchRequest *request, S3Status status,
+    const S3ErrorDetails *error)
+{
+  FetchJob *job = request->job;
+
+  if ((status == S3StatusOK) && !fetch_write(request)) {
+    status = S3StatusAbortedByCallback;
+  }
+
+  if (status == S3StatusOK) {
+    job->fetched++;
+    job->bytes += request->size;
+  }
+  else {
+    printf("%s\t%s\n", request->key, S3_get_status_name(status));
+    job->failed++;
+    if (job->status == S3StatusOK) {
+      responseCompleteCallback(status, error, 0);
+      job->status = status;
+    }
+  }
+
+  request->done = 1;
+  job->unfinished--;
+}
+
+// The result of a request is that of the attempt whose response started
+// first, or if neither started, of the last one to fail.  The request is
+// reused only once both attempts are out of the pipeline.
+static void fetchCompleteCallback(S3Status status, const S3ErrorDetails *error,
+    void *callbackData)
+{
+  FetchAttempt *attempt = (FetchAttempt *) callbackData;
+  FetchRequest *request = attempt->request;
+  FetchJob *job = request->job;
+
+  attempt->active = 0;
+  pipeline_release(&(job->pipeline));
+
+  if (!request->done &&
+      ((request->winner == (attempt - request->attempts)) ||
+       ((request->winner < 0) && !request->attempts[0].active &&
+        !request->attempts[1].active))) {
+    fetch_finish(request, status, error);
+  }
+
+  if (request->attempts[0].active || request->attempts[1].active) {
+    return;
+  }
+
+  if (request->data) {
+    growbuffer_destroy(request->data);
+    request->data = 0;
+  }
+  request->next = job->freeRequests;
+  job->freeRequests = request;
+}
+
+static void fetch_send(FetchRequest *request, int index,
+    const S3BucketContext *bucketContext, const S3GetObjectHandler *handler)
+{
+  FetchAttempt *attempt = &(request->attempts[index]);
+
+  attempt->request = request;
+  attempt->startMs = current_time_ms();
+  attempt->active = 1;
+  S3_get_object(bucketContext, request->key, 0, 0, 0,
+      request->job->pipeline.context, handler, attempt);
+}
+
+// Sends a hedge for every GET that has waited longer than the hedge delay for
+// its response, while pipeline slots and the budget allow
+static void fetch_hedge(FetchJob *job, const S3BucketContext *bucketContext,
+    const S3GetObjectHandler *handler)
+{
+  int64_t now;
+  int i, delayMs;
+
+  if (!job->hedge || ((delayMs = fetch_hedge_delay(job)) < 0)) {
+    return;
+  }
+
+  now = current_time_ms();
+  for (i = 0; i < job->requestCount; i++) {
+    FetchRequest *request = &(job->requests[i]);
+    if (job->pipeline.inFlight >= job->pipeline.maxInFlight) {
+      return;
+    }
+    if (((job->hedged + 1) * 100) > (job->sent * job->hedge->budget)) {
+      return;
+    }
+    if (request->attempts[0].active && !request->attempts[1].active &&
+        (request->winner < 0) && !request->done &&
+        ((now - request->attempts[0].startMs) >= delayMs)) {
+      job->pipeline.inFlight++;
+      job->sent++;
+      job->hedged++;
+      fetch_send(request, 1, bucketContext, handler);
+    }
+  }
+}
+
+// Drives the pipeline until fewer than limit slots are taken, or with a
+// negative limit, until every request has its result, sending hedges along
+// the way.  Returns zero if the context failed.
+static int fetch_wait(FetchJob *job, int limit,
+    const S3BucketContext *bucketContext, const S3GetObjectHandler *handler)
+{
+  while ((limit < 0) ? (job->unfinished > 0) :
+         (job->pipeline.inFlight >= limit)) {
+    if (!pipeline_poll(&(job->pipeline), job->hedge ? HEDGE_POLL_MS : 100)) {
+      return 0;
+    }
+    fetch_hedge(job, bucketContext, handler);
+  }
+
+  return 1;
+}
+
+// Downloads every key listed one per line in the input into outputDir, with
+// up to parallel GETs in flight on one request context.  Keys that failed
+// are printed with their status.  If hedge is given, slow GETs are hedged as
+// it describes.
+static void fetch_objects(const char *bucketName, FILE *in,
+    const char *outputDir, int parallel, const FetchHedge *hedge)
+{
+  FetchJob job;
+  char line[S3_MAX_KEY_SIZE + 2];
+  struct timeval start, end;
+  int len, i;
+
+  memset(&job, 0, sizeof(job));
+  job.outputDir = outputDir ? outputDir : ".";
+  job.status = S3StatusOK;
+  job.hedge = (hedge && (hedge->delayMs || hedge->percentile) &&
+      (hedge->budget > 0)) ? hedge : 0;
+  job.hedgeDelayMs = -1;
+  if (parallel < 1) {
+    parallel = 1;
+  }
+  if (parallel > FETCH_MAX_PARALLEL) {
+    fprintf(stderr, "Limiting parallel to %d so that connections are "
+        "reused\n", FETCH_MAX_PARALLEL);
+    parallel = FETCH_MAX_PARALLEL;
+  }
+
+  S3_init();
+
+  S3BucketContext bucketContext =
+  {
+    0,
+    bucketName,
+    protocolG,
+    uriStyleG,
+    accessKeyIdG,
+    secretAccessKeyG,
+    0
+  };
+
+  S3GetObjectHandler fetchHandler =
+  {
+    { &fetchPropertiesCallback, &fetchCompleteCallback },
+    &fetchDataCallback
+  };
+
+  if ((statusG = pipeline_create(&(job.pipeline), parallel)) != S3StatusOK) {
+    printError();
+    goto clean;
+  }
+
+  // Every request in use holds at least one pipeline slot, so there is a
+  // free one whenever a slot is
+  job.requestCount = job.pipeline.maxInFlight;
+  if (!(job.requests = (FetchRequest *)
+        calloc(job.requestCount, sizeof(FetchRequest)))) {
+    statusG = S3StatusOutOfMemory;
+    printError();
+    goto clean;
+  }
+  for (i = 0; i < job.requestCount; i++) {
+    job.requests[i].job = &job;
+    job.requests[i].next = job.freeRequests;
+    job.freeRequests = &(job.requests[i]);
+  }
+
+  gettimeofday(&start, 0);
+
+  while ((len = read_line(in, line, sizeof(line))) >= 0) {
+    if (!len) {
+      continue;
+    }
+    if (len > S3_MAX_KEY_SIZE) {
+      printf("%s\t%s\n", line, S3_get_status_name(S3StatusKeyTooLong));
+      job.failed++;
+      continue;
+    }
+    if (!path_is_relative_below(line)) {
+      printf("%s\t%s\n", line,
+          S3_get_status_name(S3StatusErrorInvalidArgument));
+      job.failed++;
+      continue;
+    }
+
+    if (!fetch_wait(&job, job.pipeline.maxInFlight, &bucketContext,
+            &fetchHandler)) {
+      printError();
+      goto clean;
+    }
+    job.pipeline.inFlight++;
+    FetchRequest *request = job.freeRequests;
+    job.freeRequests = request->next;
+    memcpy(request->key, line, len + 1);
+    request->data = 0;
+    request->size = 0;
+    request->winner = -1;
+    request->done = 0;
+    job.unfinished++;
+    job.sent++;
+
+    fetch_send(request, 0, &bucketContext, &fetchHandler);
+  }
+
+  if (!fetch_wait(&job, -1, &bucketContext, &fetchHandler)) {
+    printError();
+    goto clean;
+  }
+
+  gettimeofday(&end, 0);
+  double elapsed = (end.tv_sec - start.tv_sec) +
+    ((end.tv_usec - start.tv_usec) / 1000000.0);
+  fprintf(stderr, "%llu fetched (%llu bytes), %llu failed in %.2f s "
+      "(%.0f requests/s)\n",
+      (unsigned long long) job.fetched, (unsigned long long) job.bytes,
+      (unsigned long long) job.failed, elapsed,
+      (elapsed > 0) ? ((job.fetched + job.failed) / elapsed) : 0.0);
+  if (job.hedge) {
+    fprintf(stderr, "%llu hedged, %llu of them answered first\n",
+        (unsigned long long) job.hedged, (unsigned long long) job.hedgesWon);
+  }
+
+  statusG = job.status;
+  if (statusG != S3StatusOK) {
+    printError();
+  }
+
+clean:
+  // Interrupts the GETs that lost to their hedges and never answered
+  pipeline_destroy(&(job.pipeline));
+  free(job.requests);
+  S3_deinitialize();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Sequential reads.  An ObjectReader gives read() access to an object, with
+// ranged GETs of chunkSize bytes kept in flight ahead of the reader.  The
+// window of chunks ahead starts at READER_MIN_WINDOW and doubles, up to
+// maxWindow, whenever a sequential read has to wait for its data; a seek
+// outside the chunks already requested drops them and starts over from the
+// minimum.  Every range is requested If-Match the ETag the object had when
+// it was opened, so that a concurrent overwrite fails the read instead of
+// mixing versions.
+
+#define READER_DEFAULT_CHUNK_SIZE (1024 * 1024)
+#define READER_MIN_WINDOW 2
+#define READER_DEFAULT_MAX_WINDOW 16
+
+typedef struct ReaderChunk
+{
+  struct ObjectReader *reader;
+  uint64_t offset;
+  int length;
+  char *data;
+  // Bytes received so far
+  int size;
+  int done;
+  // Set when a seek dropped the chunk while its GET was in flight
+  int stale;
+  S3Status status;
+  struct ReaderChunk *next;
+} ReaderChunk;
+
+typedef struct ObjectReader
+{
+  RequestPipeline pipeline;
+  S3BucketContext bucketContext;
+  char key[S3_MAX_KEY_SIZE + 1];
+  char eTag[256];
+  S3GetConditions conditions;
+  uint64_t size;
+  int chunkSize;
+  int window, maxWindow;
+  // The next byte read returns and the next byte to request
+  uint64_t position, nextOffset;
+  // Chunks requested and not yet consumed, in order of offset
+  ReaderChunk *head, *tail;
+  int chunkCount;
+  ReaderChunk *freeChunks;
+  uint64_t requests, seeks, waits;
+  S3Status status;
+} ObjectReader;
+
+static S3Status readerHeadPropertiesCallback(
+    const S3ResponseProperties *properties, void *callbackData)
+{
+  ObjectReader *reader = (ObjectReader *) callbackData;
+
+  reader->size = properties->contentLength;
+  snprintf(reader->eTag, sizeof(reader->eTag), "%s",
+      properties->eTag ? properties->eTag : "");
+  return S3StatusOK;
+}
+
+static void readerHeadCompleteCallback(S3Status status,
+    const S3ErrorDetails *error, void *callbackData)
+{
+  ObjectReader *reader = (ObjectReader *) callbackData;
+
+  responseCompleteCallback(status, error, 0);
+  reader->status = status;
+}
+
+static S3Status readerDataCallback(int bufferSize, const char *buffer,
+    void *callbackData)
+{
+  ReaderChunk *chunk = (ReaderChunk *) callbackData;
+
+  if (chunk->stale) {
+    return S3StatusAbortedByCallback;
+  }
+  if (bufferSize > (chunk->length - chunk->size)) {
+    return S3StatusErrorInvalidRange;
+  }
+  memcpy(&(chunk->data[chunk->size]), buffer, bufferSize);
+  chunk->size += bufferSize;
+  return S3StatusOK;
+}
+
+static void reader_chunk_free(ObjectReader *reader, ReaderChunk *chunk)
+{
+  chunk->next = reader->freeChunks;
+  reader->freeChunks = chunk;
+}
+
+static void readerCompleteCallback(S3Status status,
+    const S3ErrorDetails *error, void *callbackData)
+{
+  ReaderChunk *chunk = (ReaderChunk *) callbackData;
+  ObjectReader *reader = chunk->reader;
+
+  pipeline_release(&(reader->pipeline));
+  if (chunk->stale) {
+    reader_chunk_free(reader, chunk);
+    return;
+  }
+
+  if ((status == S3StatusOK) && (chunk->size != chunk->length)) {
+    status = S3StatusErrorIncompleteBody;
+  }
+  if ((status != S3StatusOK) && error) {
+    responseCompleteCallback(status, error, 0);
+  }
+  chunk->status = status;
+  chunk->done = 1;
+}
+
+static S3GetObjectHandler readerHandlerG =
+{
+  { 0, &readerCompleteCallback },
+  &readerDataCallback
+};
+
+// Requests chunks until window of them are ahead of the reader, as far as
+// the object and the free pipeline slots go
+static void reader_fill(ObjectReader *reader)
+{
+  while ((reader->chunkCount < reader->window) &&
+      (reader->nextOffset < reader->size) &&
+      (reader->pipeline.inFlight < reader->pipeline.maxInFlight)) {
+    ReaderChunk *chunk = reader->freeChunks;
+    if (chunk) {
+      reader->freeChunks = chunk->next;
+    }
+    else if (!(chunk = (ReaderChunk *) calloc(1, sizeof(ReaderChunk))) ||
+        !(chunk->data = (char *) malloc(reader->chunkSize))) {
+      free(chunk);
+      return;
+    }
+    chunk->reader = reader;
+    chunk->offset = reader->nextOffset;
+    chunk->length = ((reader->size - chunk->offset) < (uint64_t)
+        reader->chunkSize) ? (int) (reader->size - chunk->offset) :
+      reader->chunkSize;
+    chunk->size = 0;
+    chunk->done = 0;
+    chunk->stale = 0;
+    chunk->status = S3StatusOK;
+    chunk->next = 0;
+    if (reader->tail) {
+      reader->tail->next = chunk;
+    }
+    else {
+      reader->head = chunk;
+    }
+    reader->tail = chunk;
+    reader->chunkCount++;
+    reader->nextOffset += chunk->length;
+    reader->requests++;
+
+    reader->pipeline.inFlight++;
+    S3_get_object(&(reader->bucketContext), reader->key,
+        reader->eTag[0] ? &(reader->conditions) : 0, chunk->offset,
+        chunk->length, reader->pipeline.context, &readerHandlerG, chunk);
+  }
+}
+
+// Opens bucketContext/key for reading from its start.  maxWindow bounds the
+// chunks in flight at once.
+static S3Status object_reader_open(ObjectReader *reader,
+    const S3BucketContext *bucketContext, const char *key, int chunkSize,
+    int maxWindow)
+{
+  memset(reader, 0, sizeof(ObjectReader));
+  reader->bucketContext = *bucketContext;
+  snprintf(reader->key, sizeof(reader->key), "%s", key);
+  reader->chunkSize = (chunkSize > 0) ? chunkSize : READER_DEFAULT_CHUNK_SIZE;
+  reader->maxWindow = (maxWindow >= READER_MIN_WINDOW) ? maxWindow :
+    READER_MIN_WINDOW;
+  reader->window = READER_MIN_WINDOW;
+  reader->conditions.ifModifiedSince = -1;
+  reader->conditions.ifNotModifiedSince = -1;
+  reader->conditions.ifMatchETag = reader->eTag;
+
+  S3ResponseHandler headHandler =
+  {
+    &readerHeadPropertiesCallback, &readerHeadCompleteCallback
+  };
+
+  reader->status = S3StatusInternalError;
+  S3_head_object(bucketContext, key, 0, &headHandler, reader);
+  if (reader->status != S3StatusOK) {
+    return reader->status;
+  }
+
+  return (reader->status = pipeline_create(&(reader->pipeline),
+          reader->maxWindow));
+}
+
+// Drops every chunk requested, to be requested again from nextOffset
+static void reader_drop(ObjectReader *reader)
+{
+  while (reader->head) {
+    ReaderChunk *chunk = reader->head;
+    reader->head = chunk->next;
+    if (chunk->done) {
+      reader_chunk_free(reader, chunk);
+    }
+    else {
+      // Freed by its complete callback
+      chunk->stale = 1;
+    }
+  }
+  reader->tail = 0;
+  reader->chunkCount = 0;
+}
+
+// Moves the read position to offset.  A position within the chunks already
+// requested keeps them; any other drops them and shrinks the window.
+static void object_reader_seek(ObjectReader *reader, uint64_t offset)
+{
+  if (offset == reader->position) {
+    return;
+  }
+  reader->seeks++;
+
+  if (reader->head && (offset > reader->position) &&
+      (offset < reader->nextOffset)) {
+    while (reader->head &&
+        ((reader->head->offset + reader->head->length) <= offset)) {
+      ReaderChunk *chunk = reader->head;
+      if (!(reader->head = chunk->next)) {
+        reader->tail = 0;
+      }
+      reader->chunkCount--;
+      if (chunk->done) {
+        reader_chunk_free(reader, chunk);
+      }
+      else {
+        chunk->stale = 1;
+      }
+    }
+  }
+  else {
+    reader_drop(reader);
+    reader->nextOffset = (offset < reader->size) ? offset : reader->size;
+    reader->window = READER_MIN_WINDOW;
+  }
+  reader->position = offset;
+}
+
+// Copies up to length bytes from the read position into buffer.  Returns
+// the number of bytes copied, 0 at the end of the object, or -1 on failure
+// with reader->status set.
+static int64_t object_reader_read(ObjectReader *reader, char *buffer,
+    uint64_t length)
+{
+  uint64_t copied = 0;
+  int waited = 0;
+
+  if (reader->status != S3StatusOK) {
+    return -1;
+  }
+
+  while ((copied < length) && (reader->position < reader->size)) {
+    reader_fill(reader);
+
+    ReaderChunk *chunk = reader->head;
+    if (!chunk && (reader->pipeline.inFlight < reader->pipeline.maxInFlight)) {
+      // Out of memory for chunk buffers
+      reader->status = S3StatusOutOfMemory;
+      return -1;
+    }
+    // Without a chunk, every slot is taken by GETs that a seek dropped
+    if (!chunk || !chunk->done) {
+      if (copied) {
+        // Return what is here rather than wait
+        break;
+      }
+      waited = 1;
+      if (!pipeline_poll(&(reader->pipeline), 100)) {
+        reader->status = statusG;
+        return -1;
+      }
+      continue;
+    }
+    if (chunk->status != S3StatusOK) {
+      reader->status = chunk->status;
+      return -1;
+    }
+
+    uint64_t skip = reader->position - chunk->offset;
+    uint64_t n = chunk->length - skip;
+    if (n > (length - copied)) {
+      n = length - copied;
+    }
+    memcpy(&(buffer[copied]), &(chunk->data[skip]), n);
+    copied += n;
+    reader->position += n;
+
+    if (reader->position == (chunk->offset + chunk->length)) {
+      if (!(reader->head = chunk->next)) {
+        reader->tail = 0;
+      }
+      reader->chunkCount--;
+      reader_chunk_free(reader, chunk);
+    }
+  }
+
+  // The read-ahead did not cover this read, so look further ahead
+  if (waited) {
+    reader->waits++;
+    if (reader->window < reader->maxWindow) {
+      reader->window *= 2;
+      if (reader->window > reader->maxWindow) {
+        reader->window = reader->maxWindow;
+      }
+    }
+  }
+  reader_fill(reader);
+
+  return copied;
+}
+
+static void object_reader_close(ObjectReader *reader)
+{
+  reader_drop(reader);
+  // Completes the GETs still in flight, which frees their chunks
+  pipeline_destroy(&(reader->pipeline));
+  while (reader->freeChunks) {
+    ReaderChunk *chunk = reader->freeChunks;
+    reader->freeChunks = chunk->next;
+    free(chunk->data);
+    free(chunk);
+  }
+}
+
+// Writes length bytes (all if 0) of bucketName/key from offset to stdout
+static void cat_object(const char *bucketName, const char *key,
+    uint64_t offset, uint64_t length, int chunkSize, int maxWindow)
+{
+  ObjectReader reader;
+  char buffer[64 * 1024];
+  uint64_t written = 0;
+
+  S3_init();
+
+  S3BucketContext bucketContext =
+  {
+    0,
+    bucketName,
+    protocolG,
+    uriStyleG,
+    accessKeyIdG,
+    secretAccessKeyG,
+    0
+  };
+
+  if ((statusG = object_reader_open(&reader, &bucketContext, key, chunkSize,
+          maxWindow)) != S3StatusOK) {
+    printError();
+    object_reader_close(&reader);
+    S3_deinitialize();
+    return;
+  }
+
+  object_reader_seek(&reader, offset);
+  while (!length || (written < length)) {
+    uint64_t want = sizeof(buffer);
+    if (length && ((length - written) < want)) {
+      want = length - written;
+    }
+    int64_t n = object_reader_read(&reader, buffer, want);
+    if (n <= 0) {
+      if (n < 0) {
+        statusG = reader.status;
+        printError();
+      }
+      break;
+    }
+    if (fwrite(buffer, 1, n, stdout) != (size_t) n) {
+      perror("\nERROR: Failed to write to stdout");
+      statusG = S3StatusInternalError;
+      break;
+    }
+    written += n;
+  }
+  fflush(stdout);
+
+  fprintf(stderr, "%llu bytes in %llu GETs, %llu waits, %llu seeks, "
+      "window %d\n", (unsigned long long) written,
+      (unsigned long long) reader.requests,
+      (unsigned long long) reader.waits, (unsigned long long) reader.seeks,
+      reader.window);
+
+  object_reader_close(&reader);
+  S3_deinitialize();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Random-access reads through a block cache.  A BlockCache serves pread()
+// style reads of one object from blockCount blocks of blockSize bytes kept in
+// memory and evicted least recently used first.  A read is widened to whole
+// blocks, and the blocks it misses are fetched with ranged GETs, up to
+// parallel at once.  Blocks can also be kept in a sparse local file the size
+// of the object, which outlives the memory blocks and the process: next to it
+// a .blocks file records the object's ETag, the block size and which blocks
+// the file holds, and is discarded when the object has changed.
+
+#define BLOCK_CACHE_DEFAULT_BLOCK_SIZE (256 * 1024)
+#define BLOCK_CACHE_DEFAULT_BLOCKS 256
+#define BLOCK_CACHE_DEFAULT_PARALLEL 8
+
+typedef enum
+{
+  CacheBlockEmpty,
+  CacheBlockLoading,
+  CacheBlockReady
+} CacheBlockState;
+
+typedef struct CacheBlock
+{
+  struct BlockCache *cache;
+  // Block number within the object
+  uint64_t index;
+  CacheBlockState state;
+  char *data;
+  int size, received;
+  // Nonzero while the read in progress needs the block
+  int pinned;
+  S3Status status;
+  struct CacheBlock *hashNext;
+  // Neighbours in the LRU list, most recently used first
+  struct CacheBlock *newer, *older;
+} CacheBlock;
+
+typedef struct BlockCache
+{
+  RequestPipeline pipeline;
+  S3BucketContext bucketContext;
+  char key[S3_MAX_KEY_SIZE + 1];
+  char eTag[256];
+  S3GetConditions conditions;
+  uint64_t size;
+  int blockSize, blockCount;
+  CacheBlock *blocks;
+  CacheBlock **hash;
+  unsigned hashMask;
+  CacheBlock *newest, *oldest;
+  // The sparse file, or -1, and one bit per block of the object telling
+  // whether the file holds it
+  int fd;
+  char *path;
+  unsigned char *onDisk;
+  uint64_t blockTotal;
+  uint64_t reads, hits, diskHits, misses, bytesRead, bytesFetched;
+  S3Status status;
+} BlockCache;
+
+static S3Status cacheHeadPropertiesCallback(
+    const S3ResponseProperties *properties, void *callbackData)
+{
+  BlockCache *cache = (BlockCache *) callbackData;
+
+  cache->size = properties->contentLength;
+  snprintf(cache->eTag, sizeof(cache->eTag), "%s",
+      properties->eTag ? properties->eTag : "");
+  return S3StatusOK;
+}
+
+static void cacheHeadCompleteCallback(S3Status status,
+    const S3ErrorDetails *error, void *callbackData)
+{
+  BlockCache *cache = (BlockCache *) callbackData;
+
+  responseCompleteCallback(status, error, 0);
+  cache->status = status;
+}
+
+static S3Status cacheDataCallback(int bufferSize, const char *buffer,
+    void *callbackData)
+{
+  CacheBlock *block = (CacheBlock *) callbackData;
+
+  if (bufferSize > (block->size - block->received)) {
+    return S3StatusErrorInvalidRange;
+  }
+  memcpy(&(block->data[block->received]), buffer, bufferSize);
+  block->received += bufferSize;
+  return S3StatusOK;
+}
+
+static void cache_disk_store(BlockCache *cache, CacheBlock *block)
+{
+  if ((cache->fd < 0) ||
+      (cache->onDisk[block->index / 8] & (1 << (block->index % 8)))) {
+    return;
+  }
+  if (pwrite(cache->fd, block->data, block->size,
+        block->index * cache->blockSize) == block->size) {
+    cache->onDisk[block->index / 8] |= (1 << (block->index % 8));
+  }
+}
+
+static void cacheCompleteCallback(S3Status status,
+    const S3ErrorDetails *error, void *callbackData)
+{
+  CacheBlock *block = (CacheBlock *) callbackData;
+  BlockCache *cache = block->cache;
+
+  pipeline_release(&(cache->pipeline));
+  if ((status == S3StatusOK) && (block->received != block->size)) {
+    status = S3StatusErrorIncompleteBody;
+  }
+  if ((status != S3StatusOK) && error) {
+    responseCompleteCallback(status, error, 0);
+  }
+  block->status = status;
+  block->state = CacheBlockReady;
+  if (status == S3StatusOK) {
+    cache->bytesFetched += block->size;
+    cache_disk_store(cache, block);
+  }
+}
+
+static S3GetObjectHandler cacheHandlerG =
+{
+  { 0, &cacheCompleteCallback },
+  &cacheDataCallback
+};
+
+static void cache_lru_unlink(BlockCache *cache, CacheBlock *block)
+{
+  if (block->newer) {
+    block->newer->older = block->older;
+  }
+  else if (cache->newest == block) {
+    cache->newest = block->older;
+  }
+  if (block->older) {
+    block->older->newer = block->newer;
+  }
+  else if (cache->oldest == block) {
+    cache->oldest = block->newer;
+  }
+  block->newer = block->older = 0;
+}
+
+static void cache_lru_touch(BlockCache *cache, CacheBlock *block)
+{
+  cache_lru_unlink(cache, block);
+  block->older = cache->newest;
+  if (cache->newest) {
+    cache->newest->newer = block;
+  }
+  cache->newest = block;
+  if (!cache->oldest) {
+    cache->oldest = block;
+  }
+}
+
+static CacheBlock **cache_hash_slot(BlockCache *cache, uint64_t index)
+{
+  return &(cache->hash[(index * 0x9E3779B97F4A7C15ULL >> 32) &
+      cache->hashMask]);
+}
+
+static CacheBlock *cache_lookup(BlockCache *cache, uint64_t index)
+{
+  CacheBlock *block = *cache_hash_slot(cache, index);
+
+  while (block && (block->index != index)) {
+    block = block->hashNext;
+  }
+  return block;
+}
+
+// Takes the least recently used block that is not pinned, out of the hash
+// table, to be reused for index.  There always is one, as a read pins at
+// most half of the blocks.
+static CacheBlock *cache_evict(BlockCache *cache, uint64_t index)
+{
+  CacheBlock *block = cache->oldest;
+
+  while (block->pinned) {
+    block = block->newer;
+  }
+
+  if (block->state != CacheBlockEmpty) {
+    CacheBlock **slot = cache_hash_slot(cache, block->index);
+    while (*slot != block) {
+      slot = &((*slot)->hashNext);
+    }
+    *slot = block->hashNext;
+  }
+
+  block->index = index;
+  block->size = ((cache->size - (index * cache->blockSize)) <
+      (uint64_t) cache->blockSize) ?
+    (int) (cache->size - (index * cache->blockSize)) : cache->blockSize;
+  block->received = 0;
+  block->status = S3StatusOK;
+  CacheBlock **slot = cache_hash_slot(cache, index);
+  block->hashNext = *slot;
+  *slot = block;
+  return block;
+}
+
+// Gets block index into memory, from the sparse file or with a GET added to
+// the pipeline, and pins it.  Returns zero if the context failed.
+static int cache_want(BlockCache *cache, uint64_t index)
+{
+  CacheBlock *block = cache_lookup(cache, index);
+
+  if (block && (block->state == CacheBlockReady) &&
+      (block->status == S3StatusOK)) {
+    cache->hits++;
+  }
+  else {
+    if (!block) {
+      block = cache_evict(cache, index);
+    }
+    block->state = CacheBlockLoading;
+    if ((cache->fd >= 0) &&
+        (cache->onDisk[index / 8] & (1 << (index % 8))) &&
+        (pread(cache->fd, block->data, block->size,
+               index * cache->blockSize) == block->size)) {
+      cache->diskHits++;
+      block->received = block->size;
+      block->status = S3StatusOK;
+      block->state = CacheBlockReady;
+    }
+    else {
+      cache->misses++;
+      block->received = 0;
+      if (!pipeline_acquire(&(cache->pipeline))) {
+        block->status = statusG;
+        block->state = CacheBlockReady;
+        return 0;
+      }
+      S3_get_object(&(cache->bucketContext), cache->key,
+          cache->eTag[0] ? &(cache->conditions) : 0,
+          index * cache->blockSize, block->size, cache->pipeline.context,
+          &cacheHandlerG, block);
+    }
+  }
+
+  block->pinned = 1;
+  cache_lru_touch(cache, block);
+  return 1;
+}
+
+// Loads the record of the blocks held by the sparse file at path, unless it
+// is missing or was made for another version of the object or block size.
+// Only called for a file that already existed with the size of the object.
+static void cache_disk_load(BlockCache *cache)
+{
+  char recordPath[4096], line[512], expected[512];
+  FILE *record;
+  uint64_t bytes = (cache->blockTotal + 7) / 8;
+
+  snprintf(recordPath, sizeof(recordPath), "%s.blocks", cache->path);
+  if (!(record = fopen(recordPath, "r" FOPEN_EXTRA_FLAGS))) {
+    return;
+  }
+  snprintf(expected, sizeof(expected), "%s %d %llu\n", cache->eTag,
+      cache->blockSize, (unsigned long long) cache->size);
+  if (fgets(line, sizeof(line), record) && !strcmp(line, expected) &&
+      (fread(cache->onDisk, 1, bytes, record) == bytes)) {
+    fclose(record);
+    return;
+  }
+  fclose(record);
+  memset(cache->onDisk, 0, bytes);
+}
+
+// Writes the record to a temporary file renamed over the old one, so that a
+// record is never left half written
+static void cache_disk_save(BlockCache *cache)
+{
+  char recordPath[4096], tempPath[4096];
+  FILE *record;
+  uint64_t bytes = (cache->blockTotal + 7) / 8;
+
+  snprintf(recordPath, sizeof(recordPath), "%s.blocks", cache->path);
+  snprintf(tempPath, sizeof(tempPath), "%s.blocks.tmp", cache->path);
+  if (!(record = fopen(tempPath, "w" FOPEN_EXTRA_FLAGS))) {
+    return;
+  }
+  fprintf(record, "%s %d %llu\n", cache->eTag, cache->blockSize,
+      (unsigned long long) cache->size);
+  int failed = (fwrite(cache->onDisk, 1, bytes, record) != bytes);
+  if (fclose(record)) {
+    failed = 1;
+  }
+  if (failed || RENAME(tempPath, recordPath)) {
+    remove(tempPath);
+  }
+}
+
+// Opens a cache over bucketContext/key.  path names the sparse file to keep
+// blocks in, or is null to keep them in memory only.
+static S3Status block_cache_open(BlockCache *cache,
+    const S3BucketContext *bucketContext, const char *key, int blockSize,
+    int blockCount, int parallel, const char *path)
+{
+  unsigned hashSize = 1;
+  int i;
+
+  memset(cache, 0, sizeof(BlockCache));
+  cache->fd = -1;
+  cache->bucketContext = *bucketContext;
+  snprintf(cache->key, sizeof(cache->key), "%s", key);
+  cache->blockSize = (blockSize > 0) ? blockSize :
+    BLOCK_CACHE_DEFAULT_BLOCK_SIZE;
+  cache->blockCount = (blockCount > 1) ? blockCount : 2;
+  cache->conditions.ifModifiedSince = -1;
+  cache->conditions.ifNotModifiedSince = -1;
+  cache->conditions.ifMatchETag = cache->eTag;
+
+  S3ResponseHandler headHandler =
+  {
+    &cacheHeadPropertiesCallback, &cacheHeadCompleteCallback
+  };
+
+  cache->status = S3StatusInternalError;
+  S3_head_object(bucketContext, key, 0, &headHandler, cache);
+  if (cache->status != S3StatusOK) {
+    return cache->status;
+  }
+  cache->blockTotal = (cache->size + cache->blockSize - 1) / cache->blockSize;
+
+  while (hashSize < (unsigned) (cache->blockCount * 2)) {
+    hashSize <<= 1;
+  }
+  cache->hash = (CacheBlock **) calloc(hashSize, sizeof(CacheBlock *));
+  cache->hashMask = hashSize - 1;
+  cache->blocks = (CacheBlock *) calloc(cache->blockCount,
+      sizeof(CacheBlock));
+  if (!cache->hash || !cache->blocks) {
+    return (cache->status = S3StatusOutOfMemory);
+  }
+  for (i = 0; i < cache->blockCount; i++) {
+    CacheBlock *block = &(cache->blocks[i]);
+    block->cache = cache;
+    if (!(block->data = (char *) malloc(cache->blockSize))) {
+      return (cache->status = S3StatusOutOfMemory);
+    }
+    cache_lru_touch(cache, block);
+  }
+
+  if (path) {
+    if (!(cache->path = strdup(path)) ||
+        !(cache->onDisk = (unsigned char *)
+          calloc((cache->blockTotal + 7) / 8, 1))) {
+      return (cache->status = S3StatusOutOfMemory);
+    }
+    // The record is only trusted for the file it was written with: one that
+    // is missing, and so created now, or that has another size was replaced
+    // or never finished, and may not hold the blocks the record says
+    struct stat st;
+    if (((cache->fd = open(path, O_RDWR | O_BINARY)) >= 0) &&
+        !fstat(cache->fd, &st) && ((uint64_t) st.st_size == cache->size)) {
+      cache_disk_load(cache);
+    }
+    if ((cache->fd < 0) && (errno == ENOENT)) {
+      cache->fd = open(path, O_RDWR | O_CREAT | O_BINARY, 0666);
+    }
+    if ((cache->fd < 0) || ftruncate(cache->fd, cache->size)) {
+      fprintf(stderr, "\nERROR: Failed to open cache file %s: ", path);
+      perror(0);
+      return (cache->status = S3StatusInternalError);
+    }
+  }
+
+  return (cache->status = pipeline_create(&(cache->pipeline), parallel));
+}
+
+// Copies length bytes of the object from offset into buffer, or fewer at its
+// end.  Returns the number of bytes copied, or -1 on failure with
+// cache->status set.
+static int64_t block_cache_pread(BlockCache *cache, char *buffer,
+    uint64_t offset, uint64_t length)
+{
+  uint64_t copied = 0;
+
+  if (cache->status != S3StatusOK) {
+    return -1;
+  }
+  if (offset >= cache->size) {
+    return 0;
+  }
+  if (length > (cache->size - offset)) {
+    length = cache->size - offset;
+  }
+  cache->reads++;
+
+  while (copied < length) {
+    uint64_t first = (offset + copied) / cache->blockSize;
+    uint64_t last = (offset + length - 1) / cache->blockSize;
+    uint64_t index;
+    int failed = 0;
+
+    // At most half of the blocks at a time, so that the others can be
+    // evicted for them
+    if ((last - first) >= (uint64_t) (cache->blockCount / 2)) {
+      last = first + (cache->blockCount / 2) - 1;
+    }
+
+    for (index = first; index <= last; index++) {
+      if (!cache_want(cache, index)) {
+        failed = 1;
+        break;
+      }
+    }
+    if (!failed && !pipeline_wait(&(cache->pipeline), 0)) {
+      failed = 1;
+    }
+    if (failed) {
+      cache->status = statusG;
+    }
+
+    for (index = first; index <= last; index++) {
+      CacheBlock *block = cache_lookup(cache, index);
+      if (!block || !block->pinned) {
+        continue;
+      }
+      block->pinned = 0;
+      if (failed || (cache->status != S3StatusOK)) {
+        continue;
+      }
+      if (block->status != S3StatusOK) {
+        cache->status = block->status;
+        continue;
+      }
+      uint64_t start = offset + copied - (index * cache->blockSize);
+      uint64_t n = block->size - start;
+      if (n > (length - copied)) {
+        n = length - copied;
+      }
+      memcpy(&(buffer[copied]), &(block->data[start]), n);
+      copied += n;
+    }
+
+    if (cache->status != S3StatusOK) {
+      return -1;
+    }
+  }
+
+  cache->bytesRead += copied;
+  return copied;
+}
+
+static void block_cache_print_stats(BlockCache *cache)
+{
+  uint64_t blocks = cache->hits + cache->diskHits + cache->misses;
+
+  fprintf(stderr, "%llu reads of %llu bytes: %llu blocks, %llu in memory, "
+      "%llu from the cache file, %llu fetched (%llu bytes); hit rate "
+      "%.1f%%\n", (unsigned long long) cache->reads,
+      (unsigned long long) cache->bytesRead, (unsigned long long) blocks,
+      (unsigned long long) cache->hits, (unsigned long long) cache->diskHits,
+      (unsigned long long) cache->misses,
+      (unsigned long long) cache->bytesFetched,
+      blocks ? ((100.0 * (cache->hits + cache->diskHits)) / blocks) : 0.0);
+}
+
+static void block_cache_close(BlockCache *cache)
+{
+  int i;
+
+  pipeline_destroy(&(cache->pipeline));
+  if (cache->fd >= 0) {
+    cache_disk_save(cache);
+    close(cache->fd);
+  }
+  for (i = 0; cache->blocks && (i < cache->blockCount); i++) {
+    free(cache->blocks[i].data);
+  }
+  free(cache->blocks);
+  free(cache->hash);
+  free(cache->onDisk);
+  free(cache->path);
+}
+
+// Reads the ranges listed one "offset length" per line in the input through
+// a block cache over bucketName/key, and writes their bytes to stdout in turn
+static void pread_object(const char *bucketName, const char *key, FILE *in,
+    int blockSize, int blockCount, int parallel, const char *cachePath)
+{
+  BlockCache cache;
+  char line[256];
+  char *buffer = 0;
+  uint64_t bufferSize = 0;
+
+  S3_init();
+
+  S3BucketContext bucketContext =
+  {
+    0,
+    bucketName,
+    protocolG,
+    uriStyleG,
+    accessKeyIdG,
+    secretAccessKeyG,
+    0
+  };
+
+  if ((statusG = block_cache_open(&cache, &bucketContext, key, blockSize,
+          blockCount, parallel, cachePath)) != S3StatusOK) {
+    printError();
+    goto clean;
+  }
+
+  while (fgets(line, sizeof(line), in)) {
+    char *end;
+    uint64_t offset = strtoull(line, &end, 10);
+    uint64_t length = strtoull(end, &end, 10);
+    // Only the part of the range within the object is read, so the buffer
+    // is sized for that
+    if (!length || (offset >= cache.size)) {
+      continue;
+    }
+    if (length > (cache.size - offset)) {
+      length = cache.size - offset;
+    }
+    if (length > SIZE_MAX) {
+      fprintf(stderr, "\nERROR: Range of %llu bytes is too long\n",
+          (unsigned long long) length);
+      statusG = S3StatusErrorInvalidArgument;
+      goto clean;
+    }
+    if (length > bufferSize) {
+      char *grown = (char *) realloc(buffer, length);
+      if (!grown) {
+        statusG = S3StatusOutOfMemory;
+        printError();
+        goto clean;
+      }
+      buffer = grown;
+      bufferSize = length;
+    }
+    int64_t n = block_cache_pread(&cache, buffer, offset, length);
+    if (n < 0) {
+      statusG = cache.status;
+      printError();
+      goto clean;
+    }
+    if (fwrite(buffer, 1, n, stdout) != (size_t) n) {
+      perror("\nERROR: Failed to write to stdout");
+      statusG = S3StatusInternalError;
+      goto clean;
+    }
+  }
+  fflush(stdout);
+
+  block_cache_print_stats(&cache);
+
+clean:
+  block_cache_close(&cache);
+  free(buffer);
+  S3_deinitialize();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Batch PUTs.  put_batch() stores many small objects at once: the PUTs share
+// one request context, with up to parallel in flight so that each goes out
+// on a connection kept open by an earlier one, and share a single handler.
+// Nothing is called back per object; the caller gets the status of each in
+// an array once all are done.  A file is opened only when its PUT is sent,
+// so a batch holds at most parallel of them open.
+
+#define BATCH_PUT_MAX_PARALLEL REQUEST_HANDLE_CACHE_SIZE
+// Files listed to the put command are stored this many per batch
+#define BATCH_PUT_DEFAULT_SIZE 1024
+
+// An object to store: size bytes of data if data is set, otherwise the
+// content of the file at path.  properties may be null.
+typedef struct BatchPutItem
+{
+  const char *key;
+  const char *data;
+  uint64_t size;
+  const char *path;
+  const S3PutProperties *properties;
+} BatchPutItem;
+
+typedef struct BatchPutRequest
+{
+  struct BatchPut *batch;
+  int index;
+  // The file being sent, or -1 when sending data
+  int fd;
+  const char *data;
+  uint64_t remaining;
+  struct BatchPutRequest *next;
+} BatchPutRequest;
+
+typedef struct BatchPut
+{
+  RequestPipeline pipeline;
+  S3Status *statuses;
+  // One request per pipeline slot; idle ones are kept on freeRequests
+  BatchPutRequest *requests, *freeRequests;
+} BatchPut;
+
+static int batchPutDataCallback(int bufferSize, char *buffer,
+    void *callbackData)
+{
+  BatchPutRequest *request = (BatchPutRequest *) callbackData;
+  int n = (request->remaining < (uint64_t) bufferSize) ?
+    (int) request->remaining : bufferSize;
+
+  if (!n) {
+    return 0;
+  }
+  if (request->fd >= 0) {
+    if ((n = read(request->fd, buffer, n)) <= 0) {
+      // Aborts the PUT
+      return -1;
+    }
+  }
+  else {
+    memcpy(buffer, request->data, n);
+    request->data += n;
+  }
+  request->remaining -= n;
+  return n;
+}
+
+static void batchPutCompleteCallback(S3Status status,
+    const S3ErrorDetails *error, void *callbackData)
+{
+  BatchPutRequest *request = (BatchPutRequest *) callbackData;
+  BatchPut *batch = request->batch;
+
+  (void) error;
+  if ((status == S3StatusOK) && request->remaining) {
+    status = S3StatusErrorIncompleteBody;
+  }
+  batch->statuses[request->index] = status;
+  if (request->fd >= 0) {
+    close(request->fd);
+  }
+  pipeline_release(&(batch->pipeline));
+  request->next = batch->freeRequests;
+  batch->freeRequests = request;
+}
+
+static S3PutObjectHandler batchPutHandlerG =
+{
+  { 0, &batchPutCompleteCallback },
+  &batchPutDataCallback
+};
+
+// Stores the count items in bucketContext with up to parallel PUTs in flight,
+// and sets statuses[i] to how the PUT of items[i] went.  Returns the number
+// that failed, or -1 if the batch could not be run, with statusG set; the
+// items not sent then have status S3StatusInterrupted.
+static int put_batch(const S3BucketContext *bucketContext,
+    const BatchPutItem *items, int count, int parallel, S3Status *statuses)
+{
+  BatchPut batch;
+  int i, failed = 0;
+
+  memset(&batch, 0, sizeof(batch));
+  batch.statuses = statuses;
+  for (i = 0; i < count; i++) {
+    statuses[i] = S3StatusInterrupted;
+  }
+  if (parallel < 1) {
+    parallel = 1;
+  }
+  if (parallel > BATCH_PUT_MAX_PARALLEL) {
+    parallel = BATCH_PUT_MAX_PARALLEL;
+  }
+
+  if ((statusG = pipeline_create(&(batch.pipeline), parallel)) !=
+      S3StatusOK) {
+    goto clean;
+  }
+  if (!(batch.requests = (BatchPutRequest *)
+        calloc(batch.pipeline.maxInFlight, sizeof(BatchPutRequest)))) {
+    statusG = S3StatusOutOfMemory;
+    goto clean;
+  }
+  for (i = 0; i < batch.pipeline.maxInFlight; i++) {
+    batch.requests[i].batch = &batch;
+    batch.requests[i].next = batch.freeRequests;
+    batch.freeRequests = &(batch.requests[i]);
+  }
+
+  for (i = 0; i < count; i++) {
+    const BatchPutItem *item = &(items[i]);
+    int fd = -1;
+    uint64_t size = item->size;
+
+    if (!item->data && item->path) {
+      struct stat st;
+      if (((fd = open(item->path, O_RDONLY | O_BINARY)) < 0) ||
+          fstat(fd, &st)) {
+        if (fd >= 0) {
+          close(fd);
+        }
+        statuses[i] = S3StatusInternalError;
+        continue;
+      }
+      size = st.st_size;
+    }
+
+    if (!pipeline_acquire(&(batch.pipeline))) {
+      if (fd >= 0) {
+        close(fd);
+      }
+      goto clean;
+    }
+    BatchPutRequest *request = batch.freeRequests;
+    batch.freeRequests = request->next;
+    request->index = i;
+    request->fd = fd;
+    request->data = item->data;
+    request->remaining = size;
+    S3_put_object(bucketContext, item->key, size, item->properties,
+        batch.pipeline.context, &batchPutHandlerG, request);
+  }
+
+  if (!pipeline_wait(&(batch.pipeline), 0)) {
+    goto clean;
+  }
+  statusG = S3StatusOK;
+
+clean:
+  // Interrupts the PUTs still in flight if the context failed
+  pipeline_destroy(&(batch.pipeline));
+  free(batch.requests);
+  if (statusG != S3StatusOK) {
+    return -1;
+  }
+  for (i = 0; i < count; i++) {
+    failed += (statuses[i] != S3StatusOK);
+  }
+  return failed;
+}
+
+// Stores every file listed one per line in the input at its path under
+// prefix, in batches of batchSize, and prints the files that failed with
+// their status
+static void put_files(const char *bucketName, FILE *in, const char *prefix,
+    int batchSize, int parallel)
+{
+  char line[S3_MAX_KEY_SIZE + 2];
+  BatchPutItem *items = 0;
+  S3Status *statuses = 0;
+  char *names = 0;
+  uint64_t stored = 0, failed = 0;
+  struct timeval start, end;
+  int count = 0, done = 0, len, i;
+
+  if (!prefix) {
+    prefix = "";
+  }
+  int prefixLen = strlen(prefix);
+  if (batchSize < 1) {
+    batchSize = 1;
+  }
+
+  S3_init();
+
+  S3BucketContext bucketContext =
+  {
+    0,
+    bucketName,
+    protocolG,
+    uriStyleG,
+    accessKeyIdG,
+    secretAccessKeyG,
+    0
+  };
+
+  // Each item's key is its prefixed path, kept in one slot of names; the
+  // path is the key past the prefix
+  if (!(items = (BatchPutItem *) calloc(batchSize, sizeof(BatchPutItem))) ||
+      !(statuses = (S3Status *) malloc(batchSize * sizeof(S3Status))) ||
+      !(names = (char *) malloc(batchSize * (S3_MAX_KEY_SIZE + 1)))) {
+    statusG = S3StatusOutOfMemory;
+    printError();
+    goto clean;
+  }
+
+  gettimeofday(&start, 0);
+
+  while (!done) {
+    count = 0;
+    while ((count < batchSize) &&
+        !(done = ((len = read_line(in, line, sizeof(line))) < 0))) {
+      if (!len) {
+        continue;
+      }
+      // A line too long for the buffer reads as longer than any key
+      if ((prefixLen + len) > S3_MAX_KEY_SIZE) {
+        printf("%s\t%s\n", line, S3_get_status_name(S3StatusKeyTooLong));
+        failed++;
+        continue;
+      }
+      char *key = &(names[count * (S3_MAX_KEY_SIZE + 1)]);
+      memcpy(key, prefix, prefixLen);
+      memcpy(&(key[prefixLen]), line, len + 1);
+      items[count].key = key;
+      items[count].path = &(key[prefixLen]);
+      count++;
+    }
+    if (!count) {
+      continue;
+    }
+
+    int batchFailed = put_batch(&bucketContext, items, count, parallel,
+        statuses);
+    if (batchFailed < 0) {
+      printError();
       goto clean;
     }
+    for (i = 0; i < count; i++) {
+      if (statuses[i] != S3StatusOK) {
+        printf("%s\t%s\n", items[i].path, S3_get_status_name(statuses[i]));
+      }
+    }
+    stored += count - batchFailed;
+    failed += batchFailed;
+  }
+
+  gettimeofday(&end, 0);
+  double elapsed = (end.tv_sec - start.tv_sec) +
+    ((end.tv_usec - start.tv_usec) / 1000000.0);
+  fprintf(stderr, "%llu stored, %llu failed in %.2f s (%.0f requests/s)\n",
+      (unsigned long long) stored, (unsigned long long) failed, elapsed,
+      (elapsed > 0) ? ((stored + failed) / elapsed) : 0.0);
+  if (failed) {
+    statusG = S3StatusInternalError;
+  }
+
+clean:
+  free(items);
+  free(statuses);
+  free(names);
+  S3_deinitialize();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Presigned URLs.  A presigned URL carries its own signature in the query
+// string, so a client without credentials can GET or PUT the object with it
+// until it expires.  S3_generate_authenticated_query_string() only signs GETs
+// and derives the HMAC key state again for every URL; a Presigner derives it
+// once, signs GETs and PUTs the same way libs3 does, and writes each URL
+// straight into the caller's buffer.
+
+// libs3's MAX_EXPIRES, Jan 19 2038
+#define PRESIGN_MAX_EXPIRES ((((int64_t) 1) << 31) - 1)
+// Keys read and signed at a time by the presign command
+#define PRESIGN_BATCH_SIZE 1024
+
+// SHA-1 (FIPS 180-1), for the HMAC-SHA1 of signature version 2
+typedef struct SHA1Context
+{
+  uint32_t state[5];
+  uint64_t length;
+  unsigned char buffer[64];
+} SHA1Context;
+
+#define SHA1_ROTL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static void sha1_transform(uint32_t state[5], const unsigned char *block)
+{
+  uint32_t w[80];
+  uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+  uint32_t e = state[4];
+  int i;
+
+  for (i = 0; i < 16; i++) {
+    w[i] = (((uint32_t) block[i * 4]) << 24) |
+      (((uint32_t) block[i * 4 + 1]) << 16) |
+      (((uint32_t) block[i * 4 + 2]) << 8) |
+      ((uint32_t) block[i * 4 + 3]);
+  }
+  for (i = 16; i < 80; i++) {
+    w[i] = SHA1_ROTL(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+  }
+
+  for (i = 0; i < 80; i++) {
+    uint32_t f, k;
+    if (i < 20) {
+      f = (b & c) | (~b & d);
+      k = 0x5a827999;
+    }
+    else if (i < 40) {
+      f = b ^ c ^ d;
+      k = 0x6ed9eba1;
+    }
+    else if (i < 60) {
+      f = (b & c) | (b & d) | (c & d);
+      k = 0x8f1bbcdc;
+    }
+    else {
+      f = b ^ c ^ d;
+      k = 0xca62c1d6;
+    }
+    uint32_t x = SHA1_ROTL(a, 5) + f + e + k + w[i];
+    e = d;
+    d = c;
+    c = SHA1_ROTL(b, 30);
+    b = a;
+    a = x;
+  }
+
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+  state[4] += e;
+}
+
+static void sha1_init(SHA1Context *context)
+{
+  context->state[0] = 0x67452301;
+  context->state[1] = 0xefcdab89;
+  context->state[2] = 0x98badcfe;
+  context->state[3] = 0x10325476;
+  context->state[4] = 0xc3d2e1f0;
+  context->length = 0;
+}
+
+static void sha1_update(SHA1Context *context, const void *data, size_t len)
+{
+  const unsigned char *in = (const unsigned char *) data;
+  size_t used = context->length & 63;
+
+  context->length += len;
+
+  if (used) {
+    size_t toCopy = 64 - used;
+    if (toCopy > len) {
+      toCopy = len;
+    }
+    memcpy(&(context->buffer[used]), in, toCopy);
+    in += toCopy, len -= toCopy, used += toCopy;
+    if (used < 64) {
+      return;
+    }
+    sha1_transform(context->state, context->buffer);
+  }
+
+  while (len >= 64) {
+    sha1_transform(context->state, in);
+    in += 64, len -= 64;
+  }
+
+  memcpy(context->buffer, in, len);
+}
+
+static void sha1_final(SHA1Context *context, unsigned char digest[20])
+{
+  static const unsigned char padding[64] = { 0x80 };
+  unsigned char bits[8];
+  uint64_t length = context->length * 8;
+  size_t used = context->length & 63;
+  int i;
+
+  for (i = 0; i < 8; i++) {
+    bits[i] = (unsigned char) (length >> ((7 - i) * 8));
+  }
+  sha1_update(context, padding, (used < 56) ? (56 - used) : (120 - used));
+  sha1_update(context, bits, 8);
+
+  for (i = 0; i < 20; i++) {
+    digest[i] = (unsigned char) (context->state[i / 4] >> ((3 - (i % 4)) * 8));
+  }
+}
+
+// The HMAC-SHA1 states after hashing the inner and outer key pads; signing
+// a message starts from copies of them instead of hashing the pads again
+typedef struct HmacKey
+{
+  SHA1Context inner;
+  SHA1Context outer;
+} HmacKey;
+
+static void hmac_key_init(HmacKey *hmacKey, const void *key, size_t len)
+{
+  unsigned char block[64], pad[64];
+  int i;
+
+  memset(block, 0, sizeof(block));
+  if (len > sizeof(block)) {
+    SHA1Context context;
+    sha1_init(&context);
+    sha1_update(&context, key, len);
+    sha1_final(&context, block);
+  }
+  else {
+    memcpy(block, key, len);
+  }
+
+  for (i = 0; i < 64; i++) {
+    pad[i] = block[i] ^ 0x36;
+  }
+  sha1_init(&(hmacKey->inner));
+  sha1_update(&(hmacKey->inner), pad, sizeof(pad));
+  for (i = 0; i < 64; i++) {
+    pad[i] = block[i] ^ 0x5c;
+  }
+  sha1_init(&(hmacKey->outer));
+  sha1_update(&(hmacKey->outer), pad, sizeof(pad));
+}
+
+// Finishes an HMAC whose message was fed into inner, a copy of key->inner
+static void hmac_final(const HmacKey *hmacKey, SHA1Context *inner,
+    unsigned char mac[20])
+{
+  SHA1Context outer = hmacKey->outer;
+  unsigned char digest[20];
+
+  sha1_final(inner, digest);
+  sha1_update(&outer, digest, sizeof(digest));
+  sha1_final(&outer, mac);
+}
+
+// URL-encodes src into dest the way libs3 does; returns the length written,
+// or -1 if it does not fit in size bytes with its terminating 0
+static int presign_url_encode(char *dest, int size, const char *src)
+{
+  static const char hex[] = "0123456789ABCDEF";
+  int len = 0;
+
+  for (; *src; src++) {
+    unsigned char c = (unsigned char) *src;
+    if (isalnum(c) || strchr("-_.!~*'()/", c)) {
+      if (len + 2 > size) {
+        return -1;
+      }
+      dest[len++] = c;
+    }
+    else {
+      if (len + 4 > size) {
+        return -1;
+      }
+      dest[len++] = '%';
+      dest[len++] = hex[c >> 4];
+      dest[len++] = hex[c & 15];
+    }
+  }
+  dest[len] = 0;
+  return len;
+}
+
+typedef enum
+{
+  PresignMethodGet,
+  PresignMethodPut
+} PresignMethod;
+
+typedef struct Presigner
+{
+  HmacKey hmacKey;
+  const char *accessKeyId;
+  // What every URL starts with: "http://host/bucket/" for path style,
+  // "http://bucket.host/" for virtual host style
+  char prefix[sizeof("https://") + S3_MAX_HOSTNAME_SIZE +
+      S3_MAX_BUCKET_NAME_SIZE + 2];
+  int prefixLength;
+  // What every canonicalized resource starts with: "/bucket/"
+  char resource[S3_MAX_BUCKET_NAME_SIZE + 3];
+  int resourceLength;
+} Presigner;
+
+// Returns zero if the host or bucket name is too long.
+static int presigner_init(Presigner *presigner,
+    const S3BucketContext *bucketContext, const char *hostName)
+{
+  const char *scheme =
+    (bucketContext->protocol == S3ProtocolHTTPS) ? "https" : "http";
+  int len;
+
+  if (bucketContext->hostName) {
+    hostName = bucketContext->hostName;
+  }
+  if (bucketContext->uriStyle == S3UriStylePath) {
+    len = snprintf(presigner->prefix, sizeof(presigner->prefix),
+        "%s://%s/%s/", scheme, hostName, bucketContext->bucketName);
+  }
+  else {
+    len = snprintf(presigner->prefix, sizeof(presigner->prefix),
+        "%s://%s.%s/", scheme, bucketContext->bucketName, hostName);
+  }
+  if ((len < 0) || (len >= (int) sizeof(presigner->prefix))) {
+    return 0;
+  }
+  presigner->prefixLength = len;
+
+  len = snprintf(presigner->resource, sizeof(presigner->resource), "/%s/",
+      bucketContext->bucketName);
+  if ((len < 0) || (len >= (int) sizeof(presigner->resource))) {
+    return 0;
+  }
+  presigner->resourceLength = len;
+
+  presigner->accessKeyId = bucketContext->accessKeyId;
+  hmac_key_init(&(presigner->hmacKey), bucketContext->secretAccessKey,
+      strlen(bucketContext->secretAccessKey));
+  return 1;
+}
+
+// Writes the URL that lets its holder do method on key until expires
+// (seconds since the epoch, negative for as late as possible) into buffer.
+// Returns the length of the URL, or -1 if it does not fit in bufferSize
+// bytes; S3_MAX_AUTHENTICATED_QUERY_STRING_SIZE is always enough.  The PUT
+// must be sent without a Content-Type or Content-MD5 header, as neither is
+// signed.
+static int presign(const Presigner *presigner, PresignMethod method,
+    const char *key, int64_t expires, char *buffer, int bufferSize)
+{
+  static const char base64[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  SHA1Context inner = presigner->hmacKey.inner;
+  unsigned char mac[20];
+  char header[64], signature[29];
+  int len, keyLength, i;
+
+  if ((expires < 0) || (expires > PRESIGN_MAX_EXPIRES)) {
+    expires = PRESIGN_MAX_EXPIRES;
+  }
+  if (bufferSize <= presigner->prefixLength) {
+    return -1;
+  }
+
+  // The encoded key is written in its place in the URL and signed from there
+  memcpy(buffer, presigner->prefix, presigner->prefixLength);
+  len = presigner->prefixLength;
+  if ((keyLength = presign_url_encode(&(buffer[len]), bufferSize - len,
+          key)) < 0) {
+    return -1;
+  }
+
+  // StringToSign: method, Content-MD5, Content-Type, Expires, resource
+  i = snprintf(header, sizeof(header), "%s\n\n\n%ld\n",
+      (method == PresignMethodPut) ? "PUT" : "GET", (long) expires);
+  sha1_update(&inner, header, i);
+  sha1_update(&inner, presigner->resource, presigner->resourceLength);
+  sha1_update(&inner, &(buffer[len]), keyLength);
+  hmac_final(&(presigner->hmacKey), &inner, mac);
+  len += keyLength;
+
+  for (i = 0; i < 7; i++) {
+    uint32_t bits = (mac[i * 3] << 16) | (mac[i * 3 + 1] << 8) |
+      ((i < 6) ? mac[i * 3 + 2] : 0);
+    signature[i * 4] = base64[(bits >> 18) & 63];
+    signature[i * 4 + 1] = base64[(bits >> 12) & 63];
+    signature[i * 4 + 2] = base64[(bits >> 6) & 63];
+    signature[i * 4 + 3] = (i < 6) ? base64[bits & 63] : '=';
+  }
+  signature[28] = 0;
+
+  i = snprintf(&(buffer[len]), bufferSize - len,
+      "?AWSAccessKeyId=%s&Expires=%ld&Signature=", presigner->accessKeyId,
+      (long) expires);
+  if ((i < 0) || (i >= (bufferSize - len))) {
+    return -1;
+  }
+  len += i;
+  if ((i = presign_url_encode(&(buffer[len]), bufferSize - len,
+          signature)) < 0) {
+    return -1;
+  }
+  return len + i;
+}
+
+// Signs count keys for the same method and expiry.  The URL of keys[i] is
+// written at buffers + (i * stride) and its length, or -1, to lengths[i].
+// Returns the number of keys whose URL did not fit.
+static int presign_batch(const Presigner *presigner, PresignMethod method,
+    int count, const char * const *keys, int64_t expires, char *buffers,
+    int stride, int *lengths)
+{
+  int failed = 0, i;
+
+  for (i = 0; i < count; i++) {
+    lengths[i] = presign(presigner, method, keys[i], expires,
+        &(buffers[(size_t) i * stride]), stride);
+    if (lengths[i] < 0) {
+      failed++;
+    }
+  }
+  return failed;
+}
+
+// Prints the URLs for every key listed one per line in in; keys that could
+// not be signed are printed with their status.
+static void presign_objects(const char *bucketName, FILE *in,
+    PresignMethod method, int64_t expires)
+{
+  Presigner presigner;
+  char (*lines)[S3_MAX_KEY_SIZE + 2] = 0;
+  const char **keys = 0;
+  char *urls = 0;
+  int *lengths = 0;
+  int64_t signedCount = 0;
+  int failed = 0, count, len, i;
+  S3Status status = S3StatusOK;
+  struct timeval start, end;
+
+  S3BucketContext bucketContext =
+  {
+    0,
+    bucketName,
+    protocolG,
+    uriStyleG,
+    accessKeyIdG,
+    secretAccessKeyG,
+    0
+  };
+
+  if (!presigner_init(&presigner, &bucketContext, hostNameG)) {
+    statusG = S3StatusUriTooLong;
+    printError();
+    return;
+  }
+
+  lines = malloc(PRESIGN_BATCH_SIZE * sizeof(*lines));
+  keys = (const char **) malloc(PRESIGN_BATCH_SIZE * sizeof(*keys));
+  urls = (char *) malloc((size_t) PRESIGN_BATCH_SIZE *
+      S3_MAX_AUTHENTICATED_QUERY_STRING_SIZE);
+  lengths = (int *) malloc(PRESIGN_BATCH_SIZE * sizeof(*lengths));
+  if (!lines || !keys || !urls || !lengths) {
+    statusG = S3StatusOutOfMemory;
+    printError();
+    goto clean;
+  }
+
+  gettimeofday(&start, 0);
+
+  do {
+    count = 0;
+    while ((count < PRESIGN_BATCH_SIZE) &&
+        ((len = read_line(in, lines[count], sizeof(lines[count]))) >= 0)) {
+      char *line = lines[count];
+      if (!len) {
+        continue;
+      }
+      if (len > S3_MAX_KEY_SIZE) {
+        printf("%s\t%s\n", line, S3_get_status_name(S3StatusKeyTooLong));
+        status = S3StatusKeyTooLong;
+        failed++;
+        continue;
+      }
+      keys[count++] = line;
+    }
+
+    presign_batch(&presigner, method, count, keys, expires, urls,
+        S3_MAX_AUTHENTICATED_QUERY_STRING_SIZE, lengths);
+    for (i = 0; i < count; i++) {
+      if (lengths[i] < 0) {
+        printf("%s\t%s\n", keys[i], S3_get_status_name(S3StatusUriTooLong));
+        status = S3StatusUriTooLong;
+        failed++;
+        continue;
+      }
+      signedCount++;
+      char *url = &(urls[(size_t) i * S3_MAX_AUTHENTICATED_QUERY_STRING_SIZE]);
+      url[lengths[i]] = '\n';
+      fwrite(url, 1, lengths[i] + 1, stdout);
+    }
+  } while (count == PRESIGN_BATCH_SIZE);
+
+  gettimeofday(&end, 0);
+  double seconds = (end.tv_sec - start.tv_sec) +
+    ((end.tv_usec - start.tv_usec) / 1000000.0);
+  fprintf(stderr, "Signed %lld URLs in %.3f seconds (%.0f/s), %d failed\n",
+      (long long) signedCount, seconds,
+      (seconds > 0) ? (signedCount / seconds) : 0.0, failed);
+
+  statusG = status;
+
+ clean:
+  free(lengths);
+  free(urls);
+  free(keys);
+  free(lines);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Returns the value of a "name=value" command line parameter if the parameter
+// has the given name, 0 otherwise
+static const char *param_value(const char *param, const char *name)
+{
+  size_t len = strlen(name);
+
+  if (!strncmp(param, name, len) && (param[len] == '=')) {
+    return &(param[len + 1]);
+  }
+  return 0;
+}
+
+static void usageExit(FILE *out);
+
+// Sets dnsSpreadG from a "dns=off|rr|least|fast" parameter.  Returns zero if
+// param is not one.
+static int dns_spread_param(const char *param)
+{
+  const char *value = param_value(param, "dns");
+
+  if (!value) {
+    return 0;
+  }
+  if (!strcmp(value, "rr")) {
+    dnsSpreadG = DnsSpreadRoundRobin;
+  }
+  else if (!strcmp(value, "least")) {
+    dnsSpreadG = DnsSpreadLeastLoaded;
+  }
+  else if (!strcmp(value, "fast")) {
+    dnsSpreadG = DnsSpreadFastest;
+  }
+  else if (!strcmp(value, "off")) {
+    dnsSpreadG = DnsSpreadOff;
+  }
+  else {
+    fprintf(stderr, "\nERROR: Unknown dns policy: %s\n", value);
+    usageExit(stderr);
+  }
+  return 1;
+}
+
+// Applies param to options if it is one of the transfer options.  Returns
+// zero if it is not, exits if its value is invalid.
+static int transfer_options_param(TransferOptions *options, const char *param)
+{
+  const char *value;
+
+  if ((value = param_value(param, "partsize"))) {
+    options->partSize = strtoull(value, 0, 10);
+    if ((options->partSize < MULTIPART_CHUNK_SIZE) ||
+        (options->partSize > MULTIPART_MAX_PART_SIZE)) {
+      fprintf(stderr, "\nERROR: partsize must be between %d and %d\n",
+          MULTIPART_CHUNK_SIZE, MULTIPART_MAX_PART_SIZE);
+      usageExit(stderr);
+    }
+  }
+  else if ((value = param_value(param, "iobuffer"))) {
+    if ((options->ioBufferSize = atoi(value)) < 4096) {
+      fprintf(stderr, "\nERROR: iobuffer must be at least 4096\n");
+      usageExit(stderr);
+    }
+  }
+  else if ((value = param_value(param, "iobuffers"))) {
+    if ((options->ioBufferCount = atoi(value)) < 2) {
+      fprintf(stderr, "\nERROR: iobuffers must be at least 2\n");
+      usageExit(stderr);
+    }
+  }
+  else if ((value = param_value(param, "direct"))) {
+    options->directIo = atoi(value);
+  }
+  else if ((value = param_value(param, "verify"))) {
+    options->verify = atoi(value);
+  }
+  else if ((value = param_value(param, "progress"))) {
+    options->progressIntervalMs = atoi(value);
+  }
+  else {
+    return 0;
+  }
+
+  return 1;
+}
+
+static void usageExit(FILE *out)
+{
+  fprintf(out,
+      "Usage: sample [options] <command> ...\n"
+      "  Options:\n"
+      "    -s, --https   Use HTTPS instead of HTTP; requests in flight at\n"
+      "                  once are then limited to 32 so that connections\n"
+      "                  and TLS sessions are reused rather than set up by\n"
+      "                  a full handshake\n"
+      "    -a, --alloc-stats\n"
+      "                  Print at exit how many request buffers were\n"
+      "                  allocated and how many were reused\n"
+      "    -e, --endpoints=host[:port],...\n"
+      "                  Equivalent endpoints to send requests to; copy and\n"
+      "                  sync send each request to the endpoint that has\n"
+      "                  lately been quickest to answer, and stop using one\n"
+      "                  that keeps failing until a later probe request\n"
+      "                  succeeds.  Every other command sends all of its\n"
+      "                  requests to the first endpoint\n"
+      "    --connect-timeout=ms\n"
+      "                  Stop a request not connected and sent after ms\n"
+      "                  milliseconds\n"
+      "    --first-byte-timeout=ms\n"
+      "                  Stop a request whose response has not started ms\n"
+      "                  milliseconds after it was sent\n"
+      "    --timeout=ms  Stop a request not complete after ms milliseconds\n"
+      "    --low-speed-limit=bytes, --low-speed-time=ms\n"
+      "                  Stop a request that moves fewer than bytes in ms\n"
+      "                  milliseconds\n"
+      "                  These limits apply to the requests that upload or\n"
+      "                  download a single object and to those of sync, which\n"
+      "                  an interrupt (Ctrl-C) also stops; stopped requests\n"
+      "                  fail with status Interrupted\n"
+      "    --profile     Print at exit how the time of those same requests\n"
+      "                  went: in our callbacks, in library CPU, or waiting\n"
+      "    --profile-trace=file\n"
+      "                  Profile, and write each request and each slow\n"
+      "                  callback to file as Chrome trace JSON\n"
+      "    --stall-ms=ms Profile, and flag callbacks that block for ms\n"
+      "                  milliseconds or more (default 100)\n"
+      "  Commands:\n"
+      "       sample <localFile> <bucket> <key> <localReplica>\n"
+      "              [partsize=n] [iobuffer=n] [iobuffers=n] [direct=1]\n"
+      "              [progress=ms] [verify=1]\n"
+      "         Uploads localFile to bucket/key and downloads it back to\n"
+      "         localReplica, in parts of partsize bytes, staging data in\n"
+      "         iobuffers buffers of iobuffer bytes, reading localFile with\n"
+      "         O_DIRECT if direct=1 and reporting progress every ms\n"
+      "         milliseconds (0 for never); verify=1 checks the download\n"
+      "         against the object's ETag, also a multipart one if its\n"
+      "         part size can be guessed, and CRC32C (x-amz-meta-crc32c,\n"
+      "         in hex) as it is received\n"
+      "       sample list <bucket> [prefix=p] [marker=m] [delimiter=d]\n"
+      "                   [maxkeys=n] [parallel=n] [split=chars]\n"
+      "         Lists keys; with parallel > 1 the keyspace is split at\n"
+      "         prefix+c for split characters c and the ranges are listed\n"
+      "         concurrently, output stays in key order\n"
+      "       sample uploads <bucket> [prefix=p] [lookahead=n]\n"
+      "       sample parts <bucket> <key> <uploadId> [lookahead=n]\n"
+      "         List in-progress multipart uploads or the parts of one,\n"
+      "         fetching up to lookahead pages ahead of the output\n"
+      "       sample abort <bucket> [prefix=p] [age=s] [parallel=n]\n"
+      "                    [dryrun=1]\n"
+      "         Aborts the multipart uploads under prefix initiated more\n"
+      "         than s seconds ago (default a day), parallel at a time;\n"
+      "         with dryrun=1 they are only listed\n"
+      "       sample delete <bucket> <key>\n"
+      "       sample delete <bucket> keys=<file|-> [parallel=n]\n"
+      "         Deletes one key, or every key listed one per line in file\n"
+      "         (- for stdin) with up to parallel deletes in flight; keys\n"
+      "         that failed are printed with their status\n"
+      "       sample copy <bucket> <key> <destBucket> [destKey]\n"
+      "       sample copy <bucket> prefix=p <destBucket> [destprefix=q]\n"
+      "                   [parallel=n] [dns=off|rr|least|fast]\n"
+      "         Server-side copy of one object, or of every object under\n"
+      "         prefix p to the same key with p replaced by q\n"
+      "       sample sync <localDir> <bucket> [prefix=p]\n"
+      "                   [mode=upload|download] [parallel=n]\n"
+      "                   [partsize=n] [force=1] [dns=off|rr|least|fast]\n"
+      "                   [verify=1]\n"
+      "         Uploads localDir to bucket/prefix, or downloads it back,\n"
+      "         on parallel worker threads; files whose size and ETag\n"
+      "         already match are skipped unless force is set\n"
+      "         verify=1 checks downloads against their ETag as they are\n"
+      "         received\n"
+      "         dns=rr or dns=least spreads requests over all addresses of\n"
+      "         the endpoint, round robin or to the least loaded one, and\n"
+      "         dns=fast to the one that has lately been quickest to\n"
+      "         answer a request\n"
+      "       sample pack <bucket> <container> files=<file|-> [parallel=n]\n"
+      "         Appends the files listed one per line in file (- for\n"
+      "         stdin) into the object container and writes the index\n"
+      "         object container" PACK_INDEX_SUFFIX "; members are named\n"
+      "         by their path without a leading / and files whose path\n"
+      "         has a .. component are skipped\n"
+      "       sample unpack <bucket> <container> [outdir=d] [parallel=n]\n"
+      "                     [member ...]\n"
+      "         Extracts the given members, or all of them, into outdir\n"
+      "         using ranged GETs that cover neighbouring members\n"
+      "       sample fetch <bucket> keys=<file|-> [outdir=d] [parallel=n]\n"
+      "                    [hedge=ms|pNN] [hedgepct=n]\n"
+      "         Downloads every key listed one per line in file (- for\n"
+      "         stdin) into outdir, with up to parallel (at most 32) GETs\n"
+      "         in flight over reused connections\n"
+      "         hedge sends a second GET for a key that has not started\n"
+      "         to arrive after ms milliseconds, or after the NNth\n"
+      "         percentile of recent first-byte times; the first to answer\n"
+      "         is kept.  At most hedgepct (default 5) percent of GETs are\n"
+      "         hedged\n"
+      "       sample cat <bucket> <key> [offset=n] [length=n] [chunk=n]\n"
+      "                  [window=n]\n"
+      "         Writes length bytes (default all) of the object from\n"
+      "         offset to stdout as they arrive, reading ahead with up to\n"
+      "         window (default 16) ranged GETs of chunk bytes (default\n"
+      "         1 MB) in flight\n"
+      "       sample pread <bucket> <key> ranges=<file|-> [block=n]\n"
+      "                    [blocks=n] [parallel=n] [cachefile=f]\n"
+      "         Writes the ranges of the object listed one \"offset\n"
+      "         length\" per line in file (- for stdin) to stdout, through\n"
+      "         a cache of blocks (default 256) of block bytes (default\n"
+      "         256 KB) that fetches missing blocks with up to parallel\n"
+      "         (default 8) GETs at once; cachefile also keeps every block\n"
+      "         fetched in the sparse file f for later runs\n"
+      "       sample put <bucket> files=<file|-> [prefix=p] [parallel=n]\n"
+      "                  [batch=n]\n"
+      "         Stores the local files listed one per line in file (- for\n"
+      "         stdin) at their paths under prefix p, in batches of n\n"
+      "         (default 1024) sent with up to parallel (default 32) PUTs\n"
+      "         in flight; files that failed are printed with their status\n"
+      "       sample presign <bucket> <key> [method=get|put] [expires=s]\n"
+      "       sample presign <bucket> keys=<file|-> [method=get|put]\n"
+      "                      [expires=s]\n"
+      "         Prints URLs that allow a GET or PUT of each key without\n"
+      "         credentials for s seconds (default 3600); PUTs must be sent\n"
+      "         without Content-Type and Content-MD5\n"
+      "       sample stream <bucket> <key> [file=f] [partsize=n]\n"
+      "                     [parallel=n]\n"
+      "         Uploads everything read from f (default stdin, may be a\n"
+      "         pipe) without knowing its length, sending parts of partsize\n"
+      "         bytes as they fill with up to parallel in flight\n");
+  exit(-1);
+}
+
+static void list_command(int argc, char **argv)
+{
+  if (argc < 1) {
+    usageExit(stderr);
+  }
+
+  const char *bucketName = argv[0];
+  const char *prefix = 0, *marker = 0, *delimiter = 0, *splitChars = 0;
+  int maxKeys = 0, parallel = 1;
+  int i;
+  for (i = 1; i < argc; i++) {
+    const char *value;
+    if ((value = param_value(argv[i], "prefix"))) {
+      prefix = value;
+    }
+    else if ((value = param_value(argv[i], "marker"))) {
+      marker = value;
+    }
+    else if ((value = param_value(argv[i], "delimiter"))) {
+      delimiter = value;
+    }
+    else if ((value = param_value(argv[i], "maxkeys"))) {
+      maxKeys = atoi(value);
+    }
+    else if ((value = param_value(argv[i], "parallel"))) {
+      parallel = atoi(value);
+    }
+    else if ((value = param_value(argv[i], "split"))) {
+      splitChars = value;
+    }
+    else {
+      fprintf(stderr, "\nERROR: Unknown param: %s\n", argv[i]);
+      usageExit(stderr);
+    }
+  }
+
+  showResponsePropertiesG = 0;
+  list_bucket(bucketName, prefix, marker, delimiter, maxKeys, parallel,
+      splitChars);
+}
+
+static void uploads_command(int argc, char **argv)
+{
+  if (argc < 1) {
+    usageExit(stderr);
+  }
+
+  const char *bucketName = argv[0];
+  const char *prefix = 0;
+  int lookahead = 0;
+  int i;
+  for (i = 1; i < argc; i++) {
+    const char *value;
+    if ((value = param_value(argv[i], "prefix"))) {
+      prefix = value;
+    }
+    else if ((value = param_value(argv[i], "lookahead"))) {
+      lookahead = atoi(value);
+    }
+    else {
+      fprintf(stderr, "\nERROR: Unknown param: %s\n", argv[i]);
+      usageExit(stderr);
+    }
+  }
+
+  showResponsePropertiesG = 0;
+  list_uploads(bucketName, prefix, lookahead);
+}
+
+static void abort_command(int argc, char **argv)
+{
+  if (argc < 1) {
+    usageExit(stderr);
+  }
+
+  const char *bucketName = argv[0];
+  const char *prefix = 0;
+  int64_t age = ABORT_DEFAULT_AGE;
+  int parallel = ABORT_DEFAULT_PARALLEL, dryRun = 0;
+  int i;
+  for (i = 1; i < argc; i++) {
+    const char *value;
+    if ((value = param_value(argv[i], "prefix"))) {
+      prefix = value;
+    }
+    else if ((value = param_value(argv[i], "age"))) {
+      age = strtoll(value, 0, 10);
+    }
+    else if ((value = param_value(argv[i], "parallel"))) {
+      parallel = atoi(value);
+    }
+    else if ((value = param_value(argv[i], "dryrun"))) {
+      dryRun = atoi(value);
+    }
+    else {
+      fprintf(stderr, "\nERROR: Unknown param: %s\n", argv[i]);
+      usageExit(stderr);
+    }
+  }
+
+  showResponsePropertiesG = 0;
+  abort_stale_uploads(bucketName, prefix, age, parallel, dryRun);
+}
+
+static void parts_command(int argc, char **argv)
+{
+  if (argc < 3) {
+    usageExit(stderr);
+  }
+
+  int lookahead = 0;
+  int i;
+  for (i = 3; i < argc; i++) {
+    const char *value;
+    if ((value = param_value(argv[i], "lookahead"))) {
+      lookahead = atoi(value);
+    }
+    else {
+      fprintf(stderr, "\nERROR: Unknown param: %s\n", argv[i]);
+      usageExit(stderr);
+    }
+  }
+
+  showResponsePropertiesG = 0;
+  list_parts(argv[0], argv[1], argv[2], lookahead);
+}
+
+static void delete_command(int argc, char **argv)
+{
+  if (argc < 2) {
+    usageExit(stderr);
+  }
+
+  const char *bucketName = argv[0];
+  const char *keysFile = 0;
+  int parallel = DELETE_DEFAULT_PARALLEL;
+  int i;
+  for (i = 1; i < argc; i++) {
+    const char *value;
+    if ((value = param_value(argv[i], "keys"))) {
+      keysFile = value;
+    }
+    else if ((value = param_value(argv[i], "parallel"))) {
+      parallel = atoi(value);
+    }
+    else if ((i == 1) && (argc == 2)) {
+      delete_object(bucketName, argv[i]);
+      return;
+    }
+    else {
+      fprintf(stderr, "\nERROR: Unknown param: %s\n", argv[i]);
+      usageExit(stderr);
+    }
+  }
+
+  if (!keysFile) {
+    usageExit(stderr);
+  }
+
+  FILE *in = stdin;
+  if (strcmp(keysFile, "-") && !(in = fopen(keysFile, "r"))) {
+    fprintf(stderr, "\nERROR: Failed to open input file %s: ", keysFile);
+    perror(0);
+    exit(-1);
+  }
+
+  showResponsePropertiesG = 0;
+  delete_objects(bucketName, in, parallel);
+
+  if (in != stdin) {
+    fclose(in);
+  }
+}
+
+static void copy_command(int argc, char **argv)
+{
+  if (argc < 3) {
+    usageExit(stderr);
+  }
+
+  const char *bucketName = argv[0];
+  const char *prefix = param_value(argv[1], "prefix");
+  const char *destinationBucket = argv[2];
+
+  if (!prefix) {
+    if (argc > 4) {
+      usageExit(stderr);
+    }
+    copy_object(bucketName, argv[1], destinationBucket,
+        (argc > 3) ? argv[3] : argv[1]);
+    return;
+  }
+
+  const char *destinationPrefix = 0;
+  int parallel = COPY_DEFAULT_PARALLEL;
+  int i;
+  for (i = 3; i < argc; i++) {
+    const char *value;
+    if ((value = param_value(argv[i], "destprefix"))) {
+      destinationPrefix = value;
+    }
+    else if ((value = param_value(argv[i], "parallel"))) {
+      parallel = atoi(value);
+    }
+    else if (dns_spread_param(argv[i])) {
+    }
+    else {
+      fprintf(stderr, "\nERROR: Unknown param: %s\n", argv[i]);
+      usageExit(stderr);
+    }
+  }
 
-clean:
-    if(manager.upload_id)
-      free(manager.upload_id);
-    for(i=0;i<manager.next_etags_pos;i++) {
-      free(manager.etags[i]);
+  showResponsePropertiesG = 0;
+  copy_prefix(bucketName, prefix, destinationBucket, destinationPrefix,
+      parallel);
+}
+
+static void sync_command(int argc, char **argv)
+{
+  if (argc < 2) {
+    usageExit(stderr);
+  }
+
+  const char *localDir = argv[0];
+  const char *bucketName = argv[1];
+  const char *prefix = 0;
+  int download = 0, parallel = SYNC_DEFAULT_PARALLEL, force = 0, verify = 0;
+  uint64_t partSize = 0;
+  int i;
+  for (i = 2; i < argc; i++) {
+    const char *value;
+    if ((value = param_value(argv[i], "prefix"))) {
+      prefix = value;
+    }
+    else if ((value = param_value(argv[i], "mode"))) {
+      if (!strcmp(value, "download")) {
+        download = 1;
+      }
+      else if (strcmp(value, "upload")) {
+        fprintf(stderr, "\nERROR: Unknown mode: %s\n", value);
+        usageExit(stderr);
+      }
+    }
+    else if ((value = param_value(argv[i], "parallel"))) {
+      parallel = atoi(value);
+    }
+    else if ((value = param_value(argv[i], "partsize"))) {
+      partSize = strtoull(value, 0, 10);
+      if (partSize < MULTIPART_CHUNK_SIZE) {
+        fprintf(stderr, "\nERROR: partsize must be at least %d\n",
+            MULTIPART_CHUNK_SIZE);
+        usageExit(stderr);
+      }
+    }
+    else if ((value = param_value(argv[i], "force"))) {
+      force = atoi(value);
+    }
+    else if ((value = param_value(argv[i], "verify"))) {
+      verify = atoi(value);
+    }
+    else if (dns_spread_param(argv[i])) {
+    }
+    else {
+      fprintf(stderr, "\nERROR: Unknown param: %s\n", argv[i]);
+      usageExit(stderr);
     }
-    growbuffer_destroy(manager.gb);
-    free(manager.etags);
   }
 
-  S3_deinitialize();
+  showResponsePropertiesG = 0;
+  sync_directory(localDir, bucketName, prefix, download, parallel, partSize,
+      force, verify);
 }
 
-////////////////////////////////////////////////////////////////////////////////////////////////////
+static void pack_command(int argc, char **argv)
+{
+  if (argc < 3) {
+    usageExit(stderr);
+  }
 
-static S3Status getObjectDataCallback(int bufferSize, const char *buffer,
-    void *callbackData)
+  const char *bucketName = argv[0];
+  const char *key = argv[1];
+  const char *namesFile = 0;
+  int parallel = PACK_DEFAULT_PARALLEL;
+  int i;
+  for (i = 2; i < argc; i++) {
+    const char *value;
+    if ((value = param_value(argv[i], "files"))) {
+      namesFile = value;
+    }
+    else if ((value = param_value(argv[i], "parallel"))) {
+      parallel = atoi(value);
+    }
+    else {
+      fprintf(stderr, "\nERROR: Unknown param: %s\n", argv[i]);
+      usageExit(stderr);
+    }
+  }
+
+  if (!namesFile) {
+    usageExit(stderr);
+  }
+
+  FILE *in = stdin;
+  if (strcmp(namesFile, "-") && !(in = fopen(namesFile, "r"))) {
+    fprintf(stderr, "\nERROR: Failed to open input file %s: ", namesFile);
+    perror(0);
+    exit(-1);
+  }
+
+  showResponsePropertiesG = 0;
+  pack_objects(bucketName, key, in, parallel);
+
+  if (in != stdin) {
+    fclose(in);
+  }
+}
+
+static void unpack_command(int argc, char **argv)
 {
-  FILE *outfile = (FILE *) callbackData;
+  if (argc < 2) {
+    usageExit(stderr);
+  }
 
-  size_t wrote = fwrite(buffer, 1, bufferSize, outfile);
+  const char *bucketName = argv[0];
+  const char *key = argv[1];
+  const char *outputDir = 0;
+  int parallel = PACK_DEFAULT_PARALLEL;
+  int nameCount = 0;
+  int i;
+  for (i = 2; i < argc; i++) {
+    const char *value;
+    if ((value = param_value(argv[i], "outdir"))) {
+      outputDir = value;
+    }
+    else if ((value = param_value(argv[i], "parallel"))) {
+      parallel = atoi(value);
+    }
+    else {
+      // Everything else names a member; collect them at the front
+      argv[2 + nameCount++] = argv[i];
+    }
+  }
 
-  return ((wrote < (size_t) bufferSize) ? 
-      S3StatusAbortedByCallback : S3StatusOK);
+  showResponsePropertiesG = 0;
+  unpack_objects(bucketName, key, outputDir, parallel, nameCount,
+      &(argv[2]));
 }
 
+static void cat_command(int argc, char **argv)
+{
+  if (argc < 2) {
+    usageExit(stderr);
+  }
+
+  const char *bucketName = argv[0];
+  const char *key = argv[1];
+  uint64_t offset = 0, length = 0;
+  int chunkSize = READER_DEFAULT_CHUNK_SIZE;
+  int maxWindow = READER_DEFAULT_MAX_WINDOW;
+  int i;
+  for (i = 2; i < argc; i++) {
+    const char *value;
+    if ((value = param_value(argv[i], "offset"))) {
+      offset = strtoull(value, 0, 10);
+    }
+    else if ((value = param_value(argv[i], "length"))) {
+      length = strtoull(value, 0, 10);
+    }
+    else if ((value = param_value(argv[i], "chunk"))) {
+      chunkSize = atoi(value);
+    }
+    else if ((value = param_value(argv[i], "window"))) {
+      maxWindow = atoi(value);
+    }
+    else {
+      fprintf(stderr, "\nERROR: Unknown param: %s\n", argv[i]);
+      usageExit(stderr);
+    }
+  }
+
+  SET_BINARY_MODE(STDOUT_FILENO);
+  cat_object(bucketName, key, offset, length, chunkSize, maxWindow);
+}
 
-static void get_object(const char *filename, const char *bucketName, const char *key)
+static void pread_command(int argc, char **argv)
 {
-  int64_t ifModifiedSince = -1, ifNotModifiedSince = -1;
-  const char *ifMatch = 0, *ifNotMatch = 0;
-  uint64_t startByte = 0, byteCount = 0;
+  if (argc < 3) {
+    usageExit(stderr);
+  }
 
-  FILE *outfile = 0;
-  if (filename) {
-    // Stat the file, and if it doesn't exist, open it in w mode
-    struct stat buf;
-    if (stat(filename, &buf) == -1) {
-      outfile = fopen(filename, "w" FOPEN_EXTRA_FLAGS);
+  const char *bucketName = argv[0];
+  const char *key = argv[1];
+  const char *rangesFile = 0, *cachePath = 0;
+  int blockSize = BLOCK_CACHE_DEFAULT_BLOCK_SIZE;
+  int blockCount = BLOCK_CACHE_DEFAULT_BLOCKS;
+  int parallel = BLOCK_CACHE_DEFAULT_PARALLEL;
+  int i;
+  for (i = 2; i < argc; i++) {
+    const char *value;
+    if ((value = param_value(argv[i], "ranges"))) {
+      rangesFile = value;
+    }
+    else if ((value = param_value(argv[i], "block"))) {
+      blockSize = atoi(value);
+    }
+    else if ((value = param_value(argv[i], "blocks"))) {
+      blockCount = atoi(value);
+    }
+    else if ((value = param_value(argv[i], "parallel"))) {
+      parallel = atoi(value);
+    }
+    else if ((value = param_value(argv[i], "cachefile"))) {
+      cachePath = value;
     }
     else {
-      // Open in r+ so that we don't truncate the file, just in case
-      // there is an error and we write no bytes, we leave the file
-      // unmodified
-      outfile = fopen(filename, "r+" FOPEN_EXTRA_FLAGS);
+      fprintf(stderr, "\nERROR: Unknown param: %s\n", argv[i]);
+      usageExit(stderr);
     }
+  }
 
-    if (!outfile) {
-      fprintf(stderr, "\nERROR: Failed to open output file %s: ",
-          filename);
-      perror(0);
-      exit(-1);
+  if (!rangesFile) {
+    usageExit(stderr);
+  }
+
+  FILE *in = stdin;
+  if (strcmp(rangesFile, "-") && !(in = fopen(rangesFile, "r"))) {
+    fprintf(stderr, "\nERROR: Failed to open input file %s: ", rangesFile);
+    perror(0);
+    exit(-1);
+  }
+
+  SET_BINARY_MODE(STDOUT_FILENO);
+  pread_object(bucketName, key, in, blockSize, blockCount, parallel,
+      cachePath);
+
+  if (in != stdin) {
+    fclose(in);
+  }
+}
+
+static void put_command(int argc, char **argv)
+{
+  if (argc < 2) {
+    usageExit(stderr);
+  }
+
+  const char *bucketName = argv[0];
+  const char *filesFile = 0, *prefix = 0;
+  int parallel = BATCH_PUT_MAX_PARALLEL;
+  int batchSize = BATCH_PUT_DEFAULT_SIZE;
+  int i;
+  for (i = 1; i < argc; i++) {
+    const char *value;
+    if ((value = param_value(argv[i], "files"))) {
+      filesFile = value;
+    }
+    else if ((value = param_value(argv[i], "prefix"))) {
+      prefix = value;
+    }
+    else if ((value = param_value(argv[i], "parallel"))) {
+      parallel = atoi(value);
+    }
+    else if ((value = param_value(argv[i], "batch"))) {
+      batchSize = atoi(value);
+    }
+    else {
+      fprintf(stderr, "\nERROR: Unknown param: %s\n", argv[i]);
+      usageExit(stderr);
     }
   }
-  else {
-    outfile = stdout;
+
+  if (!filesFile) {
+    usageExit(stderr);
   }
 
-  S3_init();
+  FILE *in = stdin;
+  if (strcmp(filesFile, "-") && !(in = fopen(filesFile, "r"))) {
+    fprintf(stderr, "\nERROR: Failed to open input file %s: ", filesFile);
+    perror(0);
+    exit(-1);
+  }
 
-  S3BucketContext bucketContext =
-  {
-    0,
-    bucketName,
-    protocolG,
-    uriStyleG,
-    accessKeyIdG,
-    secretAccessKeyG,
-    0
-  };
+  put_files(bucketName, in, prefix, batchSize, parallel);
 
-  S3GetConditions getConditions =
-  {
-    ifModifiedSince,
-    ifNotModifiedSince,
-    ifMatch,
-    ifNotMatch
-  };
+  if (in != stdin) {
+    fclose(in);
+  }
+}
 
-  S3GetObjectHandler getObjectHandler =
-  {
-    { &responsePropertiesCallback, &responseCompleteCallback },
-    &getObjectDataCallback
-  };
+static void fetch_command(int argc, char **argv)
+{
+  if (argc < 2) {
+    usageExit(stderr);
+  }
 
-  S3_get_object(&bucketContext, key, &getConditions, startByte,
-      byteCount, 0, &getObjectHandler, outfile);
+  const char *bucketName = argv[0];
+  const char *keysFile = 0, *outputDir = 0;
+  int parallel = FETCH_MAX_PARALLEL;
+  FetchHedge hedge = { 0, 0, HEDGE_DEFAULT_BUDGET };
+  int i;
+  for (i = 1; i < argc; i++) {
+    const char *value;
+    if ((value = param_value(argv[i], "keys"))) {
+      keysFile = value;
+    }
+    else if ((value = param_value(argv[i], "outdir"))) {
+      outputDir = value;
+    }
+    else if ((value = param_value(argv[i], "parallel"))) {
+      parallel = atoi(value);
+    }
+    else if ((value = param_value(argv[i], "hedge"))) {
+      if ((value[0] == 'p') || (value[0] == 'P')) {
+        hedge.percentile = atoi(&(value[1]));
+        if ((hedge.percentile < 1) || (hedge.percentile > 99)) {
+          fprintf(stderr, "\nERROR: Invalid hedge percentile: %s\n",
+              value);
+          usageExit(stderr);
+        }
+      }
+      else if ((hedge.delayMs = atoi(value)) <= 0) {
+        fprintf(stderr, "\nERROR: Invalid hedge delay: %s\n", value);
+        usageExit(stderr);
+      }
+    }
+    else if ((value = param_value(argv[i], "hedgepct"))) {
+      hedge.budget = atoi(value);
+    }
+    else {
+      fprintf(stderr, "\nERROR: Unknown param: %s\n", argv[i]);
+      usageExit(stderr);
+    }
+  }
 
-  if (stdout != outfile && NULL != outfile) {
-    fclose(outfile);
-    outfile = NULL;
+  if (!keysFile) {
+    usageExit(stderr);
   }
 
-  if (statusG != S3StatusOK) {
-    printError();
+  FILE *in = stdin;
+  if (strcmp(keysFile, "-") && !(in = fopen(keysFile, "r"))) {
+    fprintf(stderr, "\nERROR: Failed to open input file %s: ", keysFile);
+    perror(0);
+    exit(-1);
   }
 
-  S3_deinitialize();
+  showResponsePropertiesG = 0;
+  fetch_objects(bucketName, in, outputDir, parallel, &hedge);
+
+  if (in != stdin) {
+    fclose(in);
+  }
+}
+
+static void presign_command(int argc, char **argv)
+{
+  if (argc < 2) {
+    usageExit(stderr);
+  }
+
+  const char *bucketName = argv[0];
+  const char *key = 0, *keysFile = 0;
+  PresignMethod method = PresignMethodGet;
+  int64_t expires = 3600;
+  int i;
+  for (i = 1; i < argc; i++) {
+    const char *value;
+    if ((value = param_value(argv[i], "keys"))) {
+      keysFile = value;
+    }
+    else if ((value = param_value(argv[i], "method"))) {
+      if (!strcasecmp(value, "get")) {
+        method = PresignMethodGet;
+      }
+      else if (!strcasecmp(value, "put")) {
+        method = PresignMethodPut;
+      }
+      else {
+        fprintf(stderr, "\nERROR: Unknown method: %s\n", value);
+        usageExit(stderr);
+      }
+    }
+    else if ((value = param_value(argv[i], "expires"))) {
+      expires = strtoll(value, 0, 10);
+    }
+    else if ((i == 1) && !strchr(argv[i], '=')) {
+      key = argv[i];
+    }
+    else {
+      fprintf(stderr, "\nERROR: Unknown param: %s\n", argv[i]);
+      usageExit(stderr);
+    }
+  }
+
+  if (!key == !keysFile) {
+    usageExit(stderr);
+  }
+  expires += time(0);
+
+  if (key && (method == PresignMethodGet)) {
+    // A single GET is what libs3 itself can sign
+    char buffer[S3_MAX_AUTHENTICATED_QUERY_STRING_SIZE];
+
+    S3_init();
+
+    S3BucketContext bucketContext =
+    {
+      0,
+      bucketName,
+      protocolG,
+      uriStyleG,
+      accessKeyIdG,
+      secretAccessKeyG,
+      0
+    };
+
+    if ((statusG = S3_generate_authenticated_query_string(buffer,
+            &bucketContext, key, expires, 0)) == S3StatusOK) {
+      printf("%s\n", buffer);
+    }
+    else {
+      printError();
+    }
+
+    S3_deinitialize();
+    return;
+  }
+
+  if (key) {
+    Presigner presigner;
+    char buffer[S3_MAX_AUTHENTICATED_QUERY_STRING_SIZE];
+
+    S3BucketContext bucketContext =
+    {
+      0,
+      bucketName,
+      protocolG,
+      uriStyleG,
+      accessKeyIdG,
+      secretAccessKeyG,
+      0
+    };
+
+    if (!presigner_init(&presigner, &bucketContext, hostNameG) ||
+        (presign(&presigner, method, key, expires, buffer,
+                 sizeof(buffer)) < 0)) {
+      statusG = S3StatusUriTooLong;
+      printError();
+      return;
+    }
+    printf("%s\n", buffer);
+    return;
+  }
+
+  FILE *in = stdin;
+  if (strcmp(keysFile, "-") && !(in = fopen(keysFile, "r"))) {
+    fprintf(stderr, "\nERROR: Failed to open input file %s: ", keysFile);
+    perror(0);
+    exit(-1);
+  }
+
+  presign_objects(bucketName, in, method, expires);
+
+  if (in != stdin) {
+    fclose(in);
+  }
+}
+
+static void stream_command(int argc, char **argv)
+{
+  if (argc < 2) {
+    usageExit(stderr);
+  }
+
+  const char *bucketName = argv[0];
+  const char *key = argv[1];
+  const char *filename = 0;
+  TransferOptions options = transferOptionsG;
+  int parallel = STREAM_DEFAULT_PARALLEL;
+  int i;
+  for (i = 2; i < argc; i++) {
+    const char *value;
+    if ((value = param_value(argv[i], "file"))) {
+      filename = value;
+    }
+    else if ((value = param_value(argv[i], "parallel"))) {
+      parallel = atoi(value);
+    }
+    else if (!param_value(argv[i], "partsize") ||
+        !transfer_options_param(&options, argv[i])) {
+      fprintf(stderr, "\nERROR: Unknown param: %s\n", argv[i]);
+      usageExit(stderr);
+    }
+  }
+
+  int fd = 0;
+  if (filename && strcmp(filename, "-") &&
+      ((fd = open(filename, O_RDONLY | O_BINARY)) < 0)) {
+    fprintf(stderr, "\nERROR: Failed to open input file %s: ", filename);
+    perror(0);
+    exit(-1);
+  }
+  if (!fd) {
+    SET_BINARY_MODE(fd);
+  }
+
+  stream_object(bucketName, key, fd, &options, parallel);
+
+  if (fd) {
+    close(fd);
+  }
+}
+
+// Options without a short form
+enum
+{
+  OptionConnectTimeout = 256,
+  OptionFirstByteTimeout,
+  OptionTimeout,
+  OptionLowSpeedLimit,
+  OptionLowSpeedTime,
+  OptionProfile,
+  OptionProfileTrace,
+  OptionStallMs
+};
+
+// Sets the endpoints of an --endpoints option, the first of which becomes
+// the host name libs3 is initialized with
+static void endpoints_option(const char *endpoints)
+{
+  static char firstEndpoint[DNS_ADDRESS_SIZE];
+
+  if (!dns_cache_set_endpoints(&dnsCacheG, endpoints)) {
+    fprintf(stderr, "\nERROR: No endpoint in %s\n", endpoints);
+    usageExit(stderr);
+  }
+  snprintf(firstEndpoint, sizeof(firstEndpoint), "%s",
+      dnsCacheG.addresses[0]);
+  hostNameG = firstEndpoint;
+  if (dnsSpreadG == DnsSpreadOff) {
+    dnsSpreadG = DnsSpreadFastest;
+  }
 }
 
+static struct option longOptionsG[] =
+{
+    { "https",                no_argument,        0,  's' },
+    { "alloc-stats",          no_argument,        0,  'a' },
+    { "endpoints",            required_argument,  0,  'e' },
+    { "connect-timeout",      required_argument,  0,  OptionConnectTimeout },
+    { "first-byte-timeout",   required_argument,  0,  OptionFirstByteTimeout },
+    { "timeout",              required_argument,  0,  OptionTimeout },
+    { "low-speed-limit",      required_argument,  0,  OptionLowSpeedLimit },
+    { "low-speed-time",       required_argument,  0,  OptionLowSpeedTime },
+    { "profile",              no_argument,        0,  OptionProfile },
+    { "profile-trace",        required_argument,  0,  OptionProfileTrace },
+    { "stall-ms",             required_argument,  0,  OptionStallMs },
+    { 0,                      0,                  0,   0  }
+};
+
 int main(int argc, char **argv)
 {
+  int c;
+  // "+" stops at the first non-option, which is the command
+  while ((c = getopt_long(argc, argv, "+sae:", longOptionsG, 0)) != -1) {
+    switch (c) {
+    case 's':
+      protocolG = S3ProtocolHTTPS;
+      break;
+    case 'a':
+      atexit(&alloc_stats_print);
+      break;
+    case 'e':
+      endpoints_option(optarg);
+      break;
+    case OptionConnectTimeout:
+      deadlineG.connectMs = atoi(optarg);
+      break;
+    case OptionFirstByteTimeout:
+      deadlineG.firstByteMs = atoi(optarg);
+      break;
+    case OptionTimeout:
+      deadlineG.totalMs = atoi(optarg);
+      break;
+    case OptionLowSpeedLimit:
+      deadlineG.lowSpeedBytes = atoi(optarg);
+      break;
+    case OptionLowSpeedTime:
+      deadlineG.lowSpeedMs = atoi(optarg);
+      break;
+    case OptionProfile:
+      profiler_start(0);
+      break;
+    case OptionProfileTrace:
+      if (!profiler_start(optarg)) {
+        fprintf(stderr, "\nERROR: Failed to create trace file %s: ", optarg);
+        perror(0);
+        exit(-1);
+      }
+      break;
+    case OptionStallMs:
+      profilerG.stallMs = atoi(optarg);
+      profiler_start(0);
+      break;
+    default:
+      usageExit(stderr);
+    }
+  }
+  // Shift the options away so that argv[1] is the command
+  argc -= optind - 1;
+  argv += optind - 1;
+
+  if ((argc > 1) && !strcmp(argv[1], "list")) {
+    list_command(argc - 2, &(argv[2]));
+    return (statusG != S3StatusOK);
+  }
+  if ((argc > 1) && !strcmp(argv[1], "uploads")) {
+    uploads_command(argc - 2, &(argv[2]));
+    return (statusG != S3StatusOK);
+  }
+  if ((argc > 1) && !strcmp(argv[1], "abort")) {
+    abort_command(argc - 2, &(argv[2]));
+    return (statusG != S3StatusOK);
+  }
+  if ((argc > 1) && !strcmp(argv[1], "parts")) {
+    parts_command(argc - 2, &(argv[2]));
+    return (statusG != S3StatusOK);
+  }
+  if ((argc > 1) && !strcmp(argv[1], "delete")) {
+    delete_command(argc - 2, &(argv[2]));
+    return (statusG != S3StatusOK);
+  }
+  if ((argc > 1) && !strcmp(argv[1], "copy")) {
+    copy_command(argc - 2, &(argv[2]));
+    return (statusG != S3StatusOK);
+  }
+  if ((argc > 1) && !strcmp(argv[1], "sync")) {
+    sync_command(argc - 2, &(argv[2]));
+    return (statusG != S3StatusOK);
+  }
+  if ((argc > 1) && !strcmp(argv[1], "pack")) {
+    pack_command(argc - 2, &(argv[2]));
+    return (statusG != S3StatusOK);
+  }
+  if ((argc > 1) && !strcmp(argv[1], "unpack")) {
+    unpack_command(argc - 2, &(argv[2]));
+    return (statusG != S3StatusOK);
+  }
+  if ((argc > 1) && !strcmp(argv[1], "fetch")) {
+    fetch_command(argc - 2, &(argv[2]));
+    return (statusG != S3StatusOK);
+  }
+  if ((argc > 1) && !strcmp(argv[1], "cat")) {
+    cat_command(argc - 2, &(argv[2]));
+    return (statusG != S3StatusOK);
+  }
+  if ((argc > 1) && !strcmp(argv[1], "pread")) {
+    pread_command(argc - 2, &(argv[2]));
+    return (statusG != S3StatusOK);
+  }
+  if ((argc > 1) && !strcmp(argv[1], "put")) {
+    put_command(argc - 2, &(argv[2]));
+    return (statusG != S3StatusOK);
+  }
+
+  if ((argc > 1) && !strcmp(argv[1], "stream")) {
+    stream_command(argc - 2, &(argv[2]));
+    return (statusG != S3StatusOK);
+  }
+  if ((argc > 1) && !strcmp(argv[1], "presign")) {
+    presign_command(argc - 2, &(argv[2]));
+    return (statusG != S3StatusOK);
+  }
+
+  if (argc < 5) {
+    usageExit(stderr);
+  }
+
+  TransferOptions options = transferOptionsG;
+  int i;
+  for (i = 5; i < argc; i++) {
+    if (!transfer_options_param(&options, argv[i])) {
+      fprintf(stderr, "\nERROR: Unknown param: %s\n", argv[i]);
+      usageExit(stderr);
+    }
+  }
+
   const char *localFile = argv[1];
   const char *bucketName = argv[2];
   const char *key = argv[3];
-  put_object(localFile, bucketName, key);
+  put_object(localFile, bucketName, key, &options);
 
   const char *localReplica = argv[4];
-  get_object(localReplica, bucketName, key);
+  get_object(localReplica, bucketName, key, &options);
 }
 